@@ -1,19 +1,73 @@
 #include "mydbg.h"
 
+#include <algorithm>
+
 extern PROCESS_INFORMATION g_piDbgee;
 
-std::vector<BREAK_POINT> g_bp;
+std::map<DWORD64, BREAK_POINT> g_bp;     // <Address, Bp>
+std::vector<BP_PATTERN> g_bpPatterns;
+
+#define BP_BATCH_SPAN 4096              // Max bytes per batched read/write.
+
+bool LessBreakPointAddress(const BREAK_POINT &a, const BREAK_POINT &b)
+{
+  return a.address < b.address;
+}
 
 void AddBreakPoint_i(const std::string &fn, int LineNumber, DWORD64 addr)
 {
+  std::map<DWORD64, BREAK_POINT>::iterator it = g_bp.find(addr);
+  if (g_bp.end() != it) {               // Pattern bp here, code already saved.
+    it->second.fn = fn;
+    it->second.LineNumber = LineNumber;
+    it->second.pattern.clear();
+    return;
+  }
+
   BREAK_POINT bp;
   bp.fn = fn;
   bp.LineNumber = LineNumber;
   bp.address = addr;
-  ReadProcessMemory(g_piDbgee.hProcess, (LPVOID)addr, &bp.saveCode, 1, NULL);
-  g_bp.push_back(bp);
+  ReadDbgeeMemory(addr, &bp.saveCode, 1);
+  g_bp[addr] = bp;
   unsigned char cc = 0xcc;
-  WriteProcessMemory(g_piDbgee.hProcess, (LPVOID)addr, &cc, 1, NULL); // Write 0xcc to bp address.
+  WriteDbgeeMemory(addr, &cc, 1);      // Write 0xcc to bp address.
+}
+
+int AddBreakPoints(std::vector<BREAK_POINT> &bps)
+{
+  //
+  // Patch a set of bps with one read and one write per span of nearby
+  // addresses, instead of two memory calls per bp.
+  //
+
+  std::sort(bps.begin(), bps.end(), LessBreakPointAddress);
+  std::vector<unsigned char> buff(BP_BATCH_SPAN);
+  int nAdded = 0;
+  for (size_t i = 0; i < bps.size();) {
+    DWORD64 begin = bps[i].address;
+    size_t n = 0;
+    while (i + n < bps.size() && bps[i + n].address < begin + BP_BATCH_SPAN) {
+      n++;
+    }
+    SIZE_T size = (SIZE_T)(bps[i + n - 1].address - begin + 1);
+    if (ReadDbgeeMemory(begin, &buff[0], size)) {
+      for (size_t k = i; k < i + n; k++) {
+        BREAK_POINT &bp = bps[k];
+        if (g_bp.count(bp.address)) {
+          continue;                     // Already a bp, its 0xcc is in buff.
+        }
+        unsigned char &code = buff[(size_t)(bp.address - begin)];
+        bp.saveCode = code;
+        code = 0xcc;
+        g_bp[bp.address] = bp;
+        nAdded++;
+      }
+      WriteDbgeeMemory(begin, &buff[0], size);
+    }
+    i += n;
+  }
+  return nAdded;
 }
 
 bool AddBreakPoint(const std::string &fn, int LineNumber)
@@ -21,7 +75,7 @@ bool AddBreakPoint(const std::string &fn, int LineNumber)
   LONG displacement;
   IMAGEHLP_LINE64 li = { 0 };
   li.SizeOfStruct = sizeof(li);
-  if (SymGetLineFromName64(g_piDbgee.hProcess, NULL, (PSTR)fn.c_str(), LineNumber, &displacement, &li)) {
+  if (TRACE_CALL("SymGetLineFromName64", SymGetLineFromName64(g_piDbgee.hProcess, NULL, (PSTR)fn.c_str(), LineNumber, &displacement, &li))) {
     AddBreakPoint_i(fn, LineNumber, li.Address);
     printf("Add breakpoint at %s:%d(%x)\n", fn.c_str(), LineNumber, (unsigned int)li.Address);
     return true;
@@ -31,20 +85,23 @@ bool AddBreakPoint(const std::string &fn, int LineNumber)
 
 bool AddTempBreakPoint(DWORD64 addr)
 {
-  for (size_t i = 0; i < g_bp.size(); i++) {
-    const BREAK_POINT &bp = g_bp[i];
-    if (bp.address == addr) {
-      return false;
-    }
+  if (g_bp.count(addr)) {
+    return false;
   }
   AddBreakPoint_i("", 0, addr);
   return true;
 }
 
+void ClearBreakPoints()
+{
+  g_bp.clear();                         // Debuggee gone, no code to restore.
+  g_bpPatterns.clear();
+}
+
 bool FindBreakPoint(const std::string &fn, int LineNumber)
 {
-  for (size_t i = 0; i < g_bp.size(); i++) {
-    const BREAK_POINT &bp = g_bp[i];
+  for (std::map<DWORD64, BREAK_POINT>::const_iterator it = g_bp.begin(); g_bp.end() != it; ++it) {
+    const BREAK_POINT &bp = it->second;
     if (bp.LineNumber == LineNumber && bp.fn == fn) {
       return true;
     }
@@ -54,29 +111,98 @@ bool FindBreakPoint(const std::string &fn, int LineNumber)
 
 const BREAK_POINT* FindBreakPoint(DWORD64 addr)
 {
-  for (size_t i = 0; i < g_bp.size(); i++) {
-    const BREAK_POINT &bp = g_bp[i];
-    if (bp.address == addr) {
-      return &bp;
-    }
+  std::map<DWORD64, BREAK_POINT>::const_iterator it = g_bp.find(addr);
+  return g_bp.end() != it ? &it->second : NULL;
+}
+
+void RemoveBreakPoint_i(std::map<DWORD64, BREAK_POINT>::iterator it)
+{
+  const BREAK_POINT &bp = it->second;
+  WriteDbgeeMemory(bp.address, &bp.saveCode, 1); // Write back saved OP code.
+  g_bp.erase(it);
+}
+
+void RestoreOriginalCode(DWORD64 addr, LPVOID buff, SIZE_T size)
+{
+  //
+  // Put saved op codes back over 0xcc in memory read from debuggee.
+  //
+
+  std::map<DWORD64, BREAK_POINT>::const_iterator it = g_bp.lower_bound(addr);
+  for (; g_bp.end() != it && it->first < addr + size; ++it) {
+    ((unsigned char*)buff)[it->first - addr] = it->second.saveCode;
   }
-  return NULL;
 }
 
-void RemoveBreakPoint_i(int i)
+BOOL WriteDbgeeCode(DWORD64 addr, LPCVOID buff, SIZE_T size)
 {
-  const BREAK_POINT &bp = g_bp[i];
-  WriteProcessMemory(g_piDbgee.hProcess, (LPVOID)bp.address, &bp.saveCode, 1, NULL); // Write back saved OP code.
-  g_bp.erase(g_bp.begin() + i);
+  //
+  // Write over code that may hold our bps: the new bytes become their
+  // saved op codes and the 0xcc stay in memory.
+  //
+
+  if (0 == size) {
+    return TRUE;
+  }
+  std::vector<unsigned char> code((const unsigned char*)buff, (const unsigned char*)buff + size);
+  std::map<DWORD64, BREAK_POINT>::iterator first = g_bp.lower_bound(addr), it;
+  for (it = first; g_bp.end() != it && it->first < addr + size; ++it) {
+    code[(size_t)(it->first - addr)] = 0xcc;
+  }
+  if (!WriteDbgeeMemory(addr, &code[0], size)) {
+    return FALSE;
+  }
+  for (it = first; g_bp.end() != it && it->first < addr + size; ++it) {
+    it->second.saveCode = ((const unsigned char*)buff)[it->first - addr];
+  }
+  return TRUE;
+}
+
+int RemoveBreakPoints(const std::vector<DWORD64> &addrs)
+{
+  //
+  // Sorted addresses. Unpatched like AddBreakPoints patches, one read and
+  // one write per span.
+  //
+
+  std::vector<unsigned char> buff(BP_BATCH_SPAN);
+  int nRemoved = 0;
+  for (size_t i = 0; i < addrs.size();) {
+    DWORD64 begin = addrs[i];
+    size_t n = 0;
+    while (i + n < addrs.size() && addrs[i + n] < begin + BP_BATCH_SPAN) {
+      n++;
+    }
+    SIZE_T size = (SIZE_T)(addrs[i + n - 1] - begin + 1);
+    bool batch = ReadDbgeeMemory(begin, &buff[0], size) ? true : false;
+    for (size_t k = i; k < i + n; k++) {
+      std::map<DWORD64, BREAK_POINT>::iterator it = g_bp.find(addrs[k]);
+      if (g_bp.end() == it) {
+        continue;
+      }
+      if (batch) {
+        buff[(size_t)(addrs[k] - begin)] = it->second.saveCode;
+        g_bp.erase(it);
+      } else {
+        RemoveBreakPoint_i(it);         // Span not readable as one, alone.
+      }
+      nRemoved++;
+    }
+    if (batch) {
+      WriteDbgeeMemory(begin, &buff[0], size);
+    }
+    i += n;
+  }
+  return nRemoved;
 }
 
 bool RemoveBreakPoint(const std::string &fn, int LineNumber)
 {
-  for (size_t i = 0; i < g_bp.size(); i++) {
-    const BREAK_POINT &bp = g_bp[i];
+  for (std::map<DWORD64, BREAK_POINT>::iterator it = g_bp.begin(); g_bp.end() != it; ++it) {
+    const BREAK_POINT &bp = it->second;
     if (bp.LineNumber == LineNumber && bp.fn == fn) {
-      RemoveBreakPoint_i(i);
       printf("Remove breakpoint at %s:%d(%x)\n", fn.c_str(), LineNumber, (unsigned int)bp.address);
+      RemoveBreakPoint_i(it);
       return true;
     }
   }
@@ -85,14 +211,117 @@ bool RemoveBreakPoint(const std::string &fn, int LineNumber)
 
 bool RemoveTempBreakPoint(DWORD64 addr)
 {
-  for (size_t i = 0; i < g_bp.size(); i++) {
-    const BREAK_POINT &bp = g_bp[i];
-    if (bp.address == addr) {
-      RemoveBreakPoint_i(i);
+  std::map<DWORD64, BREAK_POINT>::iterator it = g_bp.find(addr);
+  if (g_bp.end() != it) {
+    RemoveBreakPoint_i(it);
+    return true;
+  }
+  return false;
+}
+
+static bool MatchSourcePattern(const std::string &pattern, const char *fn)
+{
+  if (!strpbrk(pattern.c_str(), "\\/")) {
+    const char *name = strrchr(fn, '\\');
+    fn = name ? name + 1 : fn;          // Match base name if pattern has no path.
+  }
+  return MatchWildcard(pattern.c_str(), fn, true);
+}
+
+struct BP_SOURCE_MATCH
+{
+  const std::string *pattern;
+  bool found;
+};
+
+static BOOL CALLBACK StaticMatchSourceFile(PSOURCEFILE pSourceFile, PVOID UserContext)
+{
+  BP_SOURCE_MATCH &m = *(BP_SOURCE_MATCH*)UserContext;
+  m.found = MatchSourcePattern(*m.pattern, pSourceFile->FileName);
+  return !m.found;                      // Stop at the first match.
+}
+
+int MatchPatternBreakPoints(const BP_PATTERN &pat, DWORD64 base)
+{
+  //
+  // Match one module's function index against a pattern, name pattern
+  // against function names, source pattern against each function's file.
+  // For a source pattern the module's file list is looked at first, only a
+  // module naming a matching file has its functions' lines resolved.
+  //
+
+  if (pat.source) {
+    BP_SOURCE_MATCH m = {&pat.pattern, false};
+    TRACE_CALL("SymEnumSourceFiles", SymEnumSourceFiles(g_piDbgee.hProcess, base, NULL, StaticMatchSourceFile, &m));
+    if (!m.found) {
+      return 0;
+    }
+  }
+
+  std::vector<SYM_INDEX_ENTRY> matches;
+  FindIndexSymbols(base, pat.source ? "*" : pat.pattern, matches);
+
+  std::vector<BREAK_POINT> bps;
+  for (size_t i = 0; i < matches.size(); i++) {
+    IMAGEHLP_LINE64 li = { 0 };
+    li.SizeOfStruct = sizeof(li);
+    DWORD displacement = 0;
+    if (!TRACE_CALL("SymGetLineFromAddr64", SymGetLineFromAddr64(g_piDbgee.hProcess, matches[i].address, &displacement, &li))) {
+      continue;                         // No source line, would never stop.
+    }
+    if (pat.source && !MatchSourcePattern(pat.pattern, li.FileName)) {
+      continue;
+    }
+    BREAK_POINT bp;
+    bp.fn = li.FileName;
+    bp.LineNumber = li.LineNumber;
+    bp.address = matches[i].address;
+    bp.pattern = pat.pattern;
+    bps.push_back(bp);
+  }
+  return AddBreakPoints(bps);
+}
+
+void ApplyPatternBreakPoints(DWORD64 base)
+{
+  for (size_t i = 0; i < g_bpPatterns.size(); i++) {
+    int n = MatchPatternBreakPoints(g_bpPatterns[i], base);
+    if (n) {
+      printf("\tAdd %d breakpoints for %s\n", n, g_bpPatterns[i].pattern.c_str());
+    }
+  }
+}
+
+bool ToggleBreakPointPattern(const std::string &pattern, bool source)
+{
+  for (size_t i = 0; i < g_bpPatterns.size(); i++) {
+    if (g_bpPatterns[i].pattern == pattern && g_bpPatterns[i].source == source) {
+      std::vector<DWORD64> addrs;
+      for (std::map<DWORD64, BREAK_POINT>::const_iterator it = g_bp.begin(); g_bp.end() != it; ++it) {
+        if (it->second.pattern == pattern) {
+          addrs.push_back(it->first);
+        }
+      }
+      int n = RemoveBreakPoints(addrs);
+      g_bpPatterns.erase(g_bpPatterns.begin() + i);
+      printf("Remove %d breakpoints for %s\n", n, pattern.c_str());
       return true;
     }
   }
-  return false;
+
+  BP_PATTERN pat;
+  pat.pattern = pattern;
+  pat.source = source;
+  g_bpPatterns.push_back(pat);
+
+  std::vector<DWORD64> bases;
+  GetIndexModules(bases);
+  int n = 0;
+  for (size_t i = 0; i < bases.size(); i++) {
+    n += MatchPatternBreakPoints(pat, bases[i]);
+  }
+  printf("Add %d breakpoints for %s, pending for new modules\n", n, pattern.c_str());
+  return true;
 }
 
 bool ToggleBreakPoint(DWORD64 addr)
@@ -110,7 +339,7 @@ bool ToggleBreakPoint(const std::string &func)
 {
   SYMBOL_INFO sym = {0};
   sym.SizeOfStruct = sizeof(sym);
-  if (SymFromName(g_piDbgee.hProcess, (LPSTR)func.c_str(), &sym)) {
+  if (TRACE_CALL("SymFromName", SymFromName(g_piDbgee.hProcess, (LPSTR)func.c_str(), &sym))) {
     return ToggleBreakPoint(sym.Address);
   }
   return false;
@@ -0,0 +1,144 @@
+#include "mydbg.h"
+#include "mydbghelp.h"
+
+extern int g_dbgState;
+extern DWORD g_stepTid;
+extern PROCESS_INFORMATION g_piDbgee;
+extern DEBUG_TARGET *g_target;
+extern DEBUG_TARGET g_dumpTarget;
+
+#define DR7_LE 0x100                    // With TF, Windows sets DebugCtl.BTF.
+
+//
+// Branch stepping for t and p. With DebugCtl.BTF set TF traps only after
+// taken branches, so the straight-line code of a line runs free. Each trap
+// checks the line's address range, a jump inside the line goes on. The
+// line's fall-through end gets a temp bp, as no branch marks it. Stepping
+// over, a call out of the line runs to its return address. A CPU or
+// hypervisor that ignores BTF just traps on every instruction again, the
+// range check keeps that correct.
+//
+
+bool g_branchStep = true;
+
+bool SetStepMode(const std::string &mode)
+{
+  if (0 == _stricmp(mode.c_str(), "btf")) {
+    g_branchStep = true;
+  } else if (0 == _stricmp(mode.c_str(), "tf")) {
+    g_branchStep = false;
+  } else {
+    printf("unknown step mode %s\n", mode.c_str());
+    return false;
+  }
+  printf("step mode %s\n", g_branchStep ? "btf" : "tf");
+  return true;
+}
+
+static void SetBranchStepFlags(bool on)
+{
+  CONTEXT ctx;
+  ctx.ContextFlags = CONTEXT_CONTROL | CONTEXT_DEBUG_REGISTERS;
+  GetDbgeeContext(ctx);
+  if (on) {
+    ctx.EFlags |= 0x100;
+    ctx.Dr7 |= DR7_LE;
+  } else {
+    ctx.EFlags &= ~0x100;
+    ctx.Dr7 &= ~DR7_LE;
+  }
+  SetDbgeeContext(ctx);
+}
+
+bool IsBranchStepping()
+{
+  return 0 != GetCurrThread()->lineEnd;
+}
+
+bool BeginBranchStep()
+{
+  //
+  // Address range of the current line: its first address to the next
+  // line's.
+  //
+
+  if (!g_branchStep || &g_dumpTarget == g_target) {
+    return false;
+  }
+  DWORD displacement;
+  IMAGEHLP_LINE64 li = {0};
+  li.SizeOfStruct = sizeof(li);
+  if (!TRACE_CALL("SymGetLineFromAddr64", SymGetLineFromAddr64(g_piDbgee.hProcess, GetCurrIp(), &displacement, &li))) {
+    return false;
+  }
+  DWORD64 begin = li.Address;
+  if (!TRACE_CALL("SymGetLineNext64", SymGetLineNext64(g_piDbgee.hProcess, &li)) || li.Address <= GetCurrIp()) {
+    return false;
+  }
+  DBG_THREAD *th = GetCurrThread();
+  th->lineBegin = begin;
+  th->lineEnd = li.Address;
+  th->lineEndBp = AddTempBreakPoint(th->lineEnd); // A bp already there stops anyway.
+  return true;
+}
+
+void DoBranchStep(int state)
+{
+  SetBranchStepFlags(true);
+  Continue();
+  g_dbgState = state;
+}
+
+bool HandleBranchStep()
+{
+  DBG_THREAD *th = GetCurrThread();
+  DWORD64 ip = GetCurrIp();
+  if (ip >= th->lineBegin && ip < th->lineEnd) {
+    DoBranchStep(g_dbgState);           // Jump inside the line.
+    return true;
+  }
+
+  if (DBGS_STEP_OVER == g_dbgState && ip != th->lineEnd) {
+    CONTEXT ctx;
+    ctx.ContextFlags = CONTEXT_CONTROL;
+    GetDbgeeContext(ctx);
+    DWORD ret = 0;
+    if (ReadDbgeeMemory(ctx.Esp, &ret, sizeof(ret)) && ret > th->lineBegin && ret <= th->lineEnd) {
+      SetBranchStepFlags(false);        // Called from the line, run to its return.
+      th->tmpBpAddr = AddTempBreakPoint(ret) ? ret : 0;
+      Continue();
+      g_dbgState = DBGS_STEP_OVER;
+      return true;
+    }
+  }
+
+  std::string fn;
+  int LineNumber = 0;
+  if (!IsCurrSourceLineChanged(fn, LineNumber)) {
+    DoBranchStep(g_dbgState);           // No source here yet, or same line elsewhere.
+    return true;
+  }
+  return false;
+}
+
+void EndStep()
+{
+  //
+  // A step stopped, whatever stopped it.
+  //
+
+  EndStepStats();
+  DBG_THREAD *th = FindDbgeeThread(g_stepTid); // Another thread may have stopped it.
+  if (!th || 0 == th->lineEnd) {
+    return;
+  }
+  if (th->lineEndBp) {
+    RemoveTempBreakPoint(th->lineEnd);
+  }
+  DWORD tid = GetCurrThreadId();
+  SetCurrThread(th->tid);
+  SetBranchStepFlags(false);
+  SetCurrThread(tid);
+  th->lineBegin = th->lineEnd = 0;
+  th->lineEndBp = false;
+}
@@ -4,45 +4,64 @@
 extern int g_dbgState;
 extern PROCESS_INFORMATION g_piDbgee;
 extern DEBUG_EVENT g_debugEvent;
+extern DWORD g_continueStatus;
 
-std::string g_LastBreakSource;
-int g_LastBreakLine;
-
-DWORD64 g_tmpBpAddr;
+DWORD g_stepTid;                        // Thread being stepped.
 
 void ClearCpuSingleStepFlag()
 {
   CONTEXT ctx;
   ctx.ContextFlags = CONTEXT_CONTROL;
-  GetThreadContext(g_piDbgee.hThread, &ctx);
+  GetDbgeeContext(ctx);
   if (ctx.EFlags & 0x100) {
     ctx.EFlags ^= 0x100;
-    SetThreadContext(g_piDbgee.hThread, &ctx);
+    SetDbgeeContext(ctx);
   }
 }
 
 void Continue()
 {
   g_dbgState = DBGS_NONE;
-  ContinueDebugEvent(g_debugEvent.dwProcessId, g_debugEvent.dwThreadId, DBG_CONTINUE);
+  ResetFmtArena();                      // Display strings of this stop go.
+  StepOffBreakPoint();
+  if (ResumeHeldThread()) {
+    return;                             // Non-stop, its event was continued when held.
+  }
+  ContinueDbgeeEvent(g_continueStatus);
 }
 
-void DumpCallStacks()
+static BOOL CALLBACK ReadDbgeeMemoryRoutine(HANDLE, DWORD64 addr, PVOID buff, DWORD size, LPDWORD read)
 {
-  CONTEXT ctx;
-  ctx.ContextFlags = CONTEXT_FULL;
-  GetThreadContext(g_piDbgee.hThread, &ctx);
+  if (!ReadDbgeeMemory(addr, buff, size)) {
+    return FALSE;
+  }
+  *read = size;
+  return TRUE;
+}
 
-  STACKFRAME sf = {0};
+void InitStackFrame(const CONTEXT &ctx, STACKFRAME64 &sf)
+{
+  memset(&sf, 0, sizeof(sf));
   sf.AddrPC.Offset = ctx.Eip;
   sf.AddrPC.Mode = AddrModeFlat;
   sf.AddrStack.Offset = ctx.Esp;
   sf.AddrStack.Mode = AddrModeFlat;
   sf.AddrFrame.Offset = ctx.Ebp;
   sf.AddrFrame.Mode = AddrModeFlat;
+}
+
+bool WalkStack(STACKFRAME64 &sf, CONTEXT &ctx)
+{
+  return FALSE != TRACE_CALL("StackWalk64", StackWalk64(IMAGE_FILE_MACHINE_I386, g_piDbgee.hProcess, GetCurrThreadHandle(), &sf, &ctx, ReadDbgeeMemoryRoutine, SymFunctionTableAccess64, SymGetModuleBase64, 0));
+}
+
+void DumpCallStack(CONTEXT ctx)
+{
+  STACKFRAME64 sf;
+  InitStackFrame(ctx, sf);
 
   while (true) {
-    if (!StackWalk(IMAGE_FILE_MACHINE_I386, g_piDbgee.hProcess, g_piDbgee.hThread, &sf, &ctx, 0, SymFunctionTableAccess, SymGetModuleBase, 0)) {
+    if (!WalkStack(sf, ctx)) {
       break;
     }
 
@@ -54,7 +73,7 @@ void DumpCallStacks()
     IMAGEHLP_LINE64 li = {0};
     li.SizeOfStruct = sizeof(li);
 
-    if (!SymGetLineFromAddr64(g_piDbgee.hProcess, sf.AddrPC.Offset, &displacement, &li)) {
+    if (!TRACE_CALL("SymGetLineFromAddr64", SymGetLineFromAddr64(g_piDbgee.hProcess, sf.AddrPC.Offset, &displacement, &li))) {
       printf("0x%x\n", (unsigned int)sf.AddrPC.Offset);
     } else {
       char buff[sizeof(SYMBOL_INFO) + 256] = {0};
@@ -62,7 +81,7 @@ void DumpCallStacks()
       psi->SizeOfStruct = sizeof(SYMBOL_INFO);
       psi->MaxNameLen = 256;
       DWORD64 displacement2 = 0;
-      if (!SymFromAddr(g_piDbgee.hProcess, sf.AddrPC.Offset, &displacement2, psi)) {
+      if (!TRACE_CALL("SymFromAddr", SymFromAddr(g_piDbgee.hProcess, sf.AddrPC.Offset, &displacement2, psi))) {
         printf("%s:%d\n", li.FileName, li.LineNumber);
       } else {
         printf("%s:%d!%s\n", li.FileName, li.LineNumber, psi->Name);
@@ -71,169 +90,174 @@ void DumpCallStacks()
   }
 }
 
+void DumpCallStacks()
+{
+  CONTEXT ctx;
+  ctx.ContextFlags = CONTEXT_FULL;
+  GetDbgeeContext(ctx);
+  DumpCallStack(ctx);
+}
+
 ULONG64 GetVariableAddress(PSYMBOL_INFO pSymInfo)
 {
   if (pSymInfo->Flags & SYMFLAG_REGREL) {
     CONTEXT ctx;
     ctx.ContextFlags = CONTEXT_CONTROL;
-    GetThreadContext(g_piDbgee.hThread, &ctx);
+    GetDbgeeContext(ctx);
     return ctx.Ebp + pSymInfo->Address; // In 32-bits mode, variable address is related to EBP.
   } else {
     return pSymInfo->Address;
   }
 }
 
-std::string GetBaseTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
+STR_VIEW GetBaseTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
 {
   DWORD type;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_BASETYPE, &type);
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_BASETYPE, &type));
   ULONG64 length;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_LENGTH, &length);
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_LENGTH, &length));
   switch (type) {
     case btVoid:
-      return "void";
+      return FmtView("void");
     case btChar:
-      return "char";
+      return FmtView("char");
     case btWChar:
-      return "wchar_t";
+      return FmtView("wchar_t");
     case btInt:
       switch (length) {
         case 2:
-          return "short";
+          return FmtView("short");
         case 8:
-          return "long long";
+          return FmtView("long long");
       }
-      return "int";
+      return FmtView("int");
     case btUInt:
       switch (length) {
         case 1:
-          return "unsigned char";
+          return FmtView("unsigned char");
         case 2:
-          return "unsigned short";
+          return FmtView("unsigned short");
         case 8:
-          return "unsigned long long";
+          return FmtView("unsigned long long");
       }
-      return "unsigned int";
+      return FmtView("unsigned int");
     case btFloat:
       if (8 == length) {
-        return "double";
+        return FmtView("double");
       }
-      return "float";
+      return FmtView("float");
     case btBool:
-      return "bool";
+      return FmtView("bool");
     case btLong:
-      return "long";
+      return FmtView("long");
     case btULong:
-      return "unsigned long";
+      return FmtView("unsigned long");
   }
-  return "BaseType";
+  return FmtView("BaseType");
 }
 
-std::string GetBaseTypeValue(ULONG typeId, PSYMBOL_INFO pSymInfo, const char *pData)
+STR_VIEW GetBaseTypeValue(ULONG typeId, PSYMBOL_INFO pSymInfo, const char *pData)
 {
   DWORD type;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_BASETYPE, &type);
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_BASETYPE, &type));
   ULONG64 length;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_LENGTH, &length);
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_LENGTH, &length));
   char buff[32];
   switch (type) {
     case btChar:
-      sprintf(buff, "%c", *pData);
-      return buff;
+      return FmtCopy(pData, 1);
     case btWChar:
-      sprintf(buff, "%d", (int)*pData);
-      return buff;
+      return FmtNumber(*pData);
     case btInt:
       switch (length) {
         case 2:
-          sprintf(buff, "%d", (int)*(short*)pData);
-          return buff;
+          return FmtNumber(*(short*)pData);
         case 8:
-          sprintf(buff, "%I64d", *(long long*)pData);
-          return buff;
+          return FmtNumber(*(long long*)pData);
       }
-      sprintf(buff, "%d", *(int*)pData);
-      return buff;
+      return FmtNumber(*(int*)pData);
     case btUInt:
       switch (length) {
         case 1:
-          sprintf(buff, "%u", (unsigned int)*pData);
-          return buff;
+          return FmtUNumber((unsigned char)*pData, "", 10);
         case 2:
-          sprintf(buff, "%u", (unsigned int)*(unsigned short*)pData);
-          return buff;
+          return FmtUNumber(*(unsigned short*)pData, "", 10);
         case 8:
-          sprintf(buff, "%I64u", *(unsigned long long*)pData);
-          return buff;
+          return FmtUNumber(*(unsigned long long*)pData, "", 10);
       }
-      sprintf(buff, "%u", *(unsigned int*)pData);
-      return buff;
+      return FmtUNumber(*(unsigned int*)pData, "", 10);
     case btFloat:
       if (8 == length) {
         sprintf(buff, "%lf", *(double*)pData);
       } else {
         sprintf(buff, "%f", *(float*)pData);
       }
-      return buff;
+      return FmtCopy(buff, strlen(buff));
     case btBool:
       if (0 == *pData) {
-        return "true";
+        return FmtView("true");
       } else {
-        return "false";
+        return FmtView("false");
       }
     case btLong:
-      sprintf(buff, "%l", *(long*)pData);
-      return buff;
+      return FmtNumber(*(long*)pData);
     case btULong:
-      sprintf(buff, "%lu", *(unsigned long*)pData);
-      return buff;
+      return FmtUNumber(*(unsigned long*)pData, "", 10);
   }
-  return "";
+  return FmtView("");
 }
 
-std::string GetArrayTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
+STR_VIEW GetArrayTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
 {
   DWORD containTypeId;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_TYPEID, &containTypeId);
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_TYPEID, &containTypeId));
   DWORD count;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_COUNT, &count);
-  std::string typeName = GetVariableTypeName(containTypeId, pSymInfo);
-  char buff[64];
-  sprintf(buff, "%u", (unsigned int)count);
-  return typeName + "[" + buff + "]";
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_COUNT, &count));
+  STR_VIEW typeName = GetVariableTypeName(containTypeId, pSymInfo);
+  char buff[16] = "[";
+  char *end = FmtUInt(buff + 1, buff + sizeof(buff) - 1, count, 10);
+  *end++ = ']';
+  STR_VIEW dim = {buff, (size_t)(end - buff)};
+  return FmtCat(typeName, dim, FmtView(""));
 }
 
-std::string GetPointTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
+STR_VIEW GetPointTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
 {
   DWORD containTypeId;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_TYPEID, &containTypeId);
-  std::string typeName = GetVariableTypeName(containTypeId, pSymInfo);
-  return typeName + "*";
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_TYPEID, &containTypeId));
+  STR_VIEW typeName = GetVariableTypeName(containTypeId, pSymInfo);
+  return FmtCat(typeName, FmtView("*"), FmtView(""));
 }
 
-std::string GetUdtTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
+STR_VIEW GetUdtTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
 {
   WCHAR *pName;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_SYMNAME, &pName);
+  if (!TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_SYMNAME, &pName))) {
+    return FmtView("");
+  }
   int NeedLen = WideCharToMultiByte(CP_ACP, 0, pName, -1, NULL, 0, NULL, NULL);
-  std::string buff;
-  buff.resize(NeedLen);
-  WideCharToMultiByte(CP_ACP, 0, pName, -1, (char*)buff.c_str(), NeedLen, NULL, NULL);
+  char *buff = 0 < NeedLen ? FmtAlloc(NeedLen) : NULL;
+  STR_VIEW name = FmtView("");
+  if (buff) {
+    WideCharToMultiByte(CP_ACP, 0, pName, -1, buff, NeedLen, NULL, NULL);
+    name.p = buff;
+    name.n = NeedLen - 1;
+  }
   LocalFree(pName);
-  return buff;
+  return name;
 }
 
-std::string GetVariableTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
+STR_VIEW GetVariableTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
 {
   // https://debuginfo.com/articles/dbghelptypeinfo.html
   DWORD symTag;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_SYMTAG, &symTag);
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_SYMTAG, &symTag));
   switch (symTag) {
     case SymTagUDT:
     case SymTagEnum:
       return GetUdtTypeName(typeId, pSymInfo);
     case SymTagFunctionType:
-      return "<func>";
+      return FmtView("<func>");
     case SymTagPointerType:
       return GetPointTypeName(typeId, pSymInfo);
     case SymTagArrayType:
@@ -241,64 +265,260 @@ std::string GetVariableTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo)
     case SymTagBaseType:
       return GetBaseTypeName(typeId, pSymInfo);
   }
-  char buff[32];
-  sprintf(buff, "<unknown>%d", (int)symTag);
-  return buff;
+  return FmtCat(FmtView("<unknown>"), FmtNumber((int)symTag), FmtView(""));
 }
 
-std::string GetVariableValue(ULONG typeId, PSYMBOL_INFO pSymInfo, const std::string &data)
+STR_VIEW GetVariableValue(ULONG typeId, PSYMBOL_INFO pSymInfo, const char *data, size_t size)
 {
   DWORD symTag;
-  SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_SYMTAG, &symTag);
-  char buff[32];
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, pSymInfo->ModBase, typeId, TI_GET_SYMTAG, &symTag));
   switch (symTag) {
     case SymTagBaseType:
-      return GetBaseTypeValue(typeId, pSymInfo, data.data());
+      return GetBaseTypeValue(typeId, pSymInfo, data);
     case SymTagPointerType:
-      sprintf(buff, "0x%x", *(unsigned int*)data.data());
-      return buff;
-  }
-  std::string value;
-  for (size_t i = 0; i < data.size(); i++) {
-    sprintf(buff, "%02x ", (unsigned char)data[i]);
-    value += buff;
+      return FmtUNumber(*(unsigned int*)data, "0x", 16);
   }
-  return value;
+  return FmtHexBytes(data, size);
 }
 
 static BOOL CALLBACK StaticEnumLocals(PSYMBOL_INFO pSymInfo, ULONG SymbolSize, PVOID UserContext)
 {
   if (SymTagData == pSymInfo->Tag) {
     ULONG64 addr = GetVariableAddress(pSymInfo);
-    std::string mem;
-    mem.resize(SymbolSize);
-    ReadProcessMemory(g_piDbgee.hProcess, (LPCVOID)addr, (LPVOID)mem.data(), SymbolSize, NULL);
-    std::string value = GetVariableValue(pSymInfo->TypeIndex, pSymInfo, mem);
-    std::string type = GetVariableTypeName(pSymInfo->TypeIndex, pSymInfo);
-    printf("%08x %s %s %s\n", (unsigned int)addr, type.c_str(), pSymInfo->Name, value.c_str());
+    char *mem = FmtAlloc(SymbolSize);
+    if (!mem) {
+      return TRUE;
+    }
+    memset(mem, 0, SymbolSize);
+    ReadDbgeeMemory(addr, mem, SymbolSize);
+    STR_VIEW value = GetVariableValue(pSymInfo->TypeIndex, pSymInfo, mem, SymbolSize);
+    STR_VIEW type = GetVariableTypeName(pSymInfo->TypeIndex, pSymInfo);
+    printf("%08x %s %s %s\n", (unsigned int)addr, type.p, pSymInfo->Name, value.p);
   }
   return TRUE;
 }
 
 void DumpGlobals()
 {
-  DWORD64 BaseMod = SymGetModuleBase64(g_piDbgee.hProcess, GetCurrIp());
-  SymEnumSymbols(g_piDbgee.hProcess, BaseMod, NULL, StaticEnumLocals, NULL);
+  DWORD64 BaseMod = TRACE_CALL("SymGetModuleBase64", SymGetModuleBase64(g_piDbgee.hProcess, GetCurrIp()));
+  TRACE_CALL("SymEnumSymbols", SymEnumSymbols(g_piDbgee.hProcess, BaseMod, NULL, StaticEnumLocals, NULL));
 }
 
-void DumpLocals()
+//
+// Locals are enumerated once per (function, innermost block) scope and kept
+// with their decoded layout. Later dumps in the same scope only re-read the
+// frame bytes and compare them with the previous dump.
+//
+
+struct LOCAL_VAR
 {
+  std::string name;
+  std::string type;
+  bool regRel;
+  DWORD64 address;                      // EBP offset if regRel.
+  ULONG typeId;
+  ULONG size;
+};
+
+struct LOCALS_SCOPE
+{
+  DWORD64 modBase;
+  std::vector<LOCAL_VAR> vars;
+  LONG frameBegin, frameEnd;            // EBP relative range of all regRel vars.
+  DWORD64 ebp;                          // Frame of last dump, 0 if none.
+  std::string frame;                    // Frame bytes of last dump.
+  std::vector<std::string> statics;     // Non regRel values of last dump.
+};
+
+typedef std::pair<DWORD64, DWORD64> ScopeKey_t; // <Function, Block>
+typedef std::vector<std::pair<DWORD64, DWORD64> > BlockRanges_t; // [<Address, Length>]
+
+std::map<ScopeKey_t, LOCALS_SCOPE> g_localsCache;
+std::map<DWORD64, BlockRanges_t> g_blockCache; // <Function, Blocks>
+
+void GetBlockRanges(DWORD64 modBase, ULONG index, BlockRanges_t &blocks)
+{
+  DWORD count = 0;
+  TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, modBase, index, TI_GET_CHILDRENCOUNT, &count));
+  if (0 == count) {
+    return;
+  }
+  std::vector<char> buff(sizeof(TI_FINDCHILDREN_PARAMS) + count * sizeof(ULONG));
+  TI_FINDCHILDREN_PARAMS *params = (TI_FINDCHILDREN_PARAMS*)&buff[0];
+  params->Count = count;
+  params->Start = 0;
+  if (!TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, modBase, index, TI_FINDCHILDREN, params))) {
+    return;
+  }
+  for (DWORD i = 0; i < count; i++) {
+    DWORD tag = 0;
+    TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, modBase, params->ChildId[i], TI_GET_SYMTAG, &tag));
+    if (SymTagBlock == tag) {
+      ULONG64 address = 0, length = 0;
+      TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, modBase, params->ChildId[i], TI_GET_ADDRESS, &address));
+      TRACE_CALL("SymGetTypeInfo", SymGetTypeInfo(g_piDbgee.hProcess, modBase, params->ChildId[i], TI_GET_LENGTH, &length));
+      blocks.push_back(std::make_pair((DWORD64)address, (DWORD64)length));
+      GetBlockRanges(modBase, params->ChildId[i], blocks);
+    }
+  }
+}
+
+bool GetLocalsScope(DWORD64 ip, ScopeKey_t &key)
+{
+  char buff[sizeof(SYMBOL_INFO) + 256] = {0};
+  SYMBOL_INFO *psi = (SYMBOL_INFO*)buff;
+  psi->SizeOfStruct = sizeof(SYMBOL_INFO);
+  psi->MaxNameLen = 256;
+  DWORD64 displacement = 0;
+  if (!TRACE_CALL("SymFromAddr", SymFromAddr(g_piDbgee.hProcess, ip, &displacement, psi))) {
+    return false;
+  }
+
+  std::map<DWORD64, BlockRanges_t>::iterator it = g_blockCache.find(psi->Address);
+  if (g_blockCache.end() == it) {
+    it = g_blockCache.insert(std::make_pair(psi->Address, BlockRanges_t())).first;
+    GetBlockRanges(psi->ModBase, psi->Index, it->second);
+  }
+
+  key = ScopeKey_t(psi->Address, 0);
+  DWORD64 innermost = (DWORD64)-1;
+  for (size_t i = 0; i < it->second.size(); i++) {
+    const std::pair<DWORD64, DWORD64> &b = it->second[i];
+    if (ip >= b.first && ip < b.first + b.second && b.second < innermost) {
+      key.second = b.first;
+      innermost = b.second;
+    }
+  }
+  return true;
+}
+
+static BOOL CALLBACK StaticCollectLocals(PSYMBOL_INFO pSymInfo, ULONG SymbolSize, PVOID UserContext)
+{
+  if (SymTagData == pSymInfo->Tag) {
+    LOCALS_SCOPE &scope = *(LOCALS_SCOPE*)UserContext;
+    LOCAL_VAR v;
+    v.name = pSymInfo->Name;
+    v.type = GetVariableTypeName(pSymInfo->TypeIndex, pSymInfo).p;
+    v.regRel = 0 != (pSymInfo->Flags & SYMFLAG_REGREL);
+    v.address = pSymInfo->Address;
+    v.typeId = pSymInfo->TypeIndex;
+    v.size = SymbolSize;
+    scope.modBase = pSymInfo->ModBase;
+    scope.vars.push_back(v);
+  }
+  return TRUE;
+}
+
+LOCALS_SCOPE* GetLocalsLayout(DWORD64 ip)
+{
+  ScopeKey_t key;
+  if (!GetLocalsScope(ip, key)) {
+    return NULL;
+  }
+  std::map<ScopeKey_t, LOCALS_SCOPE>::iterator it = g_localsCache.find(key);
+  if (g_localsCache.end() != it) {
+    return &it->second;
+  }
+
+  LOCALS_SCOPE &scope = g_localsCache[key];
+  scope.modBase = 0;
+  scope.ebp = 0;
   IMAGEHLP_STACK_FRAME sf = {0};
-  sf.InstructionOffset = GetCurrIp();
-  SymSetContext(g_piDbgee.hProcess, &sf, NULL);
-  SymEnumSymbols(g_piDbgee.hProcess, 0, NULL, StaticEnumLocals, NULL);
+  sf.InstructionOffset = ip;
+  TRACE_CALL("SymSetContext", SymSetContext(g_piDbgee.hProcess, &sf, NULL));
+  TRACE_CALL("SymEnumSymbols", SymEnumSymbols(g_piDbgee.hProcess, 0, NULL, StaticCollectLocals, &scope));
+
+  scope.frameBegin = scope.frameEnd = 0;
+  bool first = true;
+  for (size_t i = 0; i < scope.vars.size(); i++) {
+    const LOCAL_VAR &v = scope.vars[i];
+    if (v.regRel) {
+      LONG begin = (LONG)v.address, end = begin + (LONG)v.size;
+      scope.frameBegin = first ? begin : (std::min)(scope.frameBegin, begin);
+      scope.frameEnd = first ? end : (std::max)(scope.frameEnd, end);
+      first = false;
+    }
+  }
+  return &scope;
+}
+
+void DumpLocals(bool ChangedOnly)
+{
+  CONTEXT ctx;
+  ctx.ContextFlags = CONTEXT_CONTROL;
+  GetDbgeeContext(ctx);
+  LOCALS_SCOPE *scope = GetLocalsLayout(ctx.Eip);
+  if (!scope) {
+    return;
+  }
+
+  //
+  // One read for the whole frame. Previous bytes only compare when the
+  // frame is the same, a recursive or new call shows everything.
+  //
+
+  size_t frameSize = scope->frameEnd - scope->frameBegin;
+  char *frame = FmtAlloc(frameSize);
+  if (!frame) {
+    return;
+  }
+  if (frameSize) {
+    ReadDbgeeMemory(ctx.Ebp + scope->frameBegin, frame, frameSize);
+  }
+  bool sameFrame = scope->ebp == ctx.Ebp && scope->frame.size() == frameSize;
+  scope->statics.resize(scope->vars.size());
+
+  SYMBOL_INFO si = {0};
+  si.SizeOfStruct = sizeof(si);
+  si.ModBase = scope->modBase;
+  int nUnchanged = 0;
+  for (size_t i = 0; i < scope->vars.size(); i++) {
+    const LOCAL_VAR &v = scope->vars[i];
+    ULONG64 addr;
+    const char *mem;
+    bool changed;
+    if (v.regRel) {
+      addr = ctx.Ebp + v.address;
+      size_t off = (size_t)((LONG)v.address - scope->frameBegin);
+      mem = frame + off;
+      changed = !sameFrame || 0 != memcmp(scope->frame.data() + off, mem, v.size);
+    } else {
+      addr = v.address;
+      char *buff = FmtAlloc(v.size);
+      if (!buff) {
+        continue;
+      }
+      memset(buff, 0, v.size);
+      ReadDbgeeMemory(addr, buff, v.size);
+      mem = buff;
+      changed = !sameFrame || scope->statics[i].size() != v.size || 0 != memcmp(scope->statics[i].data(), mem, v.size);
+      scope->statics[i].assign(mem, v.size); // Same size each time, no allocation after the first.
+    }
+    if (ChangedOnly && !changed) {
+      nUnchanged++;
+      continue;
+    }
+    STR_VIEW value = GetVariableValue(v.typeId, &si, mem, v.size);
+    printf("%08x %s %s %s\n", (unsigned int)addr, v.type.c_str(), v.name.c_str(), value.p);
+  }
+  if (nUnchanged) {
+    printf("(%d unchanged)\n", nUnchanged);
+  }
+  scope->ebp = ctx.Ebp;
+  scope->frame.assign(frame, frameSize);
+}
+
+void ClearLocalsCache()
+{
+  g_localsCache.clear();
+  g_blockCache.clear();
 }
 
 DWORD64 GetCurrIp()
 {
   CONTEXT ctx;
   ctx.ContextFlags = CONTEXT_CONTROL;
-  GetThreadContext(g_piDbgee.hThread, &ctx);
+  GetDbgeeContext(ctx);
   return ctx.Eip;
 }
 
@@ -307,7 +527,7 @@ bool GetSourceLineByAddr(DWORD64 Addr, std::string &fn, int &LineNumber, DWORD &
   IMAGEHLP_LINE64 li = {0};
   li.SizeOfStruct = sizeof(li);
 
-  if (!SymGetLineFromAddr64(g_piDbgee.hProcess, Addr, &displacement, &li)) {
+  if (!TRACE_CALL("SymGetLineFromAddr64", SymGetLineFromAddr64(g_piDbgee.hProcess, Addr, &displacement, &li))) {
     DWORD ec = GetLastError();
     switch (ec) {
       case 126:
@@ -335,29 +555,19 @@ bool IsCurrSourceLineChanged(std::string &fn, int &LineNumber)
   if (!GetSourceLineByAddr(GetCurrIp(), fn, LineNumber, displacement)) {
     return false;
   } else {
-    return fn != g_LastBreakSource || LineNumber != g_LastBreakLine;
+    const DBG_THREAD *th = GetCurrThread();
+    return fn != th->lastBreakSource || LineNumber != th->lastBreakLine;
   }
 }
 
-bool HandleSoftBreakSingleStep(const BREAK_POINT* bp)
-{
-  // 1. write back 0xcc
-  // 2. enter break
-
-  unsigned char cc = 0xcc;
-  WriteProcessMemory(g_piDbgee.hProcess, (LPVOID)bp->address, &cc, 1, NULL); // Write 0xcc to bp address.
-
-  return true;
-}
-
 void SetCpuSingleStepFlag()
 {
   CONTEXT ctx;
   ctx.ContextFlags = CONTEXT_CONTROL;
-  GetThreadContext(g_piDbgee.hThread, &ctx);
+  GetDbgeeContext(ctx);
   if (!(ctx.EFlags & 0x100)) {
     ctx.EFlags |= 0x100;                // Enable single-step flag.
-    SetThreadContext(g_piDbgee.hThread, &ctx);
+    SetDbgeeContext(ctx);
   }
 }
 
@@ -374,6 +584,10 @@ bool HandleStepIntoSingleStep()
   // Single step loop until current source line is different to saved source line.
   //
 
+  if (IsBranchStepping()) {
+    return HandleBranchStep();
+  }
+
   std::string fn;
   int LineNumber = 0;
   if (!IsCurrSourceLineChanged(fn, LineNumber)) {
@@ -387,75 +601,67 @@ bool HandleStepIntoSingleStep()
 bool HandleStepOutBreak(const BREAK_POINT *bp)
 {
   //
-  // 1. handle soft break as usual.
-  // 2. remove temp bp.
-  // 3. do a step into(until IsCurrSourceLineChanged).
+  // Temp bp at the return address hit:
+  // 1. stack below the frame stepped out, a deeper recursive call returned
+  //    here, keep going, the bp stays armed.
+  // 2. otherwise the frame returned, stop here.
+  // Any other bp ends the step out and stops as usual.
   //
 
-  if (bp && HandleSoftBreak(bp)) {
-    RemoveTempBreakPoint(g_tmpBpAddr);
-    StepInto();
+  DBG_THREAD *th = GetCurrThread();
+  if (!bp || th->tmpBpAddr != bp->address) {
+    RemoveTempBreakPoint(th->tmpBpAddr);
+    return false;
+  }
+
+  HandleSoftBreak(bp);
+  CONTEXT ctx;
+  ctx.ContextFlags = CONTEXT_CONTROL;
+  GetDbgeeContext(ctx);
+  if (ctx.Esp <= th->stepOutFrame) {
+    Continue();
+    g_dbgState = DBGS_STEP_OUT;
     return true;
   }
-  return false;
+
+  ClearCpuSingleStepFlag();
+  RemoveTempBreakPoint(th->tmpBpAddr);
+
+  std::string fn;
+  int LineNumber = 0;
+  DWORD displacement = 0;
+  if (!GetSourceLineByAddr(ctx.Eip, fn, LineNumber, displacement)) {
+    StepInto();                         // No source at return address, step to some.
+    return true;
+  }
+  return false;                         // Stop at return address.
 }
 
 bool IsCallInstruction(DWORD64 addr, int &Length)
 {
   //
-  // Table of CALL instruction pattern, format: OP1, OP2, Length.
-  // If OP2 == 0 then discard OP2.
+  // Decoded from the original bytes, a bp on the call or in its operand
+  // puts an 0xcc there. Any CALL form, the length from the decoder.
   //
 
-  static const unsigned char CALL_INST[] = {
-    0x9A, 0x00, 7,  // CALL FAR seg16:abs32
-    0xE8, 0x00, 5,  // CALL rel32
-    0xFF, 0x10, 2,  // CALL dword ptr [EAX]
-    0xFF, 0x11, 2,  // CALL dword ptr [ECX]
-    0xFF, 0x12, 2,  // CALL dword ptr [EDX]
-    0xFF, 0x13, 2,  // CALL dword ptr [EBX]
-    0xFF, 0x14, 3,  // CALL dword ptr [REG * SCALE + BASE]
-    0xFF, 0x15, 6,  // CALL dword ptr [abs32]
-    0xFF, 0x16, 2,  // CALL dword ptr [ESI]
-    0xFF, 0x17, 2,  // CALL dword ptr [EDI]
-    0xFF, 0x50, 3,  // CALL dword ptr [EAX + off8]
-    0xFF, 0x51, 3,  // CALL dword ptr [ECX + off8]
-    0xFF, 0x52, 3,  // CALL dword ptr [EDX + off8]
-    0xFF, 0x53, 3,  // CALL dword ptr [EBX + off8]
-    0xFF, 0x54, 4,  // CALL dword ptr [REG * SCALE + BASE + off8]
-    0xFF, 0x55, 3,  // CALL dword ptr [EBP + off8]
-    0xFF, 0x56, 3,  // CALL dword ptr [ESI + off8]
-    0xFF, 0x57, 3,  // CALL dword ptr [EDI + off8]
-    0xFF, 0x90, 6,  // CALL dword ptr [EAX + off32]
-    0xFF, 0x91, 6,  // CALL dword ptr [ECX + off32]
-    0xFF, 0x92, 6,  // CALL dword ptr [EDX + off32]
-    0xFF, 0x93, 6,  // CALL dword ptr [EBX + off32]
-    0xFF, 0x94, 7,  // CALL dword ptr [REG * SCALE + BASE + off32]
-    0xFF, 0x95, 6,  // CALL dword ptr [EBP + off32]
-    0xFF, 0x96, 6,  // CALL dword ptr [ESI + off32]
-    0xFF, 0x97, 6,  // CALL dword ptr [EDI + off32]
-    0xFF, 0xD0, 2,  // CALL EAX
-    0xFF, 0xD1, 2,  // CALL ECX
-    0xFF, 0xD2, 2,  // CALL EDX
-    0xFF, 0xD3, 2,  // CALL EBX
-    0xFF, 0xD4, 2,  // CALL ESP
-    0xFF, 0xD5, 2,  // CALL EBP
-    0xFF, 0xD6, 2,  // CALL ESI
-    0xFF, 0xD7, 2   // CALL EDI
-  };
-
-  unsigned char code[2];
-  ReadProcessMemory(g_piDbgee.hProcess, (LPVOID)addr, code, 2, NULL);
-
-  for (int i = 0; i < sizeof(CALL_INST) / 3; i++) {
-    unsigned char OP1 = CALL_INST[3 * i + 0];
-    unsigned char OP2 = CALL_INST[3 * i + 1];
-    if (OP1 == code[0] && (0 == OP2 || OP2 == code[1])) {
-      Length = CALL_INST[3 * i + 2];
-      return true;
+  unsigned char code[16];
+  SIZE_T size = sizeof(code);
+  if (!ReadDbgeeMemory(addr, code, size)) {
+    size = (std::min)((SIZE_T)(0x1000 - (addr & 0xfff)), size); // Up to the page end.
+    if (!ReadDbgeeMemory(addr, code, size)) {
+      return false;
     }
   }
-
+  RestoreOriginalCode(addr, code, size);
+  X86_INST inst;
+  if (!DecodeX86(code, size, addr, inst)) {
+    return false;
+  }
+  unsigned char op = code[inst.opcode];
+  if (X86_CALL == inst.kind || X86_CALL_INDIRECT == inst.kind || (X86_FAR == inst.kind && (0x9A == op || 0xFF == op))) {
+    Length = inst.length;
+    return true;
+  }
   return false;
 }
 
@@ -468,8 +674,9 @@ void DoStepOver()
 
   int Length = 0;                       // Length of the call instructions.
   if (IsCallInstruction(GetCurrIp(), Length)) {
-    g_tmpBpAddr = GetCurrIp() + Length;
-    AddTempBreakPoint(g_tmpBpAddr);
+    DBG_THREAD *th = GetCurrThread();
+    th->tmpBpAddr = GetCurrIp() + Length;
+    AddTempBreakPoint(th->tmpBpAddr);
   } else {
     SetCpuSingleStepFlag();
   }
@@ -484,6 +691,10 @@ bool HandleStepOverSingleStep()
   // Single step loop until current source line is different to saved source line.
   //
 
+  if (IsBranchStepping()) {
+    return HandleBranchStep();
+  }
+
   std::string fn;
   int LineNumber = 0;
   if (!IsCurrSourceLineChanged(fn, LineNumber)) {
@@ -497,12 +708,32 @@ bool HandleStepOverSingleStep()
 bool HandleStepOverBreak(const BREAK_POINT *bp)
 {
   if (bp && HandleSoftBreak(bp)) {
-    RemoveTempBreakPoint(g_tmpBpAddr);
+    RemoveTempBreakPoint(GetCurrThread()->tmpBpAddr);
     return HandleStepOverSingleStep();
   }
   return false;
 }
 
+bool HandleOtherThreadBreak(const BREAK_POINT *bp)
+{
+  //
+  // Another thread ran into the temp bp of the thread being stepped. Step
+  // it off the bp, the step goes on.
+  //
+
+  if (!bp || 0 != bp->LineNumber || GetCurrThreadId() == g_stepTid) {
+    return false;
+  }
+  if (DBGS_STEP_INTO != g_dbgState && DBGS_STEP_OVER != g_dbgState && DBGS_STEP_OUT != g_dbgState) {
+    return false;
+  }
+  HandleSoftBreak(bp);
+  int state = g_dbgState;
+  Continue();
+  g_dbgState = state;
+  return true;
+}
+
 void Go()
 {
   ClearCpuSingleStepFlag();
@@ -513,22 +744,19 @@ void SetCurrIp(DWORD64 ip)
 {
   CONTEXT ctx;
   ctx.ContextFlags = CONTEXT_CONTROL;
-  GetThreadContext(g_piDbgee.hThread, &ctx);
+  GetDbgeeContext(ctx);
   ctx.Eip = ip;
-  SetThreadContext(g_piDbgee.hThread, &ctx);
+  SetDbgeeContext(ctx);
 }
 
 bool HandleSoftBreak(const BREAK_POINT* bp)
 {
   //
-  // 1, write back saved op.
-  // 2. ip--
-  // 3. set single step flag.
+  // Back to the bp address, the bp stays armed. Continue() steps the
+  // thread off it.
   //
 
-  WriteProcessMemory(g_piDbgee.hProcess, (LPVOID)bp->address, &bp->saveCode, 1, NULL);
-  SetCurrIp(GetCurrIp() - 1);
-  SetCpuSingleStepFlag();
+  SetCurrIp(bp->address);
 
   return true;
 }
@@ -539,8 +767,9 @@ void SaveCurrSourceLine()
   int LineNumber = 0;
   DWORD displacement = 0;
   if (GetSourceLineByAddr(GetCurrIp(), fn, LineNumber, displacement)) {
-    g_LastBreakSource = fn;
-    g_LastBreakLine = LineNumber;
+    DBG_THREAD *th = GetCurrThread();
+    th->lastBreakSource = fn;
+    th->lastBreakLine = LineNumber;
   }
 }
 
@@ -559,7 +788,7 @@ bool SetNextStatement(const std::string &func)
 {
   SYMBOL_INFO sym = {0};
   sym.SizeOfStruct = sizeof(sym);
-  if (SymFromName(g_piDbgee.hProcess, (LPSTR)func.c_str(), &sym)) {
+  if (TRACE_CALL("SymFromName", SymFromName(g_piDbgee.hProcess, (LPSTR)func.c_str(), &sym))) {
     return SetNextStatement(sym.Address);
   }
   return false;
@@ -570,7 +799,7 @@ bool SetNextStatement(const std::string &fn, int LineNumber)
   LONG displacement;
   IMAGEHLP_LINE64 li = { 0 };
   li.SizeOfStruct = sizeof(li);
-  if (SymGetLineFromName64(g_piDbgee.hProcess, NULL, (PSTR)fn.c_str(), LineNumber, &displacement, &li)) {
+  if (TRACE_CALL("SymGetLineFromName64", SymGetLineFromName64(g_piDbgee.hProcess, NULL, (PSTR)fn.c_str(), LineNumber, &displacement, &li))) {
     SetCurrIp(li.Address);
     printf("Set next statement at %s:%d(%x)\n", fn.c_str(), LineNumber, (unsigned int)li.Address);
     DisplaySourceLines(fn, LineNumber);
@@ -581,31 +810,45 @@ bool SetNextStatement(const std::string &fn, int LineNumber)
 
 void StepInto()
 {
+  g_stepTid = GetCurrThreadId();
   SaveCurrSourceLine();
-  DoStepInto();
+  bool branch = BeginBranchStep();
+  BeginStepStats(branch);
+  if (branch) {
+    DoBranchStep(DBGS_STEP_INTO);
+  } else {
+    DoStepInto();
+  }
 }
 
-bool StepOut()
+bool StepOut(int nFrames)
 {
   //
-  // 1. find current function.
-  // 2. set a temp bp at the end of the function.
+  // 1. walk nFrames frames up the stack.
+  // 2. set a temp bp at the return address of the last one.
   // 3. go.
   //
 
-  SYMBOL_INFO si = {0};
-  si.SizeOfStruct = sizeof(si);
-
-  DWORD64 displacement = 0;
-  if (!SymFromAddr(g_piDbgee.hProcess, GetCurrIp(), &displacement, &si)) {
-    printf("StepOut: SymFromAddr failed. LastError %d\n", GetLastError());
-    return false;
+  CONTEXT ctx;
+  ctx.ContextFlags = CONTEXT_FULL;
+  GetDbgeeContext(ctx);
+
+  STACKFRAME64 sf;
+  InitStackFrame(ctx, sf);
+  for (int i = 0; i < nFrames; i++) {
+    if (!WalkStack(sf, ctx) || 0 == sf.AddrReturn.Offset) {
+      printf("StepOut: no frame %d\n", i + 1);
+      return false;
+    }
   }
 
-  g_tmpBpAddr = si.Address + si.Size - 1;
-  if (!AddTempBreakPoint(g_tmpBpAddr)) {
-    return false;
+  DBG_THREAD *th = GetCurrThread();
+  th->tmpBpAddr = sf.AddrReturn.Offset;
+  th->stepOutFrame = sf.AddrFrame.Offset;
+  if (!AddTempBreakPoint(th->tmpBpAddr)) {
+    th->tmpBpAddr = 0;                  // A bp is already there and stops as usual.
   }
+  g_stepTid = th->tid;
 
   Go();
   g_dbgState = DBGS_STEP_OUT;
@@ -615,6 +858,13 @@ bool StepOut()
 
 void StepOver()
 {
+  g_stepTid = GetCurrThreadId();
   SaveCurrSourceLine();
-  DoStepOver();
+  bool branch = BeginBranchStep();
+  BeginStepStats(branch);
+  if (branch) {
+    DoBranchStep(DBGS_STEP_OVER);
+  } else {
+    DoStepOver();
+  }
 }
@@ -0,0 +1,84 @@
+#include "mydbg.h"
+
+extern DEBUG_EVENT g_debugEvent;
+extern DEBUG_TARGET g_win32Target;
+
+//
+// All debuggee memory, context and event access of the debugger core goes
+// through here to the current target, and is recorded when a record log is
+// open, and traced with -trace.
+//
+
+DEBUG_TARGET *g_target = &g_win32Target;
+bool g_eventPending;                    // Waited for, not continued yet.
+
+BOOL ReadDbgeeMemory(DWORD64 addr, LPVOID buff, SIZE_T size)
+{
+  TRACE_SPAN span("ReadMemory", (DWORD)size);
+  BOOL ret = g_target->ReadMemory(addr, buff, size);
+  if (ret && IsRecording()) {
+    RecordMemory(addr, buff, size);
+  }
+  return ret;
+}
+
+BOOL WriteDbgeeMemory(DWORD64 addr, LPCVOID buff, SIZE_T size)
+{
+  TRACE_SPAN span("WriteMemory", (DWORD)size);
+  return g_target->WriteMemory(addr, buff, size);
+}
+
+BOOL GetDbgeeContext(CONTEXT &ctx)
+{
+  TRACE_SPAN span("GetContext", sizeof(ctx));
+  BOOL ret = g_target->GetContext(GetCurrThreadId(), ctx);
+  if (ret && IsRecording()) {
+    RecordContext(GetCurrThreadId(), ctx);
+  }
+  return ret;
+}
+
+BOOL SetDbgeeContext(const CONTEXT &ctx)
+{
+  TRACE_SPAN span("SetContext", sizeof(ctx));
+  return g_target->SetContext(GetCurrThreadId(), ctx);
+}
+
+BOOL WaitDbgeeEvent(DEBUG_EVENT &ev, DWORD timeout)
+{
+  BOOL ret = g_target->WaitEvent(ev, timeout);
+  if (ret) {
+    g_eventPending = true;
+    BeginEventStats(ev);
+    SetCurrThread(ev.dwThreadId);
+  }
+  if (ret && IsRecording()) {
+    RecordEvent(ev);
+  }
+  return ret;
+}
+
+BOOL ContinueDbgeeEvent(DWORD ContinueStatus)
+{
+  if (!g_eventPending) {
+    return TRUE;                        // Handler continued it already.
+  }
+  g_eventPending = false;
+  EndEventStats();
+  return g_target->ContinueEvent(g_debugEvent.dwProcessId, g_debugEvent.dwThreadId, ContinueStatus);
+}
+
+DWORD64 LoadDbgeeModule(HANDLE hFile, DWORD64 base)
+{
+  DWORD64 moduleAddress = TRACE_CALL("LoadModule", g_target->LoadModule(hFile, base));
+  if (0 != moduleAddress && IsRecording()) {
+    RecordModule(base);
+  }
+  return moduleAddress;
+}
+
+void EnumCommittedRegions(std::vector<MEM_REGION> &regions, bool WritableOnly)
+{
+  TRACE_SPAN span("QueryRegions", 0);
+  g_target->QueryRegions(regions, WritableOnly);
+}
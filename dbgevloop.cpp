@@ -3,14 +3,22 @@
 extern int g_dbgState;
 extern PROCESS_INFORMATION g_piDbgee;
 extern DEBUG_EVENT g_debugEvent;
-extern DWORD64 g_tmpBpAddr;
+extern DWORD g_stepTid;
+
+int g_stopReason = STOP_NONE;
+DWORD g_continueStatus = DBG_CONTINUE;  // For the event being handled.
 
 bool OnDllLoaded(const LOAD_DLL_DEBUG_INFO &pi)
 {
   printf("LOAD_DLL_DEBUG_EVENT\n");
-  DWORD64 moduleAddress = SymLoadModule64(g_piDbgee.hProcess, pi.hFile, NULL, NULL, (DWORD64)pi.lpBaseOfDll, 0);
+  LONGLONG t = StartupTicks();
+  DWORD64 moduleAddress = LoadDbgeeModule(pi.hFile, (DWORD64)pi.lpBaseOfDll);
+  AddModuleLoadTime(StartupTicks() - t);
   if (0 != moduleAddress) {
     printf("\tSymLoadModule64 0x%0x ok.\n", pi.lpBaseOfDll);
+    AddIndexModule((DWORD64)pi.lpBaseOfDll);
+    ApplyPatternBreakPoints((DWORD64)pi.lpBaseOfDll);
+    ApplySessionBreakPoints((DWORD64)pi.lpBaseOfDll);
   } else {
     printf("\tSymLoadModule64 failed.\n");
   }
@@ -21,7 +29,9 @@ bool OnDllLoaded(const LOAD_DLL_DEBUG_INFO &pi)
 bool OnDllUnloaded(const UNLOAD_DLL_DEBUG_INFO &pi)
 {
   printf("UNLOAD_DLL_DEBUG_EVENT\n");
-  SymUnloadModule64(g_piDbgee.hProcess, (DWORD64)pi.lpBaseOfDll);
+  RemoveIndexModule((DWORD64)pi.lpBaseOfDll);
+  RemoveDisasmModule((DWORD64)pi.lpBaseOfDll);
+  TRACE_CALL("SymUnloadModule64", SymUnloadModule64(g_piDbgee.hProcess, (DWORD64)pi.lpBaseOfDll));
   printf("\tSymUnloadModule64.\n");
   return true;
 }
@@ -34,7 +44,10 @@ bool OnBreakPoint()
   if (GetSourceLineByAddr(GetCurrIp(), fn, LineNumber, displacement)) {
     printf("at %s:%d\n", fn.c_str(), LineNumber);
     DisplaySourceLines(fn, LineNumber);
+    ApplySessionWatches();
+    ShowWatches(true);
     g_dbgState = DBGS_BREAK;
+    EndStartupTiming();
     return false;
   }
   return true;
@@ -42,7 +55,32 @@ bool OnBreakPoint()
 
 bool OnException(const EXCEPTION_DEBUG_INFO &pi)
 {
-  if (EXCEPTION_SINGLE_STEP == pi.ExceptionRecord.ExceptionCode) {
+  DWORD code = pi.ExceptionRecord.ExceptionCode;
+  if (EXCEPTION_BREAKPOINT != code && EXCEPTION_SINGLE_STEP != code) {
+    g_continueStatus = DBG_EXCEPTION_NOT_HANDLED; // Not ours, debuggee handles it.
+    int policy = FilterException(code, 0 != pi.dwFirstChance);
+    if (EXC_IGNORE == policy) {
+      return true;
+    }
+    printf("EXCEPTION_DEBUG_EVENT. Code: 0x%x, Addr: 0x%x (%s chance)\n", code, pi.ExceptionRecord.ExceptionAddress, pi.dwFirstChance ? "First" : "Second");
+    if (EXC_BREAK_FIRST == policy || (EXC_BREAK_SECOND == policy && !pi.dwFirstChance)) { // first stops at second chance too.
+      g_stopReason = STOP_EXCEPTION;
+      return OnBreakPoint();
+    }
+    return true;
+  }
+  if (EXCEPTION_SINGLE_STEP == pi.ExceptionRecord.ExceptionCode && HandleStepOffSingleStep()) {
+    return true;
+  }
+  if (EXCEPTION_BREAKPOINT == pi.ExceptionRecord.ExceptionCode &&
+      HandleOtherThreadBreak(FindBreakPoint((DWORD64)pi.ExceptionRecord.ExceptionAddress))) {
+    return true;
+  }
+  bool stepThread = g_debugEvent.dwThreadId == g_stepTid; // Steps complete only on it.
+  if (stepThread) {
+    CountStepTrap();
+  }
+  if (stepThread && EXCEPTION_SINGLE_STEP == pi.ExceptionRecord.ExceptionCode) {
     if (DBGS_STEP_INTO == g_dbgState && HandleStepIntoSingleStep()) {
       return true;
     }
@@ -50,7 +88,7 @@ bool OnException(const EXCEPTION_DEBUG_INFO &pi)
       return true;
     }
   }
-  if (EXCEPTION_BREAKPOINT == pi.ExceptionRecord.ExceptionCode) {
+  if (stepThread && EXCEPTION_BREAKPOINT == pi.ExceptionRecord.ExceptionCode) {
     const BREAK_POINT *bp = FindBreakPoint((DWORD64)pi.ExceptionRecord.ExceptionAddress);
     if (DBGS_STEP_OUT == g_dbgState && HandleStepOutBreak(bp)) {
       return true;
@@ -65,51 +103,60 @@ bool OnException(const EXCEPTION_DEBUG_INFO &pi)
   } else {
     printf("(Second chance)\n");
   }
-  if (EXCEPTION_BREAKPOINT == pi.ExceptionRecord.ExceptionCode || EXCEPTION_SINGLE_STEP == pi.ExceptionRecord.ExceptionCode) {
-    if (EXCEPTION_BREAKPOINT == pi.ExceptionRecord.ExceptionCode) {
-      printf("\tEXCEPTION_BREAKPOINT. ");
-      const BREAK_POINT *bp = FindBreakPoint((DWORD64)pi.ExceptionRecord.ExceptionAddress);
-      if (bp && HandleSoftBreak(bp)) {
-        return OnBreakPoint();
-      }
-    } else {
-      printf("\tEXCEPTION_SINGLE_STEP. ");
-      const BREAK_POINT *bp = FindBreakPoint((DWORD64)pi.ExceptionRecord.ExceptionAddress);
-      if (bp) {
-        HandleSoftBreakSingleStep(bp);
-      }
+  if (EXCEPTION_BREAKPOINT == pi.ExceptionRecord.ExceptionCode) {
+    printf("\tEXCEPTION_BREAKPOINT. ");
+    const BREAK_POINT *bp = FindBreakPoint((DWORD64)pi.ExceptionRecord.ExceptionAddress);
+    if (bp && HandleSoftBreak(bp)) {
+      g_stopReason = 0 != bp->LineNumber ? STOP_BREAKPOINT : STOP_STEP;
+      return OnBreakPoint();
     }
-    return OnBreakPoint();
+  } else {
+    printf("\tEXCEPTION_SINGLE_STEP. ");
   }
-  return true;
+  g_stopReason = STOP_STEP;
+  return OnBreakPoint();
 }
 
 bool OnOutputDebugString(const OUTPUT_DEBUG_STRING_INFO &pi)
 {
-  BYTE* pBuffer = (BYTE*)malloc(pi.nDebugStringLength);
-  ReadProcessMemory(g_piDbgee.hProcess, pi.lpDebugStringData, pBuffer, pi.nDebugStringLength, NULL);
-  printf("OUTPUT_DEBUG_STRING_EVENT: '%s'\n", pBuffer);
-  free(pBuffer);
+  if (IsOdsCaptureRunning()) {
+    CaptureDebugString(pi);             // Queued to the log writer.
+    return true;
+  }
+  unsigned char buff[1024];             // Console output is cut to a line or so.
+  SIZE_T size = (std::min)((SIZE_T)pi.nDebugStringLength * (pi.fUnicode ? 2 : 1), sizeof(buff));
+  std::string str;
+  if (ReadDbgeeMemory((DWORD64)pi.lpDebugStringData, buff, size)) {
+    DecodeDebugString(buff, size, 0 != pi.fUnicode, str);
+  }
+  printf("OUTPUT_DEBUG_STRING_EVENT: '%s'\n", str.c_str());
   return true;
 }
 
 bool OnProcessCreated(const CREATE_PROCESS_DEBUG_INFO &pi)
 {
   printf("CREATE_PROCESS_DEBUG_EVENT\n");
-  if (SymInitialize(g_piDbgee.hProcess, NULL, FALSE)) {
+  MarkStartupPhase("process created");
+  SymSetOptions(SymGetOptions() | SYMOPT_DEFERRED_LOADS); // Module symbols parsed on first lookup, not at load event.
+  if (TRACE_CALL("SymInitialize", SymInitialize(g_piDbgee.hProcess, NULL, FALSE))) {
     printf("\tSymInitialize ok.\n");
-    DWORD64 moduleAddress = SymLoadModule64(g_piDbgee.hProcess, pi.hFile, NULL, NULL, (DWORD64)pi.lpBaseOfImage, 0);
+    DWORD64 moduleAddress = LoadDbgeeModule(pi.hFile, (DWORD64)pi.lpBaseOfImage);
     if (0 != moduleAddress) {
       printf("\tSymLoadModule64 0x%x ok.\n", pi.lpBaseOfImage);
+      AddIndexModule((DWORD64)pi.lpBaseOfImage);
     } else {
       printf("\tSymLoadModule64 failed.\n");
     }
+    MarkStartupPhase("image symbols");
     ToggleBreakPointAtEntryPoint();
+    ApplyPatternBreakPoints((DWORD64)pi.lpBaseOfImage);
+    ApplySessionBreakPoints((DWORD64)pi.lpBaseOfImage);
+    MarkStartupPhase("entry breakpoint");
   } else {
     printf("\tSymInitialize failed.\n");
   }
+  AddDbgeeThread(g_debugEvent.dwThreadId, pi.hThread, (DWORD64)pi.lpStartAddress);
   CloseHandle(pi.hFile);
-  CloseHandle(pi.hThread);
   CloseHandle(pi.hProcess);
   return true;
 }
@@ -130,13 +177,14 @@ bool OnRipEvent(const RIP_INFO&)
 bool OnThreadCreated(const CREATE_THREAD_DEBUG_INFO &pi)
 {
   printf("CREATE_THREAD_DEBUG_EVENT\n");
-  CloseHandle(pi.hThread);
+  AddDbgeeThread(g_debugEvent.dwThreadId, pi.hThread, (DWORD64)pi.lpStartAddress); // Handle closed by the system at exit.
   return true;
 }
 
 bool OnThreadExited(const EXIT_THREAD_DEBUG_INFO&)
 {
   printf("EXIT_THREAD_DEBUG_EVENT\n");
+  RemoveDbgeeThread(g_debugEvent.dwThreadId);
   return true;
 }
 
@@ -178,21 +226,71 @@ bool DispatchDebugEvent(const DEBUG_EVENT &debugEvent)
 
 void DebugEventLoop()
 {
-  while (WaitForDebugEvent(&g_debugEvent, INFINITE)) {
-    if (DispatchDebugEvent(g_debugEvent)) {
-      ContinueDebugEvent(g_debugEvent.dwProcessId, g_debugEvent.dwThreadId, DBG_CONTINUE);
+  while (WaitDbgeeEvent(g_debugEvent, INFINITE)) {
+    g_continueStatus = DBG_CONTINUE;
+    bool resume = TRACE_CALL("DispatchDebugEvent", DispatchDebugEvent(g_debugEvent));
+    EndHandlerStats();
+    if (resume) {
+      ContinueDbgeeEvent(g_continueStatus);
     } else {
+      EndStep();
+      if (IsNonStop() && DBGS_BREAK == g_dbgState) {
+        HoldStoppedThread();
+      }
       break;
     }
   }
 }
 
+bool PumpNonStopEvents(DWORD timeout)
+{
+  //
+  // Debug events of the running threads while the prompt waits for input.
+  // A thread that stops is held and queued, the prompt stays where it is.
+  // False once the process is gone.
+  //
+
+  DWORD tid = GetCurrThreadId();
+  if (!WaitDbgeeEvent(g_debugEvent, timeout)) {
+    return true;
+  }
+  g_dbgState = DBGS_NONE;
+  g_continueStatus = DBG_CONTINUE;
+  bool resume = TRACE_CALL("DispatchDebugEvent", DispatchDebugEvent(g_debugEvent));
+  EndHandlerStats();
+  if (DBGS_EXIT_PROCESS == g_dbgState) {
+    return false;
+  }
+  if (resume) {
+    ContinueDbgeeEvent(g_continueStatus);
+  } else if (DBGS_BREAK == g_dbgState) {
+    HoldStoppedThread();
+    printf("thread %u stopped, %u held\n>", g_debugEvent.dwThreadId, (unsigned int)GetHeldThreadCount());
+  }
+  SetCurrThread(tid);
+  g_dbgState = DBGS_BREAK;
+  return true;
+}
+
 void HandleProcessExited()
 {
-  SymCleanup(g_piDbgee.hProcess);
+  SaveSession();
+  CloseRecordLog();
+  CloseDumpFile();
+  StopOdsCapture();
+  StopSymbolPrefetch();
+  ClearSourceIndex();
+  ClearSymbolIndex();
+  ClearLocalsCache();
+  ClearHeldThreads();
+  ClearDisplacedSteps();
+  ClearDisasmCache();
+  ClearDbgeeThreads();
+  TRACE_CALL("SymCleanup", SymCleanup(g_piDbgee.hProcess));
   printf("\tSymCleanup.\n");
   CloseHandle(g_piDbgee.hThread);
   CloseHandle(g_piDbgee.hProcess);
   memset(&g_piDbgee, 0, sizeof(g_piDbgee));
   g_dbgState = DBGS_EXIT_PROCESS;
+  g_stopReason = STOP_EXIT;
 }
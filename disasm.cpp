@@ -0,0 +1,259 @@
+#include "mydbg.h"
+#include "mydbghelp.h"
+
+extern PROCESS_INFORMATION g_piDbgee;
+
+#define DISASM_READ_SIZE 128            // Bytes read per block.
+#define DISASM_MAX_BLOCK 32             // Instructions per block.
+
+//
+// Disassembly for u. Code is decoded a basic block at a time, up to the
+// next branch, and the blocks are cached per module by start address, so
+// viewing the same code again while stepping reads nothing from the
+// debuggee. Blocks hold the original bytes, our 0xcc patches put back, so
+// setting or removing a breakpoint leaves them valid. A module's blocks go
+// with its unload. Code outside any module (scratch slots, generated code)
+// is decoded each time and not cached. Code a module rewrites itself is
+// not noticed, u flush drops the cache.
+//
+
+struct DISASM_INST
+{
+  DWORD64 address;
+  int length;
+  unsigned char code[15];               // Original bytes.
+  std::string text;
+  DWORD64 target;                       // Branch target, 0 if none.
+};
+
+struct DISASM_BLOCK
+{
+  std::vector<DISASM_INST> insts;
+};
+
+typedef std::map<DWORD64, DISASM_BLOCK> DisasmBlocks_t; // <Block address, Block>
+
+std::map<DWORD64, DisasmBlocks_t> g_disasmCache; // <Module base, Blocks>
+DWORD g_nDisasmHits, g_nDisasmReads;
+DWORD64 g_disasmNext;                   // Where u without address goes on,
+DWORD64 g_disasmIp;                     // if ip is still this.
+
+static bool IsBlockEnd(const X86_INST &inst, const unsigned char *code)
+{
+  if (X86_PLAIN != inst.kind) {
+    return true;
+  }
+  unsigned char op = code[inst.opcode];
+  if (0xC2 == op || 0xC3 == op || 0xCA == op || 0xCB == op || 0xCF == op) {
+    return true;                        // ret, retf, iretd.
+  }
+  return 0xFF == op && (4 == ((code[inst.modrm] >> 3) & 7) || 5 == ((code[inst.modrm] >> 3) & 7)); // jmp r/m.
+}
+
+static bool DecodeBlock(DWORD64 addr, DWORD64 limit, DISASM_BLOCK &block)
+{
+  //
+  // limit is the start of the next cached block, the new one stops there.
+  //
+
+  unsigned char buff[DISASM_READ_SIZE];
+  SIZE_T size = sizeof(buff);
+  if (!ReadDbgeeMemory(addr, buff, size)) {
+    size = (std::min)((SIZE_T)(0x1000 - (addr & 0xfff)), size); // Up to the page end.
+    if (!ReadDbgeeMemory(addr, buff, size)) {
+      return false;
+    }
+  }
+  g_nDisasmReads++;
+  RestoreOriginalCode(addr, buff, size);
+
+  size_t pos = 0;
+  bool end = false;
+  while (!end && pos < size && block.insts.size() < DISASM_MAX_BLOCK && (0 == limit || addr + pos < limit)) {
+    X86_INST inst;
+    DISASM_INST di;
+    di.address = addr + pos;
+    if (DecodeX86(buff + pos, size - pos, di.address, inst)) {
+      di.length = inst.length;
+      di.target = inst.target;
+      FormatX86(inst, buff + pos, di.text);
+      end = IsBlockEnd(inst, buff + pos);
+    } else if (pos + 15 > size && !block.insts.empty()) {
+      break;                            // Cut by the read, next block has it.
+    } else {
+      char text[16];
+      sprintf(text, "db 0x%02x", buff[pos]);
+      di.length = 1;
+      di.target = 0;
+      di.text = text;
+      end = true;
+    }
+    memcpy(di.code, buff + pos, di.length);
+    block.insts.push_back(di);
+    pos += di.length;
+  }
+  return !block.insts.empty();
+}
+
+static const DISASM_BLOCK* FindBlock(DWORD64 addr, size_t &index, DISASM_BLOCK &temp)
+{
+  //
+  // Block with an instruction starting at addr, decoded and cached if
+  // none yet.
+  //
+
+  DWORD64 base = TRACE_CALL("SymGetModuleBase64", SymGetModuleBase64(g_piDbgee.hProcess, addr));
+  if (0 == base) {
+    temp.insts.clear();
+    index = 0;
+    return DecodeBlock(addr, 0, temp) ? &temp : NULL;
+  }
+
+  DisasmBlocks_t &blocks = g_disasmCache[base];
+  DisasmBlocks_t::iterator it = blocks.upper_bound(addr);
+  DWORD64 limit = blocks.end() != it ? it->first : 0;
+  if (blocks.begin() != it) {
+    --it;
+    const std::vector<DISASM_INST> &insts = it->second.insts;
+    for (size_t i = 0; i < insts.size() && insts[i].address <= addr; i++) {
+      if (insts[i].address == addr) {
+        g_nDisasmHits++;
+        index = i;
+        return &it->second;
+      }
+    }
+  }
+  DISASM_BLOCK &block = blocks[addr];
+  if (!DecodeBlock(addr, limit, block)) {
+    blocks.erase(addr);
+    return NULL;
+  }
+  index = 0;
+  return &block;
+}
+
+static void ShowInstruction(const DISASM_INST &di, DWORD64 ip)
+{
+  char bytes[3 * 8 + 1] = {0};
+  for (int i = 0; i < di.length && i < 8; i++) {
+    sprintf(bytes + 3 * i, "%02x ", di.code[i]);
+  }
+  if (8 < di.length) {
+    bytes[3 * 8 - 1] = '+';
+  }
+  char mark = di.address == ip ? '>' : FindBreakPoint(di.address) ? '*' : ' ';
+  printf("%c0x%08x %-24s %s", mark, (unsigned int)di.address, bytes, di.text.c_str());
+
+  if (di.target) {
+    char buff[sizeof(SYMBOL_INFO) + 256] = {0};
+    SYMBOL_INFO *psi = (SYMBOL_INFO*)buff;
+    psi->SizeOfStruct = sizeof(SYMBOL_INFO);
+    psi->MaxNameLen = 256;
+    DWORD64 displacement = 0;
+    if (TRACE_CALL("SymFromAddr", SymFromAddr(g_piDbgee.hProcess, di.target, &displacement, psi))) {
+      if (displacement) {
+        printf(" (%s+0x%x)", psi->Name, (unsigned int)displacement);
+      } else {
+        printf(" (%s)", psi->Name);
+      }
+    }
+  }
+  printf("\n");
+}
+
+void Disassemble(DWORD64 addr, int count)
+{
+  //
+  // No address: from the start of ip's source line, or on from the last u
+  // if ip hasn't moved since.
+  //
+
+  DWORD64 ip = GetCurrIp();
+  if (0 == addr && ip == g_disasmIp && g_disasmNext) {
+    addr = g_disasmNext;
+  } else if (0 == addr) {
+    addr = ip;
+    DWORD displacement = 0;
+    IMAGEHLP_LINE64 li = {0};
+    li.SizeOfStruct = sizeof(li);
+    if (TRACE_CALL("SymGetLineFromAddr64", SymGetLineFromAddr64(g_piDbgee.hProcess, ip, &displacement, &li))) {
+      addr = li.Address;
+    }
+  }
+
+  std::string lastFn;
+  DWORD lastLine = 0;
+  DISASM_BLOCK temp;
+  for (int n = 0; n < count;) {
+    size_t i = 0;
+    const DISASM_BLOCK *block = FindBlock(addr, i, temp);
+    if (!block) {
+      printf("0x%08x ??\n", (unsigned int)addr);
+      break;
+    }
+    for (; i < block->insts.size() && n < count; i++, n++) {
+      const DISASM_INST &di = block->insts[i];
+      DWORD displacement = 0;
+      IMAGEHLP_LINE64 li = {0};
+      li.SizeOfStruct = sizeof(li);
+      if (TRACE_CALL("SymGetLineFromAddr64", SymGetLineFromAddr64(g_piDbgee.hProcess, di.address, &displacement, &li)) &&
+          (li.LineNumber != lastLine || lastFn != li.FileName)) {
+        lastFn = li.FileName;
+        lastLine = li.LineNumber;
+        std::string text;
+        GetSourceLineText(lastFn, lastLine, text);
+        printf("%s:%u %s", lastFn.c_str(), (unsigned int)lastLine, text.empty() ? "\n" : text.c_str());
+      }
+      ShowInstruction(di, ip);
+      addr = di.address + di.length;
+    }
+  }
+  g_disasmNext = addr;
+  g_disasmIp = ip;
+}
+
+void InvalidateDisasmCache(DWORD64 addr, SIZE_T size)
+{
+  //
+  // Code written other than by breakpoints. Rare, all blocks are looked at.
+  //
+
+  for (std::map<DWORD64, DisasmBlocks_t>::iterator m = g_disasmCache.begin(); g_disasmCache.end() != m; ++m) {
+    DisasmBlocks_t &blocks = m->second;
+    for (DisasmBlocks_t::iterator it = blocks.begin(); blocks.end() != it && it->first < addr + size;) {
+      const DISASM_INST &last = it->second.insts.back();
+      if (last.address + last.length > addr) {
+        blocks.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+void RemoveDisasmModule(DWORD64 base)
+{
+  g_disasmCache.erase(base);
+}
+
+void FlushDisasmCache()
+{
+  //
+  // Code the debuggee wrote itself (unpacking, JIT, hot patching) leaves
+  // its old blocks cached, we only see writes of our own.
+  //
+
+  g_disasmCache.clear();
+  g_disasmNext = g_disasmIp = 0;
+  printf("disassembly cache flushed\n");
+}
+
+void ClearDisasmCache()
+{
+  if (g_nDisasmHits || g_nDisasmReads) {
+    printf("\tDisassembly: %u blocks read, %u from cache\n", g_nDisasmReads, g_nDisasmHits);
+  }
+  g_disasmCache.clear();
+  g_nDisasmHits = g_nDisasmReads = 0;
+  g_disasmNext = g_disasmIp = 0;
+}
@@ -0,0 +1,152 @@
+#include "mydbg.h"
+
+extern int g_dbgState;
+extern DEBUG_TARGET *g_target;
+extern std::map<DWORD, DBG_THREAD> g_threads;
+
+#define SCRATCH_PAGE_SIZE 4096
+#define SCRATCH_SLOT_SIZE 32            // Longest instruction, push and two jumps.
+
+//
+// Getting a thread off a breakpoint without disarming it. The original
+// instruction is copied, relocated, to the thread's own slot in a scratch
+// page in the debuggee, followed by a jump back, and the thread goes on
+// from the slot. One trap per hit, and the 0xcc never leaves memory, so no
+// other thread can run past the bp meanwhile.
+//
+// Instructions that can't move (LOOP/JECXZ, far transfers, a call through
+// an ESP based operand) and targets with no scratch memory fall back to
+// restoring the byte and single-stepping with the other threads frozen.
+//
+
+DWORD64 g_scratchPage;                  // Page slots are handed out from.
+int g_scratchUsed;                      // Slots handed out of it.
+std::vector<DWORD64> g_freeScratch;     // Slots of exited threads, handed out first.
+DWORD g_nDisplaced, g_nStepOffFallback;
+
+static DWORD64 GetScratchSlot(DBG_THREAD *th)
+{
+  if (th->scratch) {
+    return th->scratch;
+  }
+  if (!g_freeScratch.empty()) {
+    th->scratch = g_freeScratch.back();
+    g_freeScratch.pop_back();
+    return th->scratch;
+  }
+  if (!g_scratchPage || SCRATCH_PAGE_SIZE / SCRATCH_SLOT_SIZE <= g_scratchUsed) {
+    g_scratchPage = g_target->AllocCode(SCRATCH_PAGE_SIZE);
+    g_scratchUsed = 0;
+    if (!g_scratchPage) {
+      return 0;
+    }
+  }
+  th->scratch = g_scratchPage + g_scratchUsed++ * SCRATCH_SLOT_SIZE;
+  return th->scratch;
+}
+
+void ReleaseScratchSlot(DBG_THREAD *th)
+{
+  if (th->scratch) {
+    g_freeScratch.push_back(th->scratch);
+    th->scratch = 0;
+  }
+}
+
+static bool DisplaceInstruction(DBG_THREAD *th, const BREAK_POINT *bp)
+{
+  unsigned char code[16];
+  if (!ReadDbgeeMemory(bp->address, code, sizeof(code))) {
+    return false;
+  }
+  RestoreOriginalCode(bp->address, code, sizeof(code));
+  X86_INST inst;
+  if (!DecodeX86(code, sizeof(code), bp->address, inst)) {
+    return false;
+  }
+  DWORD64 slot = GetScratchSlot(th);
+  unsigned char buff[SCRATCH_SLOT_SIZE];
+  int size = slot ? RelocateX86(inst, code, bp->address, slot, buff) : 0;
+  if (0 == size || !WriteDbgeeMemory(slot, buff, size)) {
+    return false;
+  }
+  SetCurrIp(slot);
+  return true;
+}
+
+static void FreezeOtherThreads(DWORD tid, bool freeze)
+{
+  for (std::map<DWORD, DBG_THREAD>::iterator it = g_threads.begin(); g_threads.end() != it; ++it) {
+    DBG_THREAD &th = it->second;
+    if (th.tid == tid || !th.hThread) {
+      continue;
+    }
+    if (freeze && !th.frozen) {
+      th.frozen = (DWORD)-1 != SuspendThread(th.hThread);
+    } else if (!freeze && th.frozen) {
+      ResumeThread(th.hThread);
+      th.frozen = false;
+    }
+  }
+}
+
+void StepOffBreakPoint()
+{
+  const BREAK_POINT *bp = FindBreakPoint(GetCurrIp());
+  if (!bp) {
+    return;
+  }
+  DBG_THREAD *th = GetCurrThread();
+  if (DisplaceInstruction(th, bp)) {
+    g_nDisplaced++;
+    return;
+  }
+
+  //
+  // Original byte back for one instruction, the others frozen. The bp is
+  // written back on the single-step.
+  //
+
+  g_nStepOffFallback++;
+  CONTEXT ctx;
+  ctx.ContextFlags = CONTEXT_CONTROL;
+  GetDbgeeContext(ctx);
+  th->stepOffAddr = bp->address;
+  th->stepOffTf = 0 != (ctx.EFlags & 0x100); // Set by a step command.
+  FreezeOtherThreads(th->tid, true);
+  WriteDbgeeMemory(bp->address, &bp->saveCode, 1);
+  SetCpuSingleStepFlag();
+}
+
+bool HandleStepOffSingleStep()
+{
+  DBG_THREAD *th = GetCurrThread();
+  if (0 == th->stepOffAddr) {
+    return false;
+  }
+  if (FindBreakPoint(th->stepOffAddr)) {
+    unsigned char cc = 0xcc;
+    WriteDbgeeMemory(th->stepOffAddr, &cc, 1);
+  }
+  th->stepOffAddr = 0;
+  FreezeOtherThreads(th->tid, false);
+  if (th->stepOffTf) {
+    return false;                       // The step goes on from this single-step.
+  }
+  ClearCpuSingleStepFlag();
+  int state = g_dbgState;
+  Continue();
+  g_dbgState = state;
+  return true;
+}
+
+void ClearDisplacedSteps()
+{
+  if (g_nDisplaced || g_nStepOffFallback) {
+    printf("\tBreakpoints stepped off: %u displaced, %u single-stepped\n", g_nDisplaced, g_nStepOffFallback);
+  }
+  g_scratchPage = 0;                    // Went with the process.
+  g_scratchUsed = 0;
+  g_freeScratch.clear();
+  g_nDisplaced = g_nStepOffFallback = 0;
+}
@@ -17,7 +17,7 @@ void DisplaySourceLines_i(const std::string &fn, SourceLines_t &lines, int LineN
       LONG displacement;
       IMAGEHLP_LINE64 li = { 0 };
       li.SizeOfStruct = sizeof(li);
-      if (!SymGetLineFromName64(g_piDbgee.hProcess, NULL, (PSTR)fn.c_str(), i + 1, &displacement, &li)) {
+      if (!TRACE_CALL("SymGetLineFromName64", SymGetLineFromName64(g_piDbgee.hProcess, NULL, (PSTR)fn.c_str(), i + 1, &displacement, &li))) {
         printf("SymGetLineFromName64 failed, %d\n", GetLastError());
         return;
       }
@@ -48,6 +48,22 @@ bool LoadSourceFile(const std::string &fn)
   return true;
 }
 
+bool GetSourceLineText(const std::string &fn, int LineNumber, std::string &text)
+{
+  SourceFiles_t::iterator it = g_sourceFiles.find(fn);
+  if (g_sourceFiles.end() == it) {
+    if (!LoadSourceFile(fn)) {
+      return false;
+    }
+    it = g_sourceFiles.find(fn);
+  }
+  if (0 >= LineNumber || (int)it->second.size() < LineNumber) {
+    return false;
+  }
+  text = it->second[LineNumber - 1].line;
+  return true;
+}
+
 bool DisplaySourceLines(const std::string &fn, int LineNumber)
 {
   SourceFiles_t::iterator it = g_sourceFiles.find(fn);
@@ -0,0 +1,560 @@
+#include "mydbg.h"
+
+extern int g_dbgState;
+extern PROCESS_INFORMATION g_piDbgee;
+extern DEBUG_EVENT g_debugEvent;
+extern DEBUG_TARGET *g_target;
+extern DEBUG_TARGET g_dumpTarget;
+
+//
+// Dump file layout:
+//   DUMP_HEADER
+//   DUMP_MODULE[nModules]
+//   DUMP_THREAD[nThreads]
+//   DUMP_CHUNK + compressed bytes, until end of file.
+// Memory is cut into 1 MB chunks compressed on worker threads and written
+// in address order as soon as each is ready.
+//
+
+#define DUMP_MAGIC "MYDBGDM1"
+#define DUMP_CHUNK_SIZE (1024 * 1024)
+#define DUMP_MAX_THREADS 16
+#define DUMP_CACHE_CHUNKS 64            // Decompressed chunks kept when offline.
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+struct DUMP_HEADER
+{
+  char magic[8];
+  DWORD pid, tid;
+  DWORD ExceptionCode;
+  DWORD64 ExceptionAddress;
+  DWORD nModules, nThreads;
+};
+
+struct DUMP_MODULE
+{
+  DWORD64 base;
+  DWORD size;
+  char path[MAX_PATH];
+};
+
+struct DUMP_THREAD
+{
+  DWORD tid;
+  CONTEXT ctx;
+};
+
+struct DUMP_CHUNK
+{
+  DWORD64 address;
+  DWORD size;                           // Raw size.
+  DWORD packed;                         // Compressed size.
+};
+
+//
+// LZ compression, LZ4 style sequences: token(literal len:4, match len:4),
+// literals, 16-bit offset. Lengths of 15 continue in following bytes.
+//
+
+static void LzPutLength(std::vector<unsigned char> &dst, size_t n)
+{
+  while (255 <= n) {
+    dst.push_back(255);
+    n -= 255;
+  }
+  dst.push_back((unsigned char)n);
+}
+
+void LzCompress(const unsigned char *src, size_t n, std::vector<unsigned char> &dst)
+{
+  std::vector<int> table(1 << LZ_HASH_BITS, -1);
+  dst.clear();
+  dst.reserve(n + n / 255 + 16);
+
+  size_t i = 0, anchor = 0;
+  while (i + LZ_MIN_MATCH <= n) {
+    unsigned int v = *(const unsigned int*)(src + i);
+    unsigned int h = (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+    int cand = table[h];
+    table[h] = (int)i;
+    if (0 > cand || LZ_MAX_OFFSET < i - cand || *(const unsigned int*)(src + cand) != v) {
+      i++;
+      continue;
+    }
+    size_t len = LZ_MIN_MATCH;
+    while (i + len < n && src[cand + len] == src[i + len]) {
+      len++;
+    }
+
+    size_t lit = i - anchor, m = len - LZ_MIN_MATCH;
+    dst.push_back((unsigned char)(((std::min)(lit, (size_t)15) << 4) | (std::min)(m, (size_t)15)));
+    if (15 <= lit) {
+      LzPutLength(dst, lit - 15);
+    }
+    dst.insert(dst.end(), src + anchor, src + i);
+    dst.push_back((unsigned char)(i - cand));
+    dst.push_back((unsigned char)((i - cand) >> 8));
+    if (15 <= m) {
+      LzPutLength(dst, m - 15);
+    }
+    i += len;
+    anchor = i;
+  }
+
+  size_t lit = n - anchor;
+  dst.push_back((unsigned char)((std::min)(lit, (size_t)15) << 4));
+  if (15 <= lit) {
+    LzPutLength(dst, lit - 15);
+  }
+  dst.insert(dst.end(), src + anchor, src + n);
+}
+
+bool LzDecompress(const unsigned char *src, size_t n, unsigned char *dst, size_t size)
+{
+  const unsigned char *end = src + n;
+  size_t o = 0;
+  while (src < end) {
+    unsigned char token = *src++;
+    size_t lit = token >> 4;
+    if (15 == lit) {
+      unsigned char b;
+      do {
+        if (src >= end) {
+          return false;
+        }
+        b = *src++;
+        lit += b;
+      } while (255 == b);
+    }
+    if ((size_t)(end - src) < lit || size - o < lit) {
+      return false;
+    }
+    memcpy(dst + o, src, lit);
+    src += lit;
+    o += lit;
+    if (src >= end) {
+      break;                            // Last sequence has no match.
+    }
+
+    if (2 > end - src) {
+      return false;
+    }
+    size_t offset = src[0] | (src[1] << 8);
+    src += 2;
+    size_t len = token & 15;
+    if (15 == len) {
+      unsigned char b;
+      do {
+        if (src >= end) {
+          return false;
+        }
+        b = *src++;
+        len += b;
+      } while (255 == b);
+    }
+    len += LZ_MIN_MATCH;
+    if (0 == offset || o < offset || size - o < len) {
+      return false;
+    }
+    for (size_t k = 0; k < len; k++, o++) {  // Byte copy, match may overlap.
+      dst[o] = dst[o - offset];
+    }
+  }
+  return o == size;
+}
+
+//
+// Dump writer.
+//
+
+struct DUMP_SLOT
+{
+  HANDLE done;                          // Chunk compressed, ready to write.
+  HANDLE free;                          // Chunk written, slot reusable.
+  bool ok;
+  std::vector<unsigned char> packed;
+};
+
+struct DUMP_JOB
+{
+  std::vector<DUMP_CHUNK> chunks;
+  std::vector<DUMP_SLOT> slots;
+  int nWorkers;
+  volatile LONG next;                   // Worker id.
+};
+
+static DWORD WINAPI DumpWorker(LPVOID param)
+{
+  DUMP_JOB *job = (DUMP_JOB*)param;
+  std::vector<unsigned char> buff(DUMP_CHUNK_SIZE);
+
+  //
+  // Worker w takes chunks w, w + n, ..., so slots w and w + n are its own.
+  //
+
+  LONG id = InterlockedIncrement(&job->next) - 1;
+  for (size_t i = id; i < job->chunks.size(); i += job->nWorkers) {
+    DUMP_SLOT &s = job->slots[i % job->slots.size()];
+    WaitForSingleObject(s.free, INFINITE);
+    const DUMP_CHUNK &c = job->chunks[i];
+    s.ok = FALSE != g_target->ReadMemory(c.address, &buff[0], c.size);
+    if (s.ok) {
+      RestoreOriginalCode(c.address, &buff[0], c.size);
+      LzCompress(&buff[0], c.size, s.packed);
+    }
+    SetEvent(s.done);
+  }
+  return 0;
+}
+
+bool WriteDumpFile(const char *fn)
+{
+  LARGE_INTEGER freq, t0, t1;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t0);
+
+  FILE *f = fopen(fn, "wb");
+  if (!f) {
+    printf("Open dump file %s failed\n", fn);
+    return false;
+  }
+  setvbuf(f, NULL, _IOFBF, 1024 * 1024);
+
+  std::vector<DUMP_MODULE> modules;
+  std::vector<DWORD64> bases;
+  GetIndexModules(bases);
+  for (size_t i = 0; i < bases.size(); i++) {
+    IMAGEHLP_MODULE64 mi = {0};
+    mi.SizeOfStruct = sizeof(mi);
+    if (SymGetModuleInfo64(g_piDbgee.hProcess, bases[i], &mi)) {
+      DUMP_MODULE m = {0};
+      m.base = bases[i];
+      m.size = mi.ImageSize;
+      strncpy(m.path, mi.LoadedImageName[0] ? mi.LoadedImageName : mi.ImageName, MAX_PATH - 1);
+      modules.push_back(m);
+    }
+  }
+
+  std::vector<DWORD> tids;
+  std::vector<CONTEXT> ctxs;
+  GetAllThreadContexts(tids, ctxs);
+  std::vector<DUMP_THREAD> threads(tids.size());
+  for (size_t i = 0; i < tids.size(); i++) {
+    threads[i].tid = tids[i];
+    threads[i].ctx = ctxs[i];
+  }
+
+  DUMP_HEADER hdr = {{0}};
+  memcpy(hdr.magic, DUMP_MAGIC, sizeof(hdr.magic));
+  hdr.pid = g_piDbgee.dwProcessId;
+  hdr.tid = GetCurrThreadId();
+  if (EXCEPTION_DEBUG_EVENT == g_debugEvent.dwDebugEventCode) {
+    hdr.ExceptionCode = g_debugEvent.u.Exception.ExceptionRecord.ExceptionCode;
+    hdr.ExceptionAddress = (DWORD64)g_debugEvent.u.Exception.ExceptionRecord.ExceptionAddress;
+  }
+  hdr.nModules = (DWORD)modules.size();
+  hdr.nThreads = (DWORD)threads.size();
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  if (!modules.empty()) {
+    fwrite(&modules[0], sizeof(DUMP_MODULE), modules.size(), f);
+  }
+  if (!threads.empty()) {
+    fwrite(&threads[0], sizeof(DUMP_THREAD), threads.size(), f);
+  }
+
+  DUMP_JOB job;
+  std::vector<MEM_REGION> regions;
+  EnumCommittedRegions(regions, false);
+  for (size_t i = 0; i < regions.size(); i++) {
+    const MEM_REGION &r = regions[i];
+    for (DWORD64 off = 0; off < r.size; off += DUMP_CHUNK_SIZE) {
+      DUMP_CHUNK c;
+      c.address = r.address + off;
+      c.size = (DWORD)(std::min)((DWORD64)DUMP_CHUNK_SIZE, r.size - off);
+      c.packed = 0;
+      job.chunks.push_back(c);
+    }
+  }
+
+  //
+  // Workers compress into a ring of slots, twice as many as workers. This
+  // thread writes slots in chunk order and hands them back.
+  //
+
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  int nThreads = (std::max)(1, (std::min)((int)si.dwNumberOfProcessors, DUMP_MAX_THREADS));
+  job.next = 0;
+  HANDLE hThreads[DUMP_MAX_THREADS];
+  int nCreated = 0;
+  for (int i = 0; i < nThreads; i++) {
+    hThreads[nCreated] = CreateThread(NULL, 0, DumpWorker, &job, CREATE_SUSPENDED, NULL);
+    if (hThreads[nCreated]) {
+      nCreated++;
+    }
+  }
+  job.nWorkers = nCreated;
+  job.slots.resize(nCreated * 2);       // Fixed before workers start, see DumpWorker.
+  for (size_t i = 0; i < job.slots.size(); i++) {
+    job.slots[i].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    job.slots[i].free = CreateEvent(NULL, FALSE, TRUE, NULL);
+  }
+  for (int i = 0; i < nCreated; i++) {
+    ResumeThread(hThreads[i]);
+  }
+  if (0 == nCreated) {
+    printf("CreateThread failed: %u\n", GetLastError());
+  }
+
+  DWORD64 nRaw = 0, nPacked = 0;
+  for (size_t i = 0; 0 < nCreated && i < job.chunks.size(); i++) {
+    DUMP_SLOT &s = job.slots[i % job.slots.size()];
+    WaitForSingleObject(s.done, INFINITE);
+    if (s.ok) {
+      DUMP_CHUNK c = job.chunks[i];
+      c.packed = (DWORD)s.packed.size();
+      fwrite(&c, sizeof(c), 1, f);
+      fwrite(&s.packed[0], 1, s.packed.size(), f);
+      nRaw += c.size;
+      nPacked += c.packed;
+    }
+    SetEvent(s.free);
+  }
+
+  WaitForMultipleObjects(nCreated, hThreads, TRUE, INFINITE);
+  for (int i = 0; i < nCreated; i++) {
+    CloseHandle(hThreads[i]);
+  }
+  for (size_t i = 0; i < job.slots.size(); i++) {
+    CloseHandle(job.slots[i].done);
+    CloseHandle(job.slots[i].free);
+  }
+  bool ok = 0 == ferror(f);
+  fclose(f);
+
+  QueryPerformanceCounter(&t1);
+  printf("Dump %s: %u modules, %u threads, %u MB memory, %u MB written, %.1f ms\n", fn, hdr.nModules, hdr.nThreads, (unsigned int)(nRaw >> 20), (unsigned int)(nPacked >> 20), (t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart);
+  return ok && 0 < nCreated;
+}
+
+//
+// Offline dump target.
+//
+
+struct DUMP_INDEX
+{
+  DWORD size;
+  DWORD packed;
+  __int64 offset;                       // Of compressed bytes in file.
+};
+
+FILE *g_dumpFile;
+std::map<DWORD64, DUMP_INDEX> g_dumpChunks; // <Address, Chunk>
+std::map<DWORD64, std::vector<unsigned char> > g_dumpCache; // <Address, Raw bytes>
+std::vector<DUMP_THREAD> g_dumpThreads;
+
+const unsigned char* GetDumpChunk(DWORD64 address, const DUMP_INDEX &c)
+{
+  std::map<DWORD64, std::vector<unsigned char> >::iterator it = g_dumpCache.find(address);
+  if (g_dumpCache.end() != it) {
+    return &it->second[0];
+  }
+  if (DUMP_CACHE_CHUNKS <= g_dumpCache.size()) {
+    g_dumpCache.clear();
+  }
+
+  std::vector<unsigned char> packed(c.packed);
+  if (0 != _fseeki64(g_dumpFile, c.offset, SEEK_SET) || 1 != fread(&packed[0], c.packed, 1, g_dumpFile)) {
+    return NULL;
+  }
+  std::vector<unsigned char> &raw = g_dumpCache[address];
+  raw.resize(c.size);
+  if (!LzDecompress(&packed[0], packed.size(), &raw[0], raw.size())) {
+    g_dumpCache.erase(address);
+    return NULL;
+  }
+  return &raw[0];
+}
+
+BOOL DumpTargetReadMemory(DWORD64 addr, LPVOID buff, SIZE_T size)
+{
+  unsigned char *p = (unsigned char*)buff;
+  for (SIZE_T i = 0; i < size;) {
+    DWORD64 a = addr + i;
+    std::map<DWORD64, DUMP_INDEX>::const_iterator it = g_dumpChunks.upper_bound(a);
+    if (g_dumpChunks.begin() == it) {
+      return FALSE;
+    }
+    --it;
+    if (a >= it->first + it->second.size) {
+      return FALSE;
+    }
+    const unsigned char *chunk = GetDumpChunk(it->first, it->second);
+    if (!chunk) {
+      return FALSE;
+    }
+    SIZE_T off = (SIZE_T)(a - it->first);
+    SIZE_T n = (std::min)(size - i, (SIZE_T)(it->second.size - off));
+    memcpy(p + i, chunk + off, n);
+    i += n;
+  }
+  return TRUE;
+}
+
+BOOL DumpTargetWriteMemory(DWORD64, LPCVOID, SIZE_T)
+{
+  return FALSE;
+}
+
+void DumpTargetQueryRegions(std::vector<MEM_REGION> &regions, bool)
+{
+  regions.clear();
+  for (std::map<DWORD64, DUMP_INDEX>::const_iterator it = g_dumpChunks.begin(); g_dumpChunks.end() != it; ++it) {
+    if (!regions.empty() && regions.back().address + regions.back().size == it->first) {
+      regions.back().size += it->second.size;
+    } else {
+      MEM_REGION r;
+      r.address = it->first;
+      r.size = it->second.size;
+      r.protect = PAGE_READONLY;
+      regions.push_back(r);
+    }
+  }
+}
+
+BOOL DumpTargetGetContext(DWORD tid, CONTEXT &ctx)
+{
+  for (size_t i = 0; i < g_dumpThreads.size(); i++) {
+    if (g_dumpThreads[i].tid == tid) {
+      DWORD flags = ctx.ContextFlags;
+      ctx = g_dumpThreads[i].ctx;
+      ctx.ContextFlags = flags;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+BOOL DumpTargetSetContext(DWORD, const CONTEXT&)
+{
+  return FALSE;
+}
+
+BOOL DumpTargetWaitEvent(DEBUG_EVENT&, DWORD)
+{
+  printf("Offline dump, debuggee can't run\n");
+  g_dbgState = DBGS_BREAK;
+  return FALSE;
+}
+
+BOOL DumpTargetContinueEvent(DWORD, DWORD, DWORD)
+{
+  return FALSE;
+}
+
+DWORD64 DumpTargetLoadModule(HANDLE, DWORD64)
+{
+  return 0;                             // Modules come from the dump header.
+}
+
+DWORD64 DumpTargetAllocCode(SIZE_T)
+{
+  return 0;
+}
+
+DEBUG_TARGET g_dumpTarget = {
+  "dump",
+  DumpTargetReadMemory,
+  DumpTargetWriteMemory,
+  DumpTargetQueryRegions,
+  DumpTargetGetContext,
+  DumpTargetSetContext,
+  DumpTargetWaitEvent,
+  DumpTargetContinueEvent,
+  DumpTargetLoadModule,
+  DumpTargetAllocCode
+};
+
+void CloseDumpFile()
+{
+  if (g_dumpFile) {
+    fclose(g_dumpFile);
+    g_dumpFile = NULL;
+  }
+  g_dumpChunks.clear();
+  g_dumpCache.clear();
+  g_dumpThreads.clear();
+}
+
+bool OpenDumpFile(const char *fn)
+{
+  g_dumpFile = fopen(fn, "rb");
+  DUMP_HEADER hdr;
+  if (!g_dumpFile || 1 != fread(&hdr, sizeof(hdr), 1, g_dumpFile) || 0 != memcmp(hdr.magic, DUMP_MAGIC, sizeof(hdr.magic))) {
+    printf("Invalid dump file %s\n", fn);
+    CloseDumpFile();
+    return false;
+  }
+  std::vector<DUMP_MODULE> modules(hdr.nModules);
+  g_dumpThreads.resize(hdr.nThreads);
+  if ((0 < hdr.nModules && hdr.nModules != fread(&modules[0], sizeof(DUMP_MODULE), hdr.nModules, g_dumpFile)) ||
+      (0 < hdr.nThreads && hdr.nThreads != fread(&g_dumpThreads[0], sizeof(DUMP_THREAD), hdr.nThreads, g_dumpFile))) {
+    printf("Invalid dump file %s\n", fn);
+    CloseDumpFile();
+    return false;
+  }
+
+  DUMP_CHUNK c;
+  while (1 == fread(&c, sizeof(c), 1, g_dumpFile)) {
+    DUMP_INDEX &idx = g_dumpChunks[c.address];
+    idx.size = c.size;
+    idx.packed = c.packed;
+    idx.offset = _ftelli64(g_dumpFile);
+    _fseeki64(g_dumpFile, c.packed, SEEK_CUR);
+  }
+
+  //
+  // Same as replay, the process handle is a private event object that
+  // identifies the session to dbghelp.
+  //
+
+  g_piDbgee.dwProcessId = hdr.pid;
+  g_piDbgee.dwThreadId = hdr.tid;
+  g_piDbgee.hProcess = CreateEvent(NULL, FALSE, FALSE, NULL);
+  g_piDbgee.hThread = NULL;
+  g_target = &g_dumpTarget;
+  for (size_t i = 0; i < g_dumpThreads.size(); i++) {
+    AddDbgeeThread(g_dumpThreads[i].tid, NULL, 0);
+  }
+  SetCurrThread(hdr.tid);
+
+  if (!SymInitialize(g_piDbgee.hProcess, NULL, FALSE)) {
+    printf("SymInitialize failed.\n");
+    CloseDumpFile();
+    return false;
+  }
+  for (size_t i = 0; i < modules.size(); i++) {
+    if (SymLoadModule64(g_piDbgee.hProcess, NULL, modules[i].path, NULL, modules[i].base, modules[i].size)) {
+      AddIndexModule(modules[i].base);
+    } else {
+      printf("\tSymLoadModule64 %s failed.\n", modules[i].path);
+    }
+  }
+
+  printf("Dump %s: pid=%u, tid=%u, %u modules, %u chunks\n", fn, hdr.pid, hdr.tid, hdr.nModules, (unsigned int)g_dumpChunks.size());
+  if (hdr.ExceptionCode) {
+    printf("Exception 0x%x at 0x%x\n", hdr.ExceptionCode, (unsigned int)hdr.ExceptionAddress);
+  }
+  std::string src;
+  int LineNumber = 0;
+  DWORD displacement = 0;
+  if (GetSourceLineByAddr(GetCurrIp(), src, LineNumber, displacement)) {
+    printf("at %s:%d\n", src.c_str(), LineNumber);
+    DisplaySourceLines(src, LineNumber);
+  }
+  g_dbgState = DBGS_BREAK;
+  return true;
+}
@@ -0,0 +1,225 @@
+#include "mydbg.h"
+
+#define HIST_SUB_BITS 3                 // 8 buckets per power of 2, 12.5% precision.
+#define HIST_SUBS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (2 * HIST_SUBS + (64 - HIST_SUB_BITS - 1) * HIST_SUBS)
+
+//
+// Debugger's own event statistics. For each event type: count, latency of
+// our handler (wait returned to dispatch returned), and how long the
+// debuggee stayed stopped (wait returned to continue, so it includes time
+// at the prompt after a break). Latencies go to log-linear histograms in
+// nanoseconds, constant size and cost whatever the range.
+//
+
+struct LATENCY_HIST
+{
+  DWORD64 count;
+  DWORD64 total;
+  DWORD64 max;
+  DWORD buckets[HIST_BUCKETS];
+};
+
+struct EVENT_STATS
+{
+  const char *name;
+  LATENCY_HIST handler;
+  LATENCY_HIST stopped;
+};
+
+enum {
+  EVS_CREATE_PROCESS = 0,
+  EVS_CREATE_THREAD,
+  EVS_BREAKPOINT,
+  EVS_SINGLE_STEP,
+  EVS_EXCEPTION,
+  EVS_EXIT_THREAD,
+  EVS_EXIT_PROCESS,
+  EVS_LOAD_DLL,
+  EVS_UNLOAD_DLL,
+  EVS_DEBUG_STRING,
+  EVS_RIP,
+  EVS_COUNT
+};
+
+EVENT_STATS g_evStats[EVS_COUNT] = {
+  {"create process"}, {"create thread"}, {"breakpoint"}, {"single step"},
+  {"exception"}, {"exit thread"}, {"exit process"}, {"load dll"},
+  {"unload dll"}, {"debug string"}, {"rip"},
+};
+
+//
+// Latency of t and p, command to stop, and the traps each took, by step
+// mode, to compare single-step and branch-step.
+//
+
+struct STEP_STATS
+{
+  const char *name;
+  DWORD64 nTraps;
+  LATENCY_HIST latency;
+};
+
+STEP_STATS g_stepStats[2] = {{"step tf"}, {"step btf"}};
+int g_stepStatsMode = -1;               // Step being timed, -1 if none.
+LONGLONG g_stepBegin;
+
+int g_evType = -1;                      // Event being handled, -1 if none.
+LONGLONG g_evBegin;
+LONGLONG g_evFreq;
+
+static int HistBucket(DWORD64 v)
+{
+  if (v < 2 * HIST_SUBS) {
+    return (int)v;
+  }
+  int msb = 0;
+  while (v >> (msb + 1)) {
+    msb++;
+  }
+  int shift = msb - HIST_SUB_BITS;
+  return 2 * HIST_SUBS + (shift - 1) * HIST_SUBS + (int)((v >> shift) - HIST_SUBS);
+}
+
+static DWORD64 HistBucketValue(int i)   // Upper bound of bucket.
+{
+  if (i < 2 * HIST_SUBS) {
+    return i;
+  }
+  int shift = (i - 2 * HIST_SUBS) / HIST_SUBS + 1;
+  DWORD64 top = (i - 2 * HIST_SUBS) % HIST_SUBS + HIST_SUBS;
+  return ((top + 1) << shift) - 1;
+}
+
+static void HistAdd(LATENCY_HIST &h, DWORD64 ns)
+{
+  h.count++;
+  h.total += ns;
+  h.max = (std::max)(h.max, ns);
+  h.buckets[HistBucket(ns)]++;
+}
+
+static DWORD64 HistPercentile(const LATENCY_HIST &h, double p)
+{
+  DWORD64 want = (DWORD64)(h.count * p / 100.0 + 0.5), seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h.buckets[i];
+    if (seen >= want && 0 < seen) {
+      return (std::min)(HistBucketValue(i), h.max);
+    }
+  }
+  return h.max;
+}
+
+static DWORD64 TicksToNs(LONGLONG ticks)
+{
+  return (DWORD64)(ticks * 1000000000.0 / g_evFreq);
+}
+
+void BeginEventStats(const DEBUG_EVENT &ev)
+{
+  if (0 == g_evFreq) {
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    g_evFreq = f.QuadPart;
+  }
+  g_evBegin = StartupTicks();
+  switch (ev.dwDebugEventCode) {
+    case CREATE_PROCESS_DEBUG_EVENT: g_evType = EVS_CREATE_PROCESS; break;
+    case CREATE_THREAD_DEBUG_EVENT: g_evType = EVS_CREATE_THREAD; break;
+    case EXCEPTION_DEBUG_EVENT:
+      switch (ev.u.Exception.ExceptionRecord.ExceptionCode) {
+        case EXCEPTION_BREAKPOINT: g_evType = EVS_BREAKPOINT; break;
+        case EXCEPTION_SINGLE_STEP: g_evType = EVS_SINGLE_STEP; break;
+        default: g_evType = EVS_EXCEPTION; break;
+      }
+      break;
+    case EXIT_THREAD_DEBUG_EVENT: g_evType = EVS_EXIT_THREAD; break;
+    case EXIT_PROCESS_DEBUG_EVENT: g_evType = EVS_EXIT_PROCESS; break;
+    case LOAD_DLL_DEBUG_EVENT: g_evType = EVS_LOAD_DLL; break;
+    case UNLOAD_DLL_DEBUG_EVENT: g_evType = EVS_UNLOAD_DLL; break;
+    case OUTPUT_DEBUG_STRING_EVENT: g_evType = EVS_DEBUG_STRING; break;
+    case RIP_EVENT: g_evType = EVS_RIP; break;
+    default: g_evType = -1; break;
+  }
+}
+
+void EndHandlerStats()
+{
+  if (0 <= g_evType) {
+    HistAdd(g_evStats[g_evType].handler, TicksToNs(StartupTicks() - g_evBegin));
+  }
+}
+
+void EndEventStats()
+{
+  if (0 <= g_evType) {
+    HistAdd(g_evStats[g_evType].stopped, TicksToNs(StartupTicks() - g_evBegin));
+    g_evType = -1;
+  }
+}
+
+void BeginStepStats(bool branch)
+{
+  if (0 == g_evFreq) {
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    g_evFreq = f.QuadPart;
+  }
+  g_stepStatsMode = branch ? 1 : 0;
+  g_stepBegin = StartupTicks();
+}
+
+void CountStepTrap()
+{
+  if (0 <= g_stepStatsMode) {
+    g_stepStats[g_stepStatsMode].nTraps++;
+  }
+}
+
+void EndStepStats()
+{
+  if (0 <= g_stepStatsMode) {
+    HistAdd(g_stepStats[g_stepStatsMode].latency, TicksToNs(StartupTicks() - g_stepBegin));
+    g_stepStatsMode = -1;
+  }
+}
+
+void ResetEventStats()
+{
+  for (int i = 0; i < EVS_COUNT; i++) {
+    memset(&g_evStats[i].handler, 0, sizeof(g_evStats[i].handler));
+    memset(&g_evStats[i].stopped, 0, sizeof(g_evStats[i].stopped));
+  }
+  for (int i = 0; i < 2; i++) {
+    g_stepStats[i].nTraps = 0;
+    memset(&g_stepStats[i].latency, 0, sizeof(g_stepStats[i].latency));
+  }
+}
+
+static void ShowHist(const char *name, const char *what, const LATENCY_HIST &h)
+{
+  printf("%-15s %-8s %8u %10.1f %9.1f %9.1f %9.1f %10.1f\n", name, what, (unsigned int)h.count,
+         h.total / 1000000.0, HistPercentile(h, 50) / 1000.0, HistPercentile(h, 90) / 1000.0,
+         HistPercentile(h, 99) / 1000.0, h.max / 1000.0);
+}
+
+void ShowEventStats()
+{
+  printf("%-15s %-8s %8s %10s %9s %9s %9s %10s\n", "event", "", "count", "total ms", "p50 us", "p90 us", "p99 us", "max us");
+  for (int i = 0; i < EVS_COUNT; i++) {
+    const EVENT_STATS &st = g_evStats[i];
+    if (0 == st.stopped.count && 0 == st.handler.count) {
+      continue;
+    }
+    ShowHist(st.name, "handler", st.handler);
+    ShowHist("", "stopped", st.stopped);
+  }
+  for (int i = 0; i < 2; i++) {
+    const STEP_STATS &st = g_stepStats[i];
+    if (st.latency.count) {
+      ShowHist(st.name, "latency", st.latency);
+      printf("%-15s %-8s %8.1f\n", "", "traps", (double)st.nTraps / st.latency.count);
+    }
+  }
+}
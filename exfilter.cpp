@@ -0,0 +1,154 @@
+#include "mydbg.h"
+
+#define EXC_TABLE_SIZE 256              // Power of 2.
+
+//
+// Per exception code policy, looked up on every exception that is not one
+// of our breakpoints or steps. Open addressing on the code, so the lookup
+// is a hash and a probe or two. Codes are added on first sight with the
+// default policy, so every code seen gets counters.
+//
+
+struct EXC_FILTER
+{
+  DWORD code;                           // 0 = empty slot.
+  int policy;
+  DWORD nFirst;
+  DWORD nSecond;
+};
+
+EXC_FILTER g_excFilters[EXC_TABLE_SIZE];
+int g_nExcFilters;
+int g_excDefaultPolicy = EXC_LOG;
+DWORD g_nExcOverflow;                   // Hits of codes that didn't fit.
+
+static const char *s_excPolicyNames[] = {"ignore", "log", "first", "second"};
+
+struct EXC_NAME
+{
+  DWORD code;
+  const char *name;
+};
+
+static const EXC_NAME s_excNames[] = {
+  {EXCEPTION_ACCESS_VIOLATION, "access violation"},
+  {EXCEPTION_ARRAY_BOUNDS_EXCEEDED, "array bounds"},
+  {EXCEPTION_DATATYPE_MISALIGNMENT, "misalignment"},
+  {EXCEPTION_FLT_DIVIDE_BY_ZERO, "float divide by zero"},
+  {EXCEPTION_ILLEGAL_INSTRUCTION, "illegal instruction"},
+  {EXCEPTION_INT_DIVIDE_BY_ZERO, "divide by zero"},
+  {EXCEPTION_PRIV_INSTRUCTION, "privileged instruction"},
+  {EXCEPTION_STACK_OVERFLOW, "stack overflow"},
+  {0xE06D7363, "C++ exception"},
+  {0x406D1388, "set thread name"},
+};
+
+const char* GetExceptionName(DWORD code)
+{
+  for (size_t i = 0; i < sizeof(s_excNames) / sizeof(s_excNames[0]); i++) {
+    if (code == s_excNames[i].code) {
+      return s_excNames[i].name;
+    }
+  }
+  return "";
+}
+
+EXC_FILTER* FindExceptionFilter(DWORD code, bool add)
+{
+  DWORD i = (code * 2654435761u) >> 24; // Fibonacci hash to 8 bits.
+  for (int n = 0; n < EXC_TABLE_SIZE; n++, i = (i + 1) & (EXC_TABLE_SIZE - 1)) {
+    EXC_FILTER &f = g_excFilters[i];
+    if (code == f.code) {
+      return &f;
+    }
+    if (0 == f.code) {
+      if (!add || EXC_TABLE_SIZE / 2 <= g_nExcFilters) { // Keep probes short.
+        return NULL;
+      }
+      f.code = code;
+      f.policy = g_excDefaultPolicy;
+      f.nFirst = f.nSecond = 0;
+      g_nExcFilters++;
+      return &f;
+    }
+  }
+  return NULL;
+}
+
+int FilterException(DWORD code, bool FirstChance)
+{
+  EXC_FILTER *f = FindExceptionFilter(code, true);
+  if (!f) {
+    g_nExcOverflow++;
+    return g_excDefaultPolicy;
+  }
+  if (FirstChance) {
+    f->nFirst++;
+  } else {
+    f->nSecond++;
+  }
+  return f->policy;
+}
+
+bool SetExceptionPolicy(const std::string &code, const std::string &policy)
+{
+  int p = -1;
+  for (size_t i = 0; i < sizeof(s_excPolicyNames) / sizeof(s_excPolicyNames[0]); i++) {
+    if (0 == _stricmp(policy.c_str(), s_excPolicyNames[i])) {
+      p = (int)i;
+    }
+  }
+  if (0 > p) {
+    printf("unknown policy %s\n", policy.c_str());
+    return false;
+  }
+  if ("*" == code) {                    // Default for codes not set explicitly.
+    g_excDefaultPolicy = p;
+    return true;
+  }
+  unsigned int c = 0;
+  if (1 != sscanf(code.c_str(), "%x", &c) || 0 == c) {
+    printf("invalid exception code %s\n", code.c_str());
+    return false;
+  }
+  EXC_FILTER *f = FindExceptionFilter(c, true);
+  if (!f) {
+    printf("exception table full\n");
+    return false;
+  }
+  f->policy = p;
+  return true;
+}
+
+void GetExceptionPolicies(std::vector<std::string> &codes, std::vector<std::string> &policies)
+{
+  //
+  // Default first, then codes whose policy differs from it.
+  //
+
+  codes.assign(1, "*");
+  policies.assign(1, s_excPolicyNames[g_excDefaultPolicy]);
+  for (int i = 0; i < EXC_TABLE_SIZE; i++) {
+    const EXC_FILTER &f = g_excFilters[i];
+    if (f.code && f.policy != g_excDefaultPolicy) {
+      char code[16];
+      sprintf(code, "%08x", f.code);
+      codes.push_back(code);
+      policies.push_back(s_excPolicyNames[f.policy]);
+    }
+  }
+}
+
+void ShowExceptionFilters()
+{
+  printf("default: %s\n", s_excPolicyNames[g_excDefaultPolicy]);
+  for (int i = 0; i < EXC_TABLE_SIZE; i++) {
+    const EXC_FILTER &f = g_excFilters[i];
+    if (f.code) {
+      printf("%08x %-7s first %8u second %4u  %s\n", f.code, s_excPolicyNames[f.policy], f.nFirst, f.nSecond, GetExceptionName(f.code));
+    }
+  }
+  if (g_nExcOverflow) {
+    printf("%u hits of codes not in table\n", g_nExcOverflow);
+  }
+}
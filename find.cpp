@@ -0,0 +1,286 @@
+#include "mydbg.h"
+
+#include <emmintrin.h>
+
+extern DEBUG_TARGET *g_target;
+
+#define FIND_CHUNK_SIZE (1024 * 1024)
+#define FIND_MAX_THREADS 16
+#define FIND_MAX_RESULTS 1000
+
+struct FIND_PATTERN
+{
+  std::vector<unsigned char> bytes;
+  std::vector<unsigned char> mask;      // 1 = byte must match, 0 = wildcard.
+  int anchor;                           // Index of first non-wildcard byte.
+  int shift[256];                       // Horspool bad character shift table.
+  int maxShift;
+};
+
+struct FIND_CHUNK
+{
+  DWORD64 address;
+  unsigned int size;                    // Includes overlap of (pattern length - 1) bytes.
+};
+
+struct FIND_JOB
+{
+  const FIND_PATTERN *pattern;
+  std::vector<FIND_CHUNK> chunks;
+  volatile LONG nextChunk;
+  volatile LONG matches;
+  volatile LONG kbScanned;
+  CRITICAL_SECTION lock;                // Serialize streamed output.
+};
+
+bool ParseFindPattern(const std::string &str, FIND_PATTERN &pat)
+{
+  pat.bytes.clear();
+  pat.mask.clear();
+
+  if ('"' == str[0] || ('L' == str[0] && '"' == str[1])) { // "ansi" or L"unicode" string.
+    bool unicode = 'L' == str[0];
+    size_t begin = unicode ? 2 : 1;
+    size_t end = str.find_last_of('"');
+    if (end <= begin) {
+      return false;
+    }
+    for (size_t i = begin; i < end; i++) {
+      pat.bytes.push_back((unsigned char)str[i]);
+      pat.mask.push_back(1);
+      if (unicode) {
+        pat.bytes.push_back(0);
+        pat.mask.push_back(1);
+      }
+    }
+  } else if ('-' == str[0]) {           // -w|-d|-q integer, little endian.
+    int size = 0;
+    switch (str[1]) {
+      case 'w': case 'W': size = 2; break;
+      case 'd': case 'D': size = 4; break;
+      case 'q': case 'Q': size = 8; break;
+      default:
+        return false;
+    }
+    long long value;
+    if (1 != sscanf(str.c_str() + 2, "%I64d", &value)) {
+      return false;
+    }
+    for (int i = 0; i < size; i++) {
+      pat.bytes.push_back((unsigned char)(value >> (8 * i)));
+      pat.mask.push_back(1);
+    }
+  } else {                              // Hex bytes, ?? = any byte.
+    const char *p = str.c_str();
+    while (*p) {
+      if (' ' == *p || '\t' == *p) {
+        p++;
+        continue;
+      }
+      if ('?' == p[0]) {
+        pat.bytes.push_back(0);
+        pat.mask.push_back(0);
+        p += '?' == p[1] ? 2 : 1;
+        continue;
+      }
+      unsigned int b;
+      int n = 0;
+      if (1 != sscanf(p, "%2x%n", &b, &n)) {
+        return false;
+      }
+      pat.bytes.push_back((unsigned char)b);
+      pat.mask.push_back(1);
+      p += n;
+    }
+  }
+
+  int m = (int)pat.bytes.size();
+  pat.anchor = -1;
+  for (int i = 0; i < m; i++) {
+    if (pat.mask[i]) {
+      pat.anchor = i;
+      break;
+    }
+  }
+  if (-1 == pat.anchor) {
+    return false;
+  }
+
+  //
+  // Horspool shift table. A wildcard matches any byte, so no shift may
+  // skip past the last wildcard before the final position.
+  //
+
+  int lastWild = -1;
+  for (int i = 0; i < m - 1; i++) {
+    if (!pat.mask[i]) {
+      lastWild = i;
+    }
+  }
+  pat.maxShift = m - 1 - lastWild;
+  for (int c = 0; c < 256; c++) {
+    pat.shift[c] = pat.maxShift;
+  }
+  for (int i = lastWild + 1; i < m - 1; i++) {
+    pat.shift[pat.bytes[i]] = m - 1 - i;
+  }
+
+  return true;
+}
+
+static bool MatchAt(const FIND_PATTERN &pat, const unsigned char *p)
+{
+  for (size_t i = 0; i < pat.bytes.size(); i++) {
+    if (pat.mask[i] && p[i] != pat.bytes[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void ReportMatch(FIND_JOB *job, DWORD64 addr)
+{
+  if (FIND_MAX_RESULTS < InterlockedIncrement(&job->matches)) {
+    return;
+  }
+  EnterCriticalSection(&job->lock);
+  printf("0x%08x\n", (unsigned int)addr);
+  LeaveCriticalSection(&job->lock);
+}
+
+static void ScanChunk(FIND_JOB *job, DWORD64 base, const unsigned char *data, int n)
+{
+  const FIND_PATTERN &pat = *job->pattern;
+  int m = (int)pat.bytes.size();
+  if (n < m) {
+    return;
+  }
+
+  int last = n - m;                     // Last possible match offset.
+  if (8 <= pat.maxShift && pat.mask[m - 1]) {
+    //
+    // Long pattern: Horspool, every mismatch skips shift[] bytes.
+    //
+
+    for (int i = 0; i <= last;) {
+      unsigned char c = data[i + m - 1];
+      if (c == pat.bytes[m - 1] && MatchAt(pat, data + i)) {
+        ReportMatch(job, base + i);
+      }
+      i += pat.shift[c];
+    }
+    return;
+  }
+
+  //
+  // Short or wildcard-heavy pattern: SSE2 filter on the anchor byte, 16 bytes
+  // per compare, and verify the whole pattern only on candidates.
+  //
+
+  int a = pat.anchor;
+  __m128i anchor = _mm_set1_epi8((char)pat.bytes[a]);
+  int i = 0;
+  for (; i + 16 <= last + 1; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(data + i + a));
+    unsigned int bits = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, anchor));
+    while (bits) {
+      int k = 0;
+      while (!(bits & (1u << k))) {
+        k++;
+      }
+      bits &= bits - 1;
+      if (MatchAt(pat, data + i + k)) {
+        ReportMatch(job, base + i + k);
+      }
+    }
+  }
+  for (; i <= last; i++) {
+    if (data[i + a] == pat.bytes[a] && MatchAt(pat, data + i)) {
+      ReportMatch(job, base + i);
+    }
+  }
+}
+
+static DWORD WINAPI FindWorker(LPVOID param)
+{
+  FIND_JOB *job = (FIND_JOB*)param;
+  std::vector<unsigned char> buff(FIND_CHUNK_SIZE + job->pattern->bytes.size());
+  while (FIND_MAX_RESULTS > job->matches) {
+    LONG i = InterlockedIncrement(&job->nextChunk) - 1;
+    if (i >= (LONG)job->chunks.size()) {
+      break;
+    }
+    const FIND_CHUNK &c = job->chunks[i];
+    if (!g_target->ReadMemory(c.address, &buff[0], c.size)) { // Bulk read, not recorded.
+      continue;
+    }
+    ScanChunk(job, c.address, &buff[0], (int)c.size);
+    InterlockedExchangeAdd(&job->kbScanned, (LONG)(c.size / 1024));
+  }
+  return 0;
+}
+
+bool FindMemory(const std::string &str)
+{
+  FIND_PATTERN pat;
+  if (str.empty() || !ParseFindPattern(str, pat)) {
+    printf("invalid find pattern\n");
+    return false;
+  }
+
+  FIND_JOB job;
+  job.pattern = &pat;
+  job.nextChunk = 0;
+  job.matches = 0;
+  job.kbScanned = 0;
+
+  //
+  // Split committed regions into chunks, overlapped so that a match across
+  // a chunk border is still found. Regions are scanned independently.
+  //
+
+  std::vector<MEM_REGION> regions;
+  EnumCommittedRegions(regions, false);
+  unsigned int overlap = (unsigned int)pat.bytes.size() - 1;
+  for (size_t i = 0; i < regions.size(); i++) {
+    const MEM_REGION &r = regions[i];
+    for (DWORD64 off = 0; off < r.size; off += FIND_CHUNK_SIZE) {
+      FIND_CHUNK c;
+      c.address = r.address + off;
+      c.size = (unsigned int)(std::min)((DWORD64)FIND_CHUNK_SIZE + overlap, r.size - off);
+      job.chunks.push_back(c);
+    }
+  }
+
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  int nThreads = (std::min)((int)si.dwNumberOfProcessors, FIND_MAX_THREADS);
+  nThreads = (std::max)(1, (std::min)(nThreads, (int)job.chunks.size()));
+
+  LARGE_INTEGER freq, t0, t1;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t0);
+
+  InitializeCriticalSection(&job.lock);
+  HANDLE threads[FIND_MAX_THREADS];
+  for (int i = 0; i < nThreads; i++) {
+    threads[i] = CreateThread(NULL, 0, FindWorker, &job, 0, NULL);
+  }
+  WaitForMultipleObjects(nThreads, threads, TRUE, INFINITE);
+  for (int i = 0; i < nThreads; i++) {
+    CloseHandle(threads[i]);
+  }
+  DeleteCriticalSection(&job.lock);
+
+  QueryPerformanceCounter(&t1);
+  double ms = (t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart;
+  double mb = job.kbScanned / 1024.0;
+  int matches = (int)job.matches;
+  if (FIND_MAX_RESULTS < matches) {
+    printf("Stopped after %d matches.\n", FIND_MAX_RESULTS);
+    matches = FIND_MAX_RESULTS;
+  }
+  printf("%d matches, %d regions, %.1f MB scanned in %.1f ms by %d threads\n", matches, (int)regions.size(), mb, ms, nThreads);
+
+  return 0 < job.matches;
+}
@@ -0,0 +1,176 @@
+#include "mydbg.h"
+
+#define FMT_CHUNK_SIZE (64 * 1024)
+
+//
+// Bump arena for the strings l, lg and watches build while the debuggee
+// is stopped: type names, values, raw variable bytes. Allocation is a
+// pointer bump, and all of it is let go at once when the debuggee is
+// continued. Chunks are kept for the next stop, so once they cover the
+// largest dump no further memory is allocated. Strings are STR_VIEWs
+// into the arena, always 0 terminated for printf.
+//
+
+struct FMT_CHUNK
+{
+  char *base;
+  size_t size;
+};
+
+std::vector<FMT_CHUNK> g_fmtChunks;
+size_t g_fmtChunk;                      // Chunk being bumped.
+size_t g_fmtUsed;                       // Bytes used of it.
+DWORD g_nFmtAllocs;                     // Arena allocations this stop.
+DWORD g_nFmtChunkAllocs;                // Chunks allocated, ever.
+DWORD64 g_fmtBytes, g_fmtPeak;          // Bytes this stop, most in one stop.
+
+char* FmtAlloc(size_t size)
+{
+  size = (size + 7) & ~(size_t)7;
+  g_nFmtAllocs++;
+  g_fmtBytes += size;
+  while (g_fmtChunk < g_fmtChunks.size()) {
+    FMT_CHUNK &c = g_fmtChunks[g_fmtChunk];
+    if (g_fmtUsed + size <= c.size) {
+      char *p = c.base + g_fmtUsed;
+      g_fmtUsed += size;
+      return p;
+    }
+    g_fmtChunk++;
+    g_fmtUsed = 0;
+  }
+
+  FMT_CHUNK c;
+  c.size = (std::max)((size_t)FMT_CHUNK_SIZE, size);
+  c.base = (char*)VirtualAlloc(NULL, c.size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (!c.base) {
+    return NULL;
+  }
+  g_nFmtChunkAllocs++;
+  g_fmtChunks.push_back(c);
+  g_fmtChunk = g_fmtChunks.size() - 1;
+  g_fmtUsed = size;
+  return c.base;
+}
+
+void ResetFmtArena()
+{
+  g_fmtPeak = (std::max)(g_fmtPeak, g_fmtBytes);
+  g_fmtChunk = 0;
+  g_fmtUsed = 0;
+  g_nFmtAllocs = 0;
+  g_fmtBytes = 0;
+}
+
+STR_VIEW FmtView(const char *s)
+{
+  STR_VIEW v = {s, strlen(s)};
+  return v;
+}
+
+STR_VIEW FmtCopy(const char *s, size_t n)
+{
+  char *p = FmtAlloc(n + 1);
+  if (!p) {
+    return FmtView("");
+  }
+  memcpy(p, s, n);
+  p[n] = 0;
+  STR_VIEW v = {p, n};
+  return v;
+}
+
+STR_VIEW FmtCat(STR_VIEW a, STR_VIEW b, STR_VIEW c)
+{
+  char *p = FmtAlloc(a.n + b.n + c.n + 1);
+  if (!p) {
+    return FmtView("");
+  }
+  memcpy(p, a.p, a.n);
+  memcpy(p + a.n, b.p, b.n);
+  memcpy(p + a.n + b.n, c.p, c.n);
+  p[a.n + b.n + c.n] = 0;
+  STR_VIEW v = {p, a.n + b.n + c.n};
+  return v;
+}
+
+char* FmtUInt(char *first, char *last, ULONGLONG value, int base)
+{
+  //
+  // Digits of value at first, like to_chars: returns the end, or NULL if
+  // they don't fit. No terminator.
+  //
+
+  static const char s_digits[] = "0123456789abcdef";
+  char buff[64];
+  char *p = buff + sizeof(buff);
+  do {
+    *--p = s_digits[value % base];
+    value /= base;
+  } while (value);
+  size_t n = buff + sizeof(buff) - p;
+  if ((size_t)(last - first) < n) {
+    return NULL;
+  }
+  memcpy(first, p, n);
+  return first + n;
+}
+
+char* FmtInt(char *first, char *last, LONGLONG value)
+{
+  if (0 <= value) {
+    return FmtUInt(first, last, (ULONGLONG)value, 10);
+  }
+  if (first == last) {
+    return NULL;
+  }
+  *first = '-';
+  return FmtUInt(first + 1, last, 0 - (ULONGLONG)value, 10);
+}
+
+STR_VIEW FmtNumber(LONGLONG value)
+{
+  char buff[24];
+  char *end = FmtInt(buff, buff + sizeof(buff), value);
+  return FmtCopy(buff, end - buff);
+}
+
+STR_VIEW FmtUNumber(ULONGLONG value, const char *prefix, int base)
+{
+  char buff[32];
+  size_t n = strlen(prefix);
+  memcpy(buff, prefix, n);
+  char *end = FmtUInt(buff + n, buff + sizeof(buff), value, base);
+  return FmtCopy(buff, end - buff);
+}
+
+STR_VIEW FmtHexBytes(const char *data, size_t size)
+{
+  //
+  // "xx xx ... " for raw values.
+  //
+
+  static const char s_hex[] = "0123456789abcdef";
+  char *p = FmtAlloc(3 * size + 1);
+  if (!p) {
+    return FmtView("");
+  }
+  for (size_t i = 0; i < size; i++) {
+    p[3 * i] = s_hex[(unsigned char)data[i] >> 4];
+    p[3 * i + 1] = s_hex[data[i] & 0x0f];
+    p[3 * i + 2] = ' ';
+  }
+  p[3 * size] = 0;
+  STR_VIEW v = {p, 3 * size};
+  return v;
+}
+
+void ShowFmtArenaStats()
+{
+  DWORD64 reserved = 0;
+  for (size_t i = 0; i < g_fmtChunks.size(); i++) {
+    reserved += g_fmtChunks[i].size;
+  }
+  printf("format arena: %u allocs %I64u bytes this stop, peak %I64u bytes, %u chunks (%I64u bytes) allocated\n",
+         g_nFmtAllocs, g_fmtBytes, (std::max)(g_fmtPeak, g_fmtBytes), g_nFmtChunkAllocs, reserved);
+}
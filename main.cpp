@@ -1,5 +1,8 @@
 #include "mydbg.h"
 
+#include <conio.h>
+#include <io.h>
+
 int g_dbgState = DBGS_NONE;
 
 PROCESS_INFORMATION g_piDbgee = { 0 };
@@ -23,7 +26,7 @@ void DumpMemory(unsigned int addr, unsigned int count)
   std::string mem;
   mem.resize(total);
 
-  ReadProcessMemory(g_piDbgee.hProcess, (LPCVOID)g_addrDump, (LPVOID)mem.data(), total, NULL);
+  ReadDbgeeMemory(g_addrDump, (LPVOID)mem.data(), total);
 
   for (unsigned int i = 0; i < total;++i) {
     printf("%08X  ", addrTag);
@@ -66,7 +69,7 @@ void DumpRegisters()
 {
   CONTEXT ctx;
   ctx.ContextFlags = CONTEXT_INTEGER | CONTEXT_CONTROL;
-  GetThreadContext(g_piDbgee.hThread, &ctx);
+  GetDbgeeContext(ctx);
   printf("EAX = 0x%08x, EBX = 0x%08x, ECX = 0x%08x, EDX = 0x%08x, ESI = 0x%08x, EDI = 0x%08x\n", ctx.Eax, ctx.Ebx, ctx.Ecx, ctx.Edx, ctx.Esi, ctx.Edi);
   printf("EIP = 0x%08x, EBP = 0x%08x, ESP = 0x%08x, EFlags = 0x%08x\n", ctx.Eip, ctx.Ebp, ctx.Esp, ctx.EFlags);
 }
@@ -75,78 +78,214 @@ void ShowCommandHelp()
 {
   printf("mydbg source level debugger commands:\n");
   printf("toggle bp\tb|B address|function|source lineno\n");
-  printf("call stacks\tc|C\n");
+  printf("pattern bp\tb|B function pattern|source pattern *\n");
+  printf("grep result bp\tb|B #index\n");
+  printf("call stacks\tc|C, c * all threads\n");
   printf("dump\t\td|D [range]\n");
+  printf("diff snapshot\tdiff\n");
+  printf("write dump\tdump file\n");
+  printf("find\t\tf|F pattern\n");
   printf("go\t\tg|G\n");
+  printf("grep source\tgrep text\n");
   printf("globals\t\tlg|LG\n");
-  printf("locals\t\tl|L\n");
+  printf("debug strings\tods\n");
+  printf("locals\t\tl|L changed since last l, la|LA all\n");
   printf("set next st\ts|S address|function|source lineno\n");
+  printf("non-stop\tset nonstop on|off, only the stopped thread halts\n");
+  printf("run script\tscript file\n");
+  printf("snapshot\tsnap [range]\n");
+  printf("event stats\tstats [reset]\n");
+  printf("exceptions\tsx [code|* ignore|log|first|second]\n");
+  printf("threads\t\tthreads, thread tid switches\n");
   printf("step into\tt|T\n");
-  printf("step out\to|O\n");
+  printf("step mode\tset stepmode btf|tf, branch or instruction traps\n");
+  printf("step out\to|O [frames], finish [frames]\n");
   printf("step over\tp|P\n");
   printf("quit\t\tq|Q\n");
   printf("registers\tr|R\n");
+  printf("disassemble\tu|U [address] [count], u flush after code changed by the debuggee\n");
+  printf("watch\t\tw|W [expression], wd [index]\n");
+  printf("symbols\t\tx|X name, prefix, substring or fuzzy, Tab completes at prompt\n");
   printf("    range = address [count]\n");
   printf("    address: hex, count: dec\n");
   printf("    source: full path, lineno: dec(from 1)\n");
   printf("    default range count: 128\n");
+  printf("    default snap range: all writable memory, count with address: one page\n");
+  printf("    expression: [*]name{.member|->member|[index]}, shown at every stop when changed\n");
+  printf("    function/source pattern: * = any run, ? = any char\n");
+  printf("    pattern: hex bytes(?? = any), \"string\", L\"string\", -w|-d|-q dec\n");
 }
 
-void HandleUserCommand()
+bool IsCommand(const std::string &str, const char *name)
 {
-  printf(">");
+  size_t n = strlen(name);
+  return 0 == _strnicmp(str.c_str(), name, n) && (str.size() == n || ' ' == str[n] || '\t' == str[n]);
+}
 
-  char buff[256];
-  if (!fgets(buff , sizeof(buff), stdin)) {
-    return;
+bool IsResumeCommand(const std::string &str)
+{
+  //
+  // Commands that continue the debuggee (or end it), as ExecuteCommand
+  // dispatches them.
+  //
+
+  if (str.empty()) {
+    return false;
   }
+  switch (str[0]) {
+    case 'g': case 'G':
+      return !IsCommand(str, "grep");
+    case 't': case 'T':
+      return !IsCommand(str, "threads") && !IsCommand(str, "thread");
+    case 'o': case 'O':
+      return !IsCommand(str, "ods");
+    case 'f': case 'F':
+      return IsCommand(str, "finish");
+    case 'p': case 'P': case 'q': case 'Q':
+      return true;
+  }
+  return false;
+}
 
-  std::string str(buff);
-  str.erase(0, str.find_first_not_of(" \t\r\n")); // Trim space.
-  str.erase(str.find_last_not_of(" \t\r\n") + 1);
+void ExecuteCommand(const std::string &str)
+{
   if (str.empty()) {
     ShowCommandHelp();
     return;
   }
 
+  SetTraceCommand(str);
   switch (str[0]) {
     case 'b': case 'B':                 // Toggle break point.
       {
         char key[2];
         char fn[MAX_PATH];
+        char star[2];
         unsigned int addr;
-        if (3 == sscanf(str.c_str(), "%1s %99s %d", key, fn, &addr)) {
+        int result;
+        if (2 == sscanf(str.c_str(), "%1s #%d", key, &result)) {
+          ToggleGrepBreakPoint(result);
+        } else if (3 == sscanf(str.c_str(), "%1s %99s %1s", key, fn, star) && '*' == star[0]) {
+          ToggleBreakPointPattern(fn, true);
+        } else if (2 == sscanf(str.c_str(), "%1s %99s", key, fn) && strpbrk(fn, "*?")) {
+          ToggleBreakPointPattern(fn, false);
+        } else if (3 == sscanf(str.c_str(), "%1s %99s %d", key, fn, &addr)) {
           ToggleBreakPoint(fn, addr);
         } else if (2 == sscanf(str.c_str(), "%1s %x", key, &addr)) {
           ToggleBreakPoint(addr);
         } else if (2 == sscanf(str.c_str(), "%1s %99s", key, fn)) {
-          ToggleBreakPoint(fn);
+          if (!ToggleBreakPoint(fn)) {
+            SuggestSymbols(fn);
+          }
         } else {
           printf("invalid b cmd\n");
         }
       }
       break;
     case 'c': case 'C':
-      DumpCallStacks();
+      if (std::string::npos != str.find('*', 1)) {
+        DumpAllCallStacks();
+      } else {
+        DumpCallStacks();
+      }
       break;
     case 'd': case 'D':                 // Dump memory.
+      if (IsCommand(str, "diff")) {
+        DiffSnapshot();
+        break;
+      }
+      if (IsCommand(str, "dump")) {
+        std::string fn(str, 4);
+        fn.erase(0, fn.find_first_not_of(" \t"));
+        if (fn.empty()) {
+          printf("invalid dump cmd\n");
+        } else {
+          WriteDumpFile(fn.c_str());
+        }
+        break;
+      }
       {
         unsigned int addr = 0, count = 128;
         sscanf(str.c_str() + 1, "%x %d", &addr, &count);
         DumpMemory(addr, count);
       }
       break;
+    case 'f': case 'F':                 // Find pattern in memory.
+      if (IsCommand(str, "finish")) {
+        int count = 1;
+        sscanf(str.c_str() + 6, "%d", &count);
+        StepOut((std::max)(1, count));
+        break;
+      }
+      {
+        std::string pattern(str, 1);
+        pattern.erase(0, pattern.find_first_not_of(" \t"));
+        FindMemory(pattern);
+      }
+      break;
     case 'g': case 'G':                 // Go, exit break and continue run.
+      if (IsCommand(str, "grep")) {
+        std::string text(str, 4);
+        text.erase(0, text.find_first_not_of(" \t"));
+        GrepSource(text);
+        break;
+      }
       Go();
       break;
     case 'l': case 'L':
       if ('g' == str[1] || 'G' == str[1]) {
         DumpGlobals();
+      } else if ('a' == str[1] || 'A' == str[1]) {
+        DumpLocals(false);
       } else {
-        DumpLocals();
+        DumpLocals(true);
       }
       break;
     case 's': case 'S':                 // Set next statement.
+      if (IsCommand(str, "script")) {
+        std::string fn(str, 6);
+        fn.erase(0, fn.find_first_not_of(" \t"));
+        LoadScript(fn.c_str());
+        break;
+      }
+      if (IsCommand(str, "stats")) {
+        if (std::string::npos != str.find("reset", 5)) {
+          ResetEventStats();
+        } else {
+          ShowEventStats();
+          ShowFmtArenaStats();
+        }
+        break;
+      }
+      if (IsCommand(str, "sx")) {
+        char key[3], code[16], policy[16];
+        if (3 == sscanf(str.c_str(), "%2s %15s %15s", key, code, policy)) {
+          SetExceptionPolicy(code, policy);
+        } else {
+          ShowExceptionFilters();
+        }
+        break;
+      }
+      if (IsCommand(str, "set")) {
+        char key[4], name[16], value[8];
+        int n = sscanf(str.c_str(), "%3s %15s %7s", key, name, value);
+        if (3 == n && 0 == _stricmp(name, "nonstop")) {
+          SetNonStop(0 == _stricmp(value, "on"));
+        } else if (3 == n && 0 == _stricmp(name, "stepmode")) {
+          SetStepMode(value);
+        } else {
+          printf("invalid set cmd\n");
+        }
+        break;
+      }
+      if (IsCommand(str, "snap")) {
+        unsigned int addr = 0, count = 0;
+        if (1 == sscanf(str.c_str() + 4, "%x %d", &addr, &count)) {
+          count = 0x1000;                 // Address alone, its page. Bare snap takes all.
+        }
+        TakeSnapshot(addr, count);
+        break;
+      }
       {
         char key[2];
         char fn[MAX_PATH];
@@ -156,21 +295,78 @@ void HandleUserCommand()
         } else if (2 == sscanf(str.c_str(), "%1s %x", key, &addr)) {
           SetNextStatement(addr);
         } else if (2 == sscanf(str.c_str(), "%1s %99s", key, fn)) {
-          SetNextStatement(fn);
+          if (!SetNextStatement(fn)) {
+            SuggestSymbols(fn);
+          }
         } else {
           printf("invalid s cmd\n");
         }
       }
       break;
     case 't': case 'T':
+      if (IsCommand(str, "threads")) {
+        ShowThreads();
+        break;
+      }
+      if (IsCommand(str, "thread")) {
+        unsigned int tid = 0;
+        if (1 == sscanf(str.c_str() + 6, "%u", &tid)) {
+          SelectThread(tid);
+        } else {
+          printf("invalid thread cmd\n");
+        }
+        break;
+      }
       StepInto();
       break;
-    case 'o': case 'O':
-      StepOut();
+    case 'o': case 'O':                 // Step out [count] frames.
+      if (IsCommand(str, "ods")) {
+        ShowOdsStats();
+        break;
+      }
+      {
+        int count = 1;
+        sscanf(str.c_str() + 1, "%d", &count);
+        StepOut((std::max)(1, count));
+      }
       break;
     case 'p': case 'P':
       StepOver();
       break;
+    case 'u': case 'U':                 // Disassemble.
+      {
+        char key[2], sub[8];
+        if (2 == sscanf(str.c_str(), "%1s %7s", key, sub) && 0 == _stricmp(sub, "flush")) {
+          FlushDisasmCache();
+          break;
+        }
+      }
+      {
+        unsigned int addr = 0, count = 16;
+        sscanf(str.c_str() + 1, "%x %d", &addr, &count);
+        Disassemble(addr, (std::max)(1, (int)count));
+      }
+      break;
+    case 'w': case 'W':                 // Watch list.
+      if (IsCommand(str, "wd")) {
+        int i = -1;
+        sscanf(str.c_str() + 2, "%d", &i);
+        RemoveWatch(i);
+      } else if (1 == str.size()) {
+        ShowWatches(false);
+      } else {
+        std::string expr(str, 1);
+        expr.erase(0, expr.find_first_not_of(" \t"));
+        AddWatch(expr, false);
+      }
+      break;
+    case 'x': case 'X':                 // Look up symbols.
+      {
+        std::string query(str, 1);
+        query.erase(0, query.find_first_not_of(" \t"));
+        ShowSymbols(query);
+      }
+      break;
     case 'q': case 'Q':
       HandleProcessExited();
       break;
@@ -183,34 +379,237 @@ void HandleUserCommand()
   }
 }
 
+//
+// Prompt input. On a console Tab completes the symbol name being typed to
+// the longest common prefix, a second Tab lists the candidates.
+//
+
+bool ReadCommandLine(std::string &str)
+{
+  if (!_isatty(_fileno(stdin))) {
+    char buff[256];
+    if (!fgets(buff , sizeof(buff), stdin)) {
+      return false;
+    }
+    str = buff;
+    return true;
+  }
+
+  str.clear();
+  int tabs = 0;
+  while (true) {
+    while (IsNonStop() && !_kbhit()) {  // Other threads run meanwhile.
+      if (!PumpNonStopEvents(50)) {
+        return false;
+      }
+    }
+    fflush(stdout);                     // Echo shows with -script's buffered stdout too.
+    int c = _getch();
+    if ('\r' == c || '\n' == c) {
+      printf("\n");
+      return true;
+    }
+    if (0 == c || 0xe0 == c) {          // Arrow or function key, second code follows.
+      _getch();
+      continue;
+    }
+    if ('\t' != c) {
+      tabs = 0;
+    }
+    if ('\b' == c) {
+      if (!str.empty()) {
+        str.erase(str.size() - 1);
+        printf("\b \b");
+      }
+    } else if ('\t' == c) {
+      size_t begin = str.find_last_of(" \t");
+      std::string prefix(str, std::string::npos == begin ? 0 : begin + 1);
+      std::vector<std::string> names;
+      if (!prefix.empty()) {
+        CompleteSymbol(prefix, 100, names);
+      }
+      if (names.empty()) {
+        continue;
+      }
+      size_t n = names[0].size();
+      for (size_t i = 1; i < names.size(); i++) {
+        size_t j = 0;
+        while (j < n && j < names[i].size() && names[0][j] == names[i][j]) {
+          j++;
+        }
+        n = j;
+      }
+      if (n > prefix.size()) {
+        std::string more(names[0], prefix.size(), n - prefix.size());
+        str += more;
+        printf("%s", more.c_str());
+      } else if (2 <= ++tabs) {
+        printf("\n");
+        for (size_t i = 0; i < names.size(); i++) {
+          printf("  %s\n", names[i].c_str());
+        }
+        printf(">%s", str.c_str());
+      }
+    } else if (' ' <= c && 0x7f != c) {
+      str += (char)c;
+      putchar(c);
+    }
+  }
+}
+
+void HandleUserCommand()
+{
+  UpdateSourceIndex();                  // Builds in the background while the user types.
+  if (1 < GetHeldThreadCount()) {
+    printf("[%u held]", (unsigned int)GetHeldThreadCount());
+  }
+  printf(">");
+  fflush(stdout);
+
+  std::string str;
+  if (!ReadCommandLine(str)) {
+    return;
+  }
+
+  str.erase(0, str.find_first_not_of(" \t\r\n")); // Trim space.
+  str.erase(str.find_last_not_of(" \t\r\n") + 1);
+  ExecuteCommand(str);
+}
+
 void DebuggerMainLoop()
 {
   while (true) {
     switch (g_dbgState) {
       case DBGS_BREAK:
-        HandleUserCommand();
+        if (IsServerRunning()) {
+          ServeDebugClient();
+        } else if (IsScriptRunning()) {
+          RunScript();
+        } else {
+          HandleUserCommand();
+        }
         break;
       case DBGS_EXIT_PROCESS:
+        if (IsScriptRunning()) {
+          RunScript();
+        }
         return;
       default:
-        DebugEventLoop();
+        if (!SelectHeldThread()) {
+          DebugEventLoop();
+        }
         break;
     }
   }
 }
 
-int main()
+#define DBGEE_PATH "D:\\vs.net\\testc2\\bin\\Debug\\testc2.exe"
+
+bool LaunchDbgee(const char *exe)
 {
   STARTUPINFO si = { 0 };
   si.cb = sizeof(si);
 
-  if (!CreateProcess(TEXT("D:\\vs.net\\testc2\\bin\\Debug\\testc2.exe"), NULL, NULL, NULL, FALSE, DEBUG_ONLY_THIS_PROCESS | CREATE_NEW_CONSOLE, NULL, NULL, &si, &g_piDbgee)) {
+  if (!CreateProcess(exe, NULL, NULL, NULL, FALSE, DEBUG_ONLY_THIS_PROCESS | CREATE_NEW_CONSOLE, NULL, NULL, &si, &g_piDbgee)) {
     printf("CreateProcess failed: %u\n", GetLastError());
-    return -1;
+    return false;
   }
+  MarkStartupPhase("create process");
   printf("pid=%d, tid=%d\n", g_piDbgee.dwProcessId, g_piDbgee.dwThreadId);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *record = NULL, *replay = NULL, *script = NULL, *dump = NULL, *ods = NULL, *trace = NULL;
+  const char *session = NULL;
+  int serverPort = 0;
+  bool startupTimes = false;
+  for (int i = 1; i < argc; i++) {
+    bool hasArg = i + 1 < argc;
+    if (0 == strcmp(argv[i], "-startup-times")) {
+      startupTimes = true;
+    } else if (0 == strcmp(argv[i], "-record") && hasArg) {
+      record = argv[++i];
+    } else if (0 == strcmp(argv[i], "-replay") && hasArg) {
+      replay = argv[++i];
+    } else if (0 == strcmp(argv[i], "-dump") && hasArg) {
+      dump = argv[++i];
+    } else if (0 == strcmp(argv[i], "-ods") && hasArg) {
+      ods = argv[++i];
+    } else if (0 == strcmp(argv[i], "-session") && hasArg) {
+      session = argv[++i];
+    } else if (0 == strcmp(argv[i], "-trace") && hasArg) {
+      trace = argv[++i];
+    } else if (0 == strcmp(argv[i], "-script") && hasArg) {
+      script = argv[++i];
+    } else if (0 == strcmp(argv[i], "-server") && hasArg) {
+      serverPort = atoi(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-bench-server") && hasArg) { // Stand-in client: -bench-server port [reads].
+      int port = atoi(argv[++i]);
+      return BenchDebugServer(port, i + 1 < argc ? atoi(argv[i + 1]) : 100000);
+    } else if (0 == strcmp(argv[i], "-bench-startup") && hasArg) { // -bench-startup runs [exe].
+      int runs = atoi(argv[++i]);
+      return BenchStartup(i + 1 < argc ? argv[i + 1] : DBGEE_PATH, (std::max)(1, runs));
+    }
+  }
+
+  if (script) {
+    setvbuf(stdout, NULL, _IOFBF, 64 * 1024); // No console round trip per line. Before any output, as the CRT requires.
+  }
+
+  if (trace) {
+    StartTrace(trace);
+  }
+
+  if (script && !LoadScript(script)) {
+    return -1;
+  }
+
+  if (dump) {                           // Post-mortem on a dump file, no debuggee process.
+    if (!OpenDumpFile(dump)) {
+      return -1;
+    }
+    DebuggerMainLoop();
+    StopTrace();
+    return 0;
+  }
+
+  if (replay) {                         // Replay a recorded session, no debuggee process.
+    if (!OpenReplayLog(replay)) {
+      return -1;
+    }
+    DebuggerMainLoop();
+    ShowEventStats();
+    StopTrace();
+    return 0;
+  }
+
+  if (record && !OpenRecordLog(record)) {
+    return -1;
+  }
+
+  if (session) {
+    LoadSession(session);
+  }
+
+  if (ods && !StartOdsCapture(ods)) {
+    return -1;
+  }
+
+  if (serverPort && !StartDebugServer(serverPort)) {
+    return -1;
+  }
+
+  BeginStartupTiming(startupTimes);
+  if (!LaunchDbgee(DBGEE_PATH)) {
+    return -1;
+  }
 
   DebuggerMainLoop();
+  StopDebugServer();
+  ShowEventStats();
+  StopTrace();
 
   return 0;
 }
@@ -18,6 +18,27 @@ enum DEBUGGER_STATE {
   DBGS_EXIT_PROCESS = 100
 };
 
+enum STOP_REASON {
+  STOP_NONE = 0,
+  STOP_BREAKPOINT,
+  STOP_STEP,
+  STOP_EXIT,
+  STOP_EXCEPTION
+};
+
+enum EXC_POLICY {
+  EXC_IGNORE = 0,                       // Count only, pass to debuggee.
+  EXC_LOG,                              // Count and print, pass to debuggee.
+  EXC_BREAK_FIRST,                      // Break on first and second chance.
+  EXC_BREAK_SECOND                      // Print, break on second chance.
+};
+
+struct STR_VIEW
+{
+  const char *p;                        // 0 terminated.
+  size_t n;
+};
+
 struct LINE
 {
   std::string line;
@@ -27,44 +48,294 @@ struct LINE
 typedef std::vector<LINE> SourceLines_t;
 typedef std::map<std::string, SourceLines_t> SourceFiles_t; // <FileName, [Lines]>
 
+struct MEM_REGION
+{
+  DWORD64 address;
+  DWORD64 size;
+  DWORD protect;
+};
+
+//
+// Debuggee access backend. The core reaches it through the *Dbgee* wrappers
+// in dbgee.cpp. Thread is given by id.
+//
+
+struct DEBUG_TARGET
+{
+  const char *name;
+  BOOL (*ReadMemory)(DWORD64 addr, LPVOID buff, SIZE_T size);
+  BOOL (*WriteMemory)(DWORD64 addr, LPCVOID buff, SIZE_T size);
+  void (*QueryRegions)(std::vector<MEM_REGION> &regions, bool WritableOnly);
+  BOOL (*GetContext)(DWORD tid, CONTEXT &ctx);
+  BOOL (*SetContext)(DWORD tid, const CONTEXT &ctx);
+  BOOL (*WaitEvent)(DEBUG_EVENT &ev, DWORD timeout);
+  BOOL (*ContinueEvent)(DWORD pid, DWORD tid, DWORD ContinueStatus);
+  DWORD64 (*LoadModule)(HANDLE hFile, DWORD64 base);
+  DWORD64 (*AllocCode)(SIZE_T size);    // Executable memory, 0 if none.
+};
+
+//
+// Span of a traced call, recorded when it goes out of scope if -trace is
+// on. TRACE_CALL("name", call) times one call inside an expression.
+//
+
+struct TRACE_SPAN
+{
+  TRACE_SPAN(const char *name, DWORD size);
+  ~TRACE_SPAN();
+  const char *name;
+  DWORD size;
+  LONGLONG begin;
+};
+
+#define TRACE_CALL(name, call) (TRACE_SPAN(name, 0), (call))
+
 struct BREAK_POINT
 {
   std::string fn;
   int LineNumber;                       // 1-based.
   DWORD64 address;
   unsigned char saveCode;
+  std::string pattern;                  // Pattern it was set by, empty if none.
+};
+
+struct BP_PATTERN
+{
+  std::string pattern;                  // '*' and '?' wildcards.
+  bool source;                          // Match source file, not function name.
+};
+
+//
+// Debuggee thread and its stepping state. A step belongs to the thread it
+// was started on.
+//
+
+struct DBG_THREAD
+{
+  DWORD tid;
+  HANDLE hThread;                       // NULL in replay and dumps.
+  DWORD64 startAddress;
+  DWORD64 tmpBpAddr;                    // Step over / out temp bp.
+  DWORD64 stepOutFrame;                 // Frame base of outermost frame being stepped out.
+  std::string lastBreakSource;
+  int lastBreakLine;
+  bool held;                            // Non-stop, suspended at a stop.
+  bool frozen;                          // Suspended while another steps off a bp.
+  DWORD64 scratch;                      // Displaced step slot, 0 if none yet.
+  DWORD64 stepOffAddr;                  // Bp single-stepped off, written back after single-step.
+  bool stepOffTf;                       // Single-step off the bp belongs to a step.
+  DWORD64 lineBegin, lineEnd;           // Line being branch-stepped, 0 if none.
+  bool lineEndBp;                       // Temp bp at lineEnd is ours.
+};
+
+enum X86_KIND {
+  X86_PLAIN = 0,
+  X86_JMP,                              // JMP rel8/rel32.
+  X86_JCC,                              // Jcc rel8/rel32.
+  X86_CALL,                             // CALL rel32.
+  X86_CALL_INDIRECT,                    // CALL r/m32.
+  X86_LOOP,                             // LOOPcc/JECXZ rel8.
+  X86_FAR                               // Far CALL/JMP.
+};
+
+struct X86_INST
+{
+  int length;
+  int kind;
+  int opcode;                           // Offset of opcode, after prefixes.
+  int modrm;                            // Offset of ModRM, -1 if none.
+  DWORD64 target;                       // Relative branch target.
+  bool usesEsp;                         // ModRM operand based on ESP.
+};
+
+struct SYM_INDEX_ENTRY
+{
+  DWORD name;                           // Offset into module's name pool.
+  DWORD64 address;
 };
 
 //
 // Functions.
 //
 
+int AddBreakPoints(std::vector<BREAK_POINT> &bps);
+void AddDbgeeThread(DWORD tid, HANDLE hThread, DWORD64 startAddress);
+void AddIndexModule(DWORD64 base);
+void AddModuleLoadTime(LONGLONG ticks);
 bool AddTempBreakPoint(DWORD64 addr);
+bool AddWatch(const std::string &expr, bool quiet);
+void ApplyPatternBreakPoints(DWORD64 base);
+void ApplySessionBreakPoints(DWORD64 base);
+void ApplySessionWatches();
+bool BeginBranchStep();
+void BeginEventStats(const DEBUG_EVENT &ev);
+void BeginStartupTiming(bool print);
+void BeginStepStats(bool branch);
+int BenchDebugServer(int port, int nReads);
+int BenchStartup(const char *exe, int runs);
+void CaptureDebugString(const OUTPUT_DEBUG_STRING_INFO &pi);
+void ClearBreakPoints();
+void ClearCpuSingleStepFlag();
+void ClearDbgeeThreads();
+void ClearDisasmCache();
+void ClearDisplacedSteps();
+void ClearHeldThreads();
+void ClearLocalsCache();
+void ClearSourceIndex();
+void ClearSymbolIndex();
+void CloseDumpFile();
+void CloseRecordLog();
+void CompleteSymbol(const std::string &prefix, size_t max, std::vector<std::string> &names);
+void Continue();
+BOOL ContinueDbgeeEvent(DWORD ContinueStatus);
+void CountStepTrap();
 void DebugEventLoop();
+void DecodeDebugString(const unsigned char *p, size_t size, bool unicode, std::string &out);
+bool DecodeX86(const unsigned char *code, size_t size, DWORD64 addr, X86_INST &inst);
+bool DiffSnapshot();
+void Disassemble(DWORD64 addr, int count);
 bool DisplaySourceLines(const std::string &fn, int LineNumber);
+void DoBranchStep(int state);
+void DumpAllCallStacks();
+void DumpCallStack(CONTEXT ctx);
 void DumpCallStacks();
 void DumpGlobals();
-void DumpLocals();
+void DumpLocals(bool ChangedOnly);
+void EndEventStats();
+void EndHandlerStats();
+void EndStartupTiming();
+void EndStep();
+void EndStepStats();
+void EnumCommittedRegions(std::vector<MEM_REGION> &regions, bool WritableOnly);
+void ExecuteCommand(const std::string &str);
+int FilterException(DWORD code, bool FirstChance);
 const BREAK_POINT* FindBreakPoint(DWORD64 addr);
+DBG_THREAD* FindDbgeeThread(DWORD tid);
+void FindIndexSymbols(DWORD64 base, const std::string &pattern, std::vector<SYM_INDEX_ENTRY> &matches);
+bool FindMemory(const std::string &str);
+void FlushDisasmCache();
+char* FmtAlloc(size_t size);
+STR_VIEW FmtCat(STR_VIEW a, STR_VIEW b, STR_VIEW c);
+STR_VIEW FmtCopy(const char *s, size_t n);
+STR_VIEW FmtHexBytes(const char *data, size_t size);
+char* FmtInt(char *first, char *last, LONGLONG value);
+STR_VIEW FmtNumber(LONGLONG value);
+char* FmtUInt(char *first, char *last, ULONGLONG value, int base);
+STR_VIEW FmtUNumber(ULONGLONG value, const char *prefix, int base);
+STR_VIEW FmtView(const char *s);
+void FormatX86(const X86_INST &inst, const unsigned char *code, std::string &text);
+void GetAllThreadContexts(std::vector<DWORD> &tids, std::vector<CONTEXT> &ctxs);
 DWORD64 GetCurrIp();
+DBG_THREAD* GetCurrThread();
+HANDLE GetCurrThreadHandle();
+DWORD GetCurrThreadId();
+BOOL GetDbgeeContext(CONTEXT &ctx);
+void GetExceptionPolicies(std::vector<std::string> &codes, std::vector<std::string> &policies);
+size_t GetHeldThreadCount();
+void GetIndexModules(std::vector<DWORD64> &bases);
 bool GetSourceLineByAddr(DWORD64 Addr, std::string &fn, int &LineNumber, DWORD &displacement);
-std::string GetVariableTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo);
+bool GetSourceLineText(const std::string &fn, int LineNumber, std::string &text);
+STR_VIEW GetVariableTypeName(ULONG typeId, PSYMBOL_INFO pSymInfo);
+STR_VIEW GetVariableValue(ULONG typeId, PSYMBOL_INFO pSymInfo, const char *data, size_t size);
+void GetWatchExpressions(std::vector<std::string> &exprs);
 void Go();
+void GrepSource(const std::string &text);
+bool HandleBranchStep();
+bool HandleOtherThreadBreak(const BREAK_POINT *bp);
+void HandleProcessExited();
 bool HandleSoftBreak(const BREAK_POINT* bp);
-bool HandleSoftBreakSingleStep(const BREAK_POINT* bp);
 bool HandleStepIntoSingleStep();
+bool HandleStepOffSingleStep();
 bool HandleStepOutBreak(const BREAK_POINT *bp);
 bool HandleStepOverBreak(const BREAK_POINT *bp);
 bool HandleStepOverSingleStep();
-void HandleProcessExited();
+void HoldStoppedThread();
+void InvalidateDisasmCache(DWORD64 addr, SIZE_T size);
+bool IsBranchStepping();
+bool IsCurrSourceLineChanged(std::string &fn, int &LineNumber);
+bool IsModuleSymbolsLoaded(DWORD64 base);
+bool IsNonStop();
+bool IsOdsCaptureRunning();
+bool IsRecording();
+bool IsResumeCommand(const std::string &str);
+bool IsScriptRunning();
+bool IsServerRunning();
+bool LaunchDbgee(const char *exe);
+DWORD64 LoadDbgeeModule(HANDLE hFile, DWORD64 base);
+bool LoadScript(const char *fn);
+bool LoadSession(const char *fn);
+void LookupSymbols(const std::string &query, size_t max, std::vector<std::string> &names, std::vector<DWORD64> &addresses);
+void MarkStartupPhase(const char *name);
+bool MatchWildcard(const char *pat, const char *str, bool noCase);
+bool OpenDumpFile(const char *fn);
+bool OpenRecordLog(const char *fn);
+bool OpenReplayLog(const char *fn);
+void PrefetchModuleSymbols(HANDLE hFile);
+bool PumpNonStopEvents(DWORD timeout);
+BOOL ReadDbgeeMemory(DWORD64 addr, LPVOID buff, SIZE_T size);
+void RecordContext(DWORD tid, const CONTEXT &ctx);
+void RecordEvent(const DEBUG_EVENT &ev);
+void RecordMemory(DWORD64 addr, LPCVOID buff, SIZE_T size);
+void RecordModule(DWORD64 base);
+void ReleaseScratchSlot(DBG_THREAD *th);
+int RelocateX86(const X86_INST &inst, const unsigned char *code, DWORD64 addr, DWORD64 to, unsigned char *out);
+int RemoveBreakPoints(const std::vector<DWORD64> &addrs);
+void RemoveDbgeeThread(DWORD tid);
+void RemoveDisasmModule(DWORD64 base);
+void RemoveIndexModule(DWORD64 base);
 bool RemoveTempBreakPoint(DWORD64 addr);
+bool RemoveWatch(int i);
+void ResetEventStats();
+void ResetFmtArena();
+void RestoreOriginalCode(DWORD64 addr, LPVOID buff, SIZE_T size);
+bool ResumeHeldThread();
+void RunScript();
+void SaveSession();
+bool SelectHeldThread();
+bool SelectThread(DWORD tid);
+void ServeDebugClient();
+void SetCpuSingleStepFlag();
+void SetCurrIp(DWORD64 ip);
+void SetCurrThread(DWORD tid);
+BOOL SetDbgeeContext(const CONTEXT &ctx);
+bool SetExceptionPolicy(const std::string &code, const std::string &policy);
 bool SetNextStatement(DWORD64 addr);
 bool SetNextStatement(const std::string &func);
 bool SetNextStatement(const std::string &fn, int LineNumber);
+bool SetNonStop(bool on);
+bool SetStepMode(const std::string &mode);
+void SetTraceCommand(const std::string &cmd);
+void ShowEventStats();
+void ShowExceptionFilters();
+void ShowFmtArenaStats();
+void ShowHeldThreads();
+void ShowOdsStats();
+void ShowSymbols(const std::string &query);
+void ShowThreads();
+void ShowWatches(bool ChangedOnly);
+bool StartDebugServer(int port);
+bool StartOdsCapture(const char *fn);
+bool StartTrace(const char *fn);
+LONGLONG StartupTicks();
 void StepInto();
-bool StepOut();
+void StepOffBreakPoint();
+bool StepOut(int nFrames);
 void StepOver();
+void StopDebugServer();
+void StopOdsCapture();
+void StopSymbolPrefetch();
+void StopTrace();
+void SuggestSymbols(const std::string &name);
+bool TakeSnapshot(DWORD64 addr, DWORD64 count);
+double TicksToMs(LONGLONG ticks);
 bool ToggleBreakPoint(DWORD64 addr);
 bool ToggleBreakPoint(const std::string &func);
 bool ToggleBreakPoint(const std::string &fn, int LineNumber);
 bool ToggleBreakPointAtEntryPoint();
+bool ToggleBreakPointPattern(const std::string &pattern, bool source);
+bool ToggleGrepBreakPoint(int i);
+void UpdateSourceIndex();
+BOOL WaitDbgeeEvent(DEBUG_EVENT &ev, DWORD timeout);
+BOOL WriteDbgeeCode(DWORD64 addr, LPCVOID buff, SIZE_T size);
+BOOL WriteDbgeeMemory(DWORD64 addr, LPCVOID buff, SIZE_T size);
+bool WriteDumpFile(const char *fn);
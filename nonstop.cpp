@@ -0,0 +1,130 @@
+#include "mydbg.h"
+
+#include <algorithm>
+#include <deque>
+
+extern int g_dbgState;
+extern DWORD g_continueStatus;
+extern DEBUG_TARGET *g_target;
+extern DEBUG_TARGET g_win32Target;
+
+//
+// Non-stop mode. A thread that stops is suspended and its debug event
+// continued at once, so the rest of the process keeps running while the
+// user looks at it. Threads stopping meanwhile are held the same way and
+// queued, and get the prompt in turn. Breakpoints stay armed while a
+// thread is held, and it is stepped off one when resumed like any other
+// thread (displace.cpp), so no other thread runs over a restored byte.
+//
+
+bool g_nonStop;
+std::deque<DWORD> g_heldThreads;        // Stop queue, oldest first.
+
+bool IsNonStop()
+{
+  return g_nonStop;
+}
+
+size_t GetHeldThreadCount()
+{
+  return g_heldThreads.size();
+}
+
+bool SetNonStop(bool on)
+{
+  if (on && &g_win32Target != g_target) {
+    printf("non-stop needs a live debuggee\n");
+    return false;
+  }
+  g_nonStop = on;
+  if (!on) {
+    //
+    // Held threads other than the current run again. One held at a bp
+    // still has its ip there and stops on it again, all-stop this time.
+    //
+
+    DWORD tid = GetCurrThreadId();
+    for (size_t i = 0; i < g_heldThreads.size(); i++) {
+      DBG_THREAD *th = FindDbgeeThread(g_heldThreads[i]);
+      if (th && th->tid != tid) {
+        th->held = false;
+        ResumeThread(th->hThread);
+      }
+    }
+    g_heldThreads.clear();
+    DBG_THREAD *th = FindDbgeeThread(tid);
+    if (th && th->held) {
+      g_heldThreads.push_back(tid);     // Released by the next go or step.
+    }
+  }
+  printf("non-stop %s\n", on ? "on" : "off");
+  return true;
+}
+
+void HoldStoppedThread()
+{
+  DBG_THREAD *th = GetCurrThread();
+  ClearCpuSingleStepFlag();
+  if (!th->hThread || (DWORD)-1 == SuspendThread(th->hThread)) {
+    printf("Hold thread %u failed, all threads stopped\n", th->tid);
+    return;
+  }
+  th->held = true;
+  g_heldThreads.push_back(th->tid);
+  ContinueDbgeeEvent(g_continueStatus);
+}
+
+bool ResumeHeldThread()
+{
+  DBG_THREAD *th = GetCurrThread();
+  if (!th->held) {
+    return false;
+  }
+  th->held = false;
+  g_heldThreads.erase(std::remove(g_heldThreads.begin(), g_heldThreads.end(), th->tid), g_heldThreads.end());
+  ResumeThread(th->hThread);
+  return true;
+}
+
+bool SelectHeldThread()
+{
+  //
+  // Next one of the stop queue gets the prompt when the current one runs.
+  //
+
+  while (!g_heldThreads.empty() && DBGS_NONE == g_dbgState) {
+    DBG_THREAD *th = FindDbgeeThread(g_heldThreads.front());
+    if (!th || !th->held) {
+      g_heldThreads.pop_front();        // Exited meanwhile.
+      continue;
+    }
+    printf("thread %u held, %u in queue\n", th->tid, (unsigned int)g_heldThreads.size());
+    SelectThread(th->tid);
+    g_dbgState = DBGS_BREAK;
+    return true;
+  }
+  return false;
+}
+
+void ShowHeldThreads()
+{
+  DWORD curr = GetCurrThreadId();
+  for (size_t i = 0; i < g_heldThreads.size(); i++) {
+    DWORD tid = g_heldThreads[i];
+    SetCurrThread(tid);
+    std::string fn;
+    int LineNumber = 0;
+    DWORD displacement = 0;
+    if (GetSourceLineByAddr(GetCurrIp(), fn, LineNumber, displacement)) {
+      printf("#%u thread %u at %s:%d\n", (unsigned int)i, tid, fn.c_str(), LineNumber);
+    } else {
+      printf("#%u thread %u at 0x%08x\n", (unsigned int)i, tid, (unsigned int)GetCurrIp());
+    }
+  }
+  SetCurrThread(curr);
+}
+
+void ClearHeldThreads()
+{
+  g_heldThreads.clear();
+}
@@ -0,0 +1,269 @@
+#include "mydbg.h"
+
+extern DEBUG_EVENT g_debugEvent;
+
+#define ODS_ARENA_SIZE (4 * 1024 * 1024)
+#define ODS_MAX_STRING (64 * 1024)      // Bytes kept of one string.
+#define ODS_ROTATE_SIZE (64 * 1024 * 1024)
+
+//
+// OutputDebugString capture. The event thread copies each string straight
+// from the debuggee into a byte ring arena and returns. A writer thread
+// decodes and writes them to a file, which rotates to file.1 when full.
+// Single producer, single consumer, so the ring needs no lock, only
+// barriers around the head and tail counters. When the ring is full the
+// event thread waits for the writer to free a record, that time is
+// counted as stall.
+//
+
+struct ODS_RECORD
+{
+  DWORD size;                           // Bytes reserved for string data following.
+  DWORD tid;
+  LONGLONG ticks;
+  WORD unicode;
+  WORD wrap;                            // Rest of arena unused, go to start.
+  WORD failed;                          // String not readable, data is garbage.
+  WORD pad;
+};
+
+#define ODS_ALIGN(n) (((n) + 7) & ~7)
+
+unsigned char *g_odsArena;
+volatile DWORD g_odsHead;               // Producer position, bytes, wraps at 4G.
+volatile DWORD g_odsTail;               // Consumer position.
+HANDLE g_odsEvent;                      // Data queued, for the writer.
+HANDLE g_odsSpaceEvent;                 // Record freed, for a stalled event thread.
+volatile LONG g_odsWaiting;             // Event thread stalled on a full ring.
+HANDLE g_odsThread;
+volatile bool g_odsStop;
+FILE *g_odsFile;
+std::string g_odsFileName;
+LONGLONG g_odsStart, g_odsFreq = 1;
+
+struct ODS_STATS
+{
+  DWORD nStrings;
+  DWORD64 nBytes;
+  DWORD nStalls;
+  LONGLONG stallTicks;
+  DWORD maxQueued;                      // High water mark of arena bytes used.
+  DWORD nRotations;
+  DWORD nTruncated;
+};
+
+ODS_STATS g_odsStats;
+
+bool IsOdsCaptureRunning()
+{
+  return NULL != g_odsThread;
+}
+
+void DecodeDebugString(const unsigned char *p, size_t size, bool unicode, std::string &out)
+{
+  if (!unicode) {
+    size_t n = 0;
+    while (n < size && p[n]) {          // May not be NUL terminated.
+      n++;
+    }
+    out.assign((const char*)p, n);
+    return;
+  }
+  const WCHAR *w = (const WCHAR*)p;
+  int nChars = 0;
+  while ((size_t)nChars < size / 2 && w[nChars]) {
+    nChars++;
+  }
+  int n = WideCharToMultiByte(CP_UTF8, 0, w, nChars, NULL, 0, NULL, NULL);
+  out.resize(n);
+  if (0 < n) {
+    WideCharToMultiByte(CP_UTF8, 0, w, nChars, &out[0], n, NULL, NULL);
+  }
+}
+
+void RotateOdsFile()
+{
+  fclose(g_odsFile);
+  std::string old = g_odsFileName + ".1";
+  MoveFileEx(g_odsFileName.c_str(), old.c_str(), MOVEFILE_REPLACE_EXISTING);
+  g_odsFile = fopen(g_odsFileName.c_str(), "wb");
+  if (g_odsFile) {
+    setvbuf(g_odsFile, NULL, _IOFBF, 256 * 1024);
+  }
+  g_odsStats.nRotations++;
+}
+
+static void PublishOdsTail(DWORD tail)
+{
+  MemoryBarrier();                      // Done with data before freeing it.
+  g_odsTail = tail;
+  MemoryBarrier();                      // Tail out before looking at the flag.
+  if (g_odsWaiting) {
+    SetEvent(g_odsSpaceEvent);
+  }
+}
+
+static DWORD WINAPI OdsWriter(LPVOID)
+{
+  std::string str;
+  DWORD64 written = 0;
+  while (true) {
+    DWORD head = g_odsHead;
+    MemoryBarrier();                    // Record data visible before reading it.
+    DWORD tail = g_odsTail;
+    if (head == tail) {
+      if (g_odsStop) {
+        break;
+      }
+      fflush(g_odsFile);
+      WaitForSingleObject(g_odsEvent, 100);
+      continue;
+    }
+
+    while (tail != head) {
+      DWORD pos = tail % ODS_ARENA_SIZE;
+      const ODS_RECORD *rec = (const ODS_RECORD*)(g_odsArena + pos);
+      if (ODS_ARENA_SIZE - pos < sizeof(ODS_RECORD) || rec->wrap) {
+        tail += ODS_ARENA_SIZE - pos;
+        PublishOdsTail(tail);
+        continue;
+      }
+      if (rec->failed) {
+        str = "<unreadable>";
+      } else {
+        DecodeDebugString((const unsigned char*)(rec + 1), rec->size, 0 != rec->unicode, str);
+      }
+      if (g_odsFile) {
+        int n = fprintf(g_odsFile, "%10.3f %5u %s\n", (rec->ticks - g_odsStart) * 1000.0 / g_odsFreq, rec->tid, str.c_str());
+        written += 0 < n ? n : 0;
+        if (ODS_ROTATE_SIZE <= written) {
+          RotateOdsFile();
+          written = 0;
+        }
+      }
+      tail += ODS_ALIGN(sizeof(ODS_RECORD) + rec->size);
+      PublishOdsTail(tail);             // Per record, a stalled event thread goes on soonest.
+    }
+  }
+  return 0;
+}
+
+bool StartOdsCapture(const char *fn)
+{
+  g_odsFileName = fn;
+  g_odsFile = fopen(fn, "wb");
+  if (!g_odsFile) {
+    printf("Open debug string log %s failed\n", fn);
+    return false;
+  }
+  setvbuf(g_odsFile, NULL, _IOFBF, 256 * 1024);
+
+  LARGE_INTEGER t;
+  QueryPerformanceFrequency(&t);
+  g_odsFreq = t.QuadPart;
+  QueryPerformanceCounter(&t);
+  g_odsStart = t.QuadPart;
+
+  memset(&g_odsStats, 0, sizeof(g_odsStats));
+  g_odsArena = (unsigned char*)VirtualAlloc(NULL, ODS_ARENA_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  g_odsHead = g_odsTail = 0;
+  g_odsStop = false;
+  g_odsEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+  g_odsSpaceEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+  g_odsWaiting = 0;
+  g_odsThread = g_odsArena ? CreateThread(NULL, 0, OdsWriter, NULL, 0, NULL) : NULL;
+  if (!g_odsThread) {
+    printf("Start debug string capture failed: %u\n", GetLastError());
+    fclose(g_odsFile);
+    return false;
+  }
+  return true;
+}
+
+void CaptureDebugString(const OUTPUT_DEBUG_STRING_INFO &pi)
+{
+  DWORD size = pi.nDebugStringLength * (pi.fUnicode ? 2 : 1);
+  if (ODS_MAX_STRING < size) {
+    size = ODS_MAX_STRING;
+    g_odsStats.nTruncated++;
+  }
+  DWORD total = ODS_ALIGN(sizeof(ODS_RECORD) + size);
+
+  //
+  // Reserve contiguous space, skipping the arena end if it doesn't fit.
+  //
+
+  DWORD head = g_odsHead;
+  DWORD pos = head % ODS_ARENA_SIZE;
+  DWORD skip = ODS_ARENA_SIZE - pos < total ? ODS_ARENA_SIZE - pos : 0;
+  if (ODS_ARENA_SIZE < head - g_odsTail + skip + total) {
+    LARGE_INTEGER t0, t1;
+    QueryPerformanceCounter(&t0);
+    g_odsStats.nStalls++;
+    g_odsWaiting = 1;
+    MemoryBarrier();                    // Writer sees the flag after our tail check.
+    while (ODS_ARENA_SIZE < head - g_odsTail + skip + total) {
+      SetEvent(g_odsEvent);
+      WaitForSingleObject(g_odsSpaceEvent, 100);
+    }
+    g_odsWaiting = 0;
+    QueryPerformanceCounter(&t1);
+    g_odsStats.stallTicks += t1.QuadPart - t0.QuadPart;
+  }
+  if (skip) {
+    if (sizeof(ODS_RECORD) <= skip) {
+      ((ODS_RECORD*)(g_odsArena + pos))->wrap = 1;
+    }
+    head += skip;
+    pos = 0;
+  }
+
+  ODS_RECORD *rec = (ODS_RECORD*)(g_odsArena + pos);
+  rec->tid = g_debugEvent.dwThreadId;
+  rec->unicode = pi.fUnicode ? 1 : 0;
+  rec->wrap = 0;
+  LARGE_INTEGER t;
+  QueryPerformanceCounter(&t);
+  rec->ticks = t.QuadPart;
+  rec->size = size;                     // Always what was reserved, the writer steps by it.
+  rec->failed = ReadDbgeeMemory((DWORD64)pi.lpDebugStringData, rec + 1, size) ? 0 : 1;
+
+  MemoryBarrier();                      // Record complete before publishing.
+  g_odsHead = head + total;
+  SetEvent(g_odsEvent);
+
+  g_odsStats.nStrings++;
+  g_odsStats.nBytes += rec->failed ? 0 : rec->size;
+  g_odsStats.maxQueued = (std::max)(g_odsStats.maxQueued, (DWORD)(g_odsHead - g_odsTail));
+}
+
+void ShowOdsStats()
+{
+  if (!IsOdsCaptureRunning()) {
+    printf("Debug string capture is off, use -ods file\n");
+    return;
+  }
+  printf("Debug strings: %u, %u KB, queue max %u KB of %u KB\n", g_odsStats.nStrings, (unsigned int)(g_odsStats.nBytes / 1024), g_odsStats.maxQueued / 1024, ODS_ARENA_SIZE / 1024);
+  printf("Stalls: %u, %.1f ms; rotations %u, truncated %u\n", g_odsStats.nStalls, g_odsStats.stallTicks * 1000.0 / g_odsFreq, g_odsStats.nRotations, g_odsStats.nTruncated);
+}
+
+void StopOdsCapture()
+{
+  if (!IsOdsCaptureRunning()) {
+    return;
+  }
+  g_odsStop = true;
+  SetEvent(g_odsEvent);
+  WaitForSingleObject(g_odsThread, INFINITE);
+  ShowOdsStats();
+  CloseHandle(g_odsThread);
+  g_odsThread = NULL;
+  CloseHandle(g_odsEvent);
+  CloseHandle(g_odsSpaceEvent);
+  if (g_odsFile) {
+    fclose(g_odsFile);
+    g_odsFile = NULL;
+  }
+  VirtualFree(g_odsArena, 0, MEM_RELEASE);
+  g_odsArena = NULL;
+}
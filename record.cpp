@@ -0,0 +1,414 @@
+#include "mydbg.h"
+
+#include <stddef.h>
+
+extern PROCESS_INFORMATION g_piDbgee;
+extern DEBUG_TARGET *g_target;
+extern DEBUG_TARGET g_replayTarget;
+
+//
+// Recording of the debuggee access made through dbgee.cpp, and the replay
+// target that serves it back without a live process.
+//
+// Log format: a sequence of records, each a DWORD header of type(8 bits) and
+// payload size(24 bits) followed by the payload. The memory and context
+// reads made while handling an event follow the event record.
+//
+
+enum RECORD_TYPE {
+  REC_EVENT = 1,                        // DEBUG_EVENT up to the used union member.
+  REC_MEMORY,                           // DWORD address, bytes.
+  REC_CONTEXT,                          // DWORD tid, CONTEXT without extended registers.
+  REC_MODULE                            // DWORD base, image file name.
+};
+
+#define REC_MAX_PAYLOAD 0xffffff
+#define REC_BUFF_SIZE (1024 * 1024)
+#define REC_CONTEXT_SIZE offsetof(CONTEXT, ExtendedRegisters)
+#define REPLAY_PAGE_SIZE 4096
+
+struct REPLAY_PAGE
+{
+  unsigned char data[REPLAY_PAGE_SIZE];
+  unsigned char valid[REPLAY_PAGE_SIZE];
+};
+
+HANDLE g_hRecord = INVALID_HANDLE_VALUE;
+std::vector<unsigned char> g_recBuff;
+DWORD g_nRecDropped;                    // Records over REC_MAX_PAYLOAD, not logged.
+
+std::vector<unsigned char> g_replayLog;
+size_t g_replayPos;
+unsigned int g_replayEvents;
+LARGE_INTEGER g_replayStart;
+std::map<DWORD64, REPLAY_PAGE> g_replayMem; // <PageAddress, Page>
+std::map<DWORD, CONTEXT> g_replayCtx;   // <ThreadId, Context>
+std::map<DWORD64, std::string> g_replayModules; // <BaseAddress, ImageName>
+
+void FlushRecord()
+{
+  if (!g_recBuff.empty()) {
+    DWORD written;
+    WriteFile(g_hRecord, &g_recBuff[0], (DWORD)g_recBuff.size(), &written, NULL);
+    g_recBuff.clear();
+  }
+}
+
+void AppendRecord(int type, const void *p1, size_t size1, const void *p2, size_t size2)
+{
+  //
+  // Header and payload are copied into the log buffer, one write per
+  // buffer full. A second part larger than the buffer goes to the file
+  // directly, uncopied.
+  //
+
+  if (REC_MAX_PAYLOAD < size1 + size2) {
+    g_nRecDropped++;
+    return;
+  }
+  DWORD hdr = ((DWORD)type << 24) | (DWORD)(size1 + size2);
+  if (g_recBuff.size() + sizeof(hdr) + size1 + size2 > REC_BUFF_SIZE) {
+    FlushRecord();
+  }
+  g_recBuff.insert(g_recBuff.end(), (const unsigned char*)&hdr, (const unsigned char*)&hdr + sizeof(hdr));
+  g_recBuff.insert(g_recBuff.end(), (const unsigned char*)p1, (const unsigned char*)p1 + size1);
+  if (REC_BUFF_SIZE > size2) {
+    g_recBuff.insert(g_recBuff.end(), (const unsigned char*)p2, (const unsigned char*)p2 + size2);
+  } else {
+    FlushRecord();
+    DWORD written;
+    WriteFile(g_hRecord, p2, (DWORD)size2, &written, NULL);
+  }
+}
+
+size_t GetEventRecordSize(DWORD code)
+{
+  size_t size = offsetof(DEBUG_EVENT, u);
+  switch (code) {
+    case CREATE_PROCESS_DEBUG_EVENT: return size + sizeof(CREATE_PROCESS_DEBUG_INFO);
+    case CREATE_THREAD_DEBUG_EVENT: return size + sizeof(CREATE_THREAD_DEBUG_INFO);
+    case EXCEPTION_DEBUG_EVENT: return size + sizeof(EXCEPTION_DEBUG_INFO);
+    case EXIT_PROCESS_DEBUG_EVENT: return size + sizeof(EXIT_PROCESS_DEBUG_INFO);
+    case EXIT_THREAD_DEBUG_EVENT: return size + sizeof(EXIT_THREAD_DEBUG_INFO);
+    case LOAD_DLL_DEBUG_EVENT: return size + sizeof(LOAD_DLL_DEBUG_INFO);
+    case UNLOAD_DLL_DEBUG_EVENT: return size + sizeof(UNLOAD_DLL_DEBUG_INFO);
+    case OUTPUT_DEBUG_STRING_EVENT: return size + sizeof(OUTPUT_DEBUG_STRING_INFO);
+    case RIP_EVENT: return size + sizeof(RIP_INFO);
+  }
+  return sizeof(DEBUG_EVENT);
+}
+
+bool OpenRecordLog(const char *fn)
+{
+  g_hRecord = CreateFile(fn, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (INVALID_HANDLE_VALUE == g_hRecord) {
+    printf("Open record log %s failed: %u\n", fn, GetLastError());
+    return false;
+  }
+  g_recBuff.reserve(REC_BUFF_SIZE);
+  return true;
+}
+
+void CloseRecordLog()
+{
+  if (INVALID_HANDLE_VALUE != g_hRecord) {
+    if (g_nRecDropped) {
+      printf("\tRecord log: %u records too large, not logged, replay may diverge\n", g_nRecDropped);
+      g_nRecDropped = 0;
+    }
+    FlushRecord();
+    CloseHandle(g_hRecord);
+    g_hRecord = INVALID_HANDLE_VALUE;
+  }
+}
+
+bool IsRecording()
+{
+  return INVALID_HANDLE_VALUE != g_hRecord;
+}
+
+void RecordEvent(const DEBUG_EVENT &ev)
+{
+  AppendRecord(REC_EVENT, &ev, GetEventRecordSize(ev.dwDebugEventCode), NULL, 0);
+}
+
+void RecordMemory(DWORD64 addr, LPCVOID buff, SIZE_T size)
+{
+  //
+  // Large reads are logged in pieces, each its own record.
+  //
+
+  const SIZE_T piece = REC_MAX_PAYLOAD - sizeof(DWORD);
+  SIZE_T off = 0;
+  do {
+    DWORD a = (DWORD)(addr + off);
+    AppendRecord(REC_MEMORY, &a, sizeof(a), (const unsigned char*)buff + off, (std::min)(piece, size - off));
+    off += piece;
+  } while (off < size);
+}
+
+void RecordContext(DWORD tid, const CONTEXT &ctx)
+{
+  AppendRecord(REC_CONTEXT, &tid, sizeof(tid), &ctx, REC_CONTEXT_SIZE);
+}
+
+void RecordModule(DWORD64 base)
+{
+  IMAGEHLP_MODULE64 mi = {0};
+  mi.SizeOfStruct = sizeof(mi);
+  if (SymGetModuleInfo64(g_piDbgee.hProcess, base, &mi)) {
+    DWORD a = (DWORD)base;
+    const char *name = mi.LoadedImageName[0] ? mi.LoadedImageName : mi.ImageName;
+    AppendRecord(REC_MODULE, &a, sizeof(a), name, strlen(name));
+  }
+}
+
+void ReplayWriteMemory(DWORD64 addr, const unsigned char *p, size_t size)
+{
+  for (size_t i = 0; i < size;) {
+    DWORD64 a = addr + i;
+    REPLAY_PAGE &pg = g_replayMem[a - a % REPLAY_PAGE_SIZE];
+    size_t off = (size_t)(a % REPLAY_PAGE_SIZE);
+    size_t n = (std::min)(size - i, REPLAY_PAGE_SIZE - off);
+    memcpy(pg.data + off, p + i, n);
+    memset(pg.valid + off, 1, n);
+    i += n;
+  }
+}
+
+bool ReplayReadMemory(DWORD64 addr, unsigned char *p, size_t size)
+{
+  for (size_t i = 0; i < size;) {
+    DWORD64 a = addr + i;
+    std::map<DWORD64, REPLAY_PAGE>::const_iterator it = g_replayMem.find(a - a % REPLAY_PAGE_SIZE);
+    if (g_replayMem.end() == it) {
+      return false;
+    }
+    size_t off = (size_t)(a % REPLAY_PAGE_SIZE);
+    size_t n = (std::min)(size - i, REPLAY_PAGE_SIZE - off);
+    for (size_t j = 0; j < n; j++) {
+      if (!it->second.valid[off + j]) {
+        return false;
+      }
+    }
+    memcpy(p + i, it->second.data + off, n);
+    i += n;
+  }
+  return true;
+}
+
+bool NextReplayRecord(int &type, const unsigned char *&p, size_t &size)
+{
+  if (g_replayPos + sizeof(DWORD) > g_replayLog.size()) {
+    return false;
+  }
+  DWORD hdr = *(const DWORD*)&g_replayLog[g_replayPos];
+  type = (int)(hdr >> 24);
+  size = hdr & REC_MAX_PAYLOAD;
+  if (g_replayPos + sizeof(DWORD) + size > g_replayLog.size()) {
+    return false;
+  }
+  p = &g_replayLog[g_replayPos + sizeof(DWORD)];
+  g_replayPos += sizeof(DWORD) + size;
+  return true;
+}
+
+void ApplyReplayRecords()
+{
+  //
+  // Apply the reads recorded after current event, up to the next event, so
+  // the handlers see the same debuggee state as the live session did.
+  //
+
+  int type;
+  const unsigned char *p;
+  size_t size;
+  size_t pos = g_replayPos;
+  while (NextReplayRecord(type, p, size) && REC_EVENT != type) {
+    switch (type) {
+      case REC_MEMORY:
+        ReplayWriteMemory(*(const DWORD*)p, p + sizeof(DWORD), size - sizeof(DWORD));
+        break;
+      case REC_CONTEXT:
+        memcpy(&g_replayCtx[*(const DWORD*)p], p + sizeof(DWORD), (std::min)(size - sizeof(DWORD), sizeof(CONTEXT)));
+        break;
+      case REC_MODULE:
+        g_replayModules[*(const DWORD*)p] = std::string((const char*)p + sizeof(DWORD), size - sizeof(DWORD));
+        break;
+    }
+    pos = g_replayPos;
+  }
+  g_replayPos = pos;                    // Leave next event unread.
+}
+
+bool OpenReplayLog(const char *fn)
+{
+  HANDLE hFile = CreateFile(fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) {
+    printf("Open replay log %s failed: %u\n", fn, GetLastError());
+    return false;
+  }
+  DWORD size = GetFileSize(hFile, NULL), read = 0;
+  g_replayLog.resize(size);
+  if (0 < size) {
+    ReadFile(hFile, &g_replayLog[0], size, &read, NULL);
+  }
+  CloseHandle(hFile);
+  g_replayLog.resize(read);
+
+  //
+  // Take process and thread id from the first event. The process handle is a
+  // private event object: unique for dbghelp, and useless for any real
+  // process access that bypasses the replay.
+  //
+
+  int type;
+  const unsigned char *p;
+  size_t recSize;
+  if (!NextReplayRecord(type, p, recSize) || REC_EVENT != type) {
+    printf("Invalid replay log %s\n", fn);
+    return false;
+  }
+  const DEBUG_EVENT *ev = (const DEBUG_EVENT*)p;
+  g_piDbgee.dwProcessId = ev->dwProcessId;
+  g_piDbgee.dwThreadId = ev->dwThreadId;
+  g_piDbgee.hProcess = CreateEvent(NULL, FALSE, FALSE, NULL);
+  g_piDbgee.hThread = NULL;
+  g_replayPos = 0;
+  g_replayEvents = 0;
+  g_target = &g_replayTarget;
+  QueryPerformanceCounter(&g_replayStart);
+  return true;
+}
+
+//
+// Replay target.
+//
+
+BOOL ReplayTargetReadMemory(DWORD64 addr, LPVOID buff, SIZE_T size)
+{
+  return ReplayReadMemory(addr, (unsigned char*)buff, size);
+}
+
+BOOL ReplayTargetWriteMemory(DWORD64 addr, LPCVOID buff, SIZE_T size)
+{
+  ReplayWriteMemory(addr, (const unsigned char*)buff, size);
+  return TRUE;
+}
+
+void ReplayTargetQueryRegions(std::vector<MEM_REGION> &regions, bool WritableOnly)
+{
+  regions.clear();
+  for (std::map<DWORD64, REPLAY_PAGE>::const_iterator it = g_replayMem.begin(); g_replayMem.end() != it; ++it) {
+    if (!regions.empty() && regions.back().address + regions.back().size == it->first) {
+      regions.back().size += REPLAY_PAGE_SIZE;
+    } else {
+      MEM_REGION r;
+      r.address = it->first;
+      r.size = REPLAY_PAGE_SIZE;
+      r.protect = PAGE_READWRITE;
+      regions.push_back(r);
+    }
+  }
+}
+
+BOOL ReplayTargetGetContext(DWORD tid, CONTEXT &ctx)
+{
+  std::map<DWORD, CONTEXT>::const_iterator it = g_replayCtx.find(tid);
+  if (g_replayCtx.end() == it) {
+    return FALSE;
+  }
+  DWORD flags = ctx.ContextFlags;
+  ctx = it->second;
+  ctx.ContextFlags = flags;
+  return TRUE;
+}
+
+BOOL ReplayTargetSetContext(DWORD tid, const CONTEXT &ctx)
+{
+  memcpy(&g_replayCtx[tid], &ctx, sizeof(ctx));
+  return TRUE;
+}
+
+BOOL ReplayTargetWaitEvent(DEBUG_EVENT &ev, DWORD)
+{
+  int type;
+  const unsigned char *p;
+  size_t size;
+  while (NextReplayRecord(type, p, size)) {
+    if (REC_EVENT != type) {
+      continue;
+    }
+    memset(&ev, 0, sizeof(ev));
+    memcpy(&ev, p, (std::min)(size, sizeof(ev)));
+
+    //
+    // Handles in the log belong to the recorded session, drop them.
+    //
+
+    switch (ev.dwDebugEventCode) {
+      case CREATE_PROCESS_DEBUG_EVENT:
+        ev.u.CreateProcessInfo.hFile = NULL;
+        ev.u.CreateProcessInfo.hProcess = NULL;
+        ev.u.CreateProcessInfo.hThread = NULL;
+        break;
+      case CREATE_THREAD_DEBUG_EVENT:
+        ev.u.CreateThread.hThread = NULL;
+        break;
+      case LOAD_DLL_DEBUG_EVENT:
+        ev.u.LoadDll.hFile = NULL;
+        break;
+    }
+
+    ApplyReplayRecords();
+    g_replayEvents++;
+    return TRUE;
+  }
+
+  LARGE_INTEGER freq, t;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t);
+  printf("Replayed %u events in %.1f ms\n", g_replayEvents, (t.QuadPart - g_replayStart.QuadPart) * 1000.0 / freq.QuadPart);
+  HandleProcessExited();
+  return FALSE;
+}
+
+BOOL ReplayTargetContinueEvent(DWORD, DWORD, DWORD)
+{
+  return TRUE;
+}
+
+DWORD64 ReplayTargetLoadModule(HANDLE, DWORD64 base)
+{
+  std::map<DWORD64, std::string>::const_iterator it = g_replayModules.find(base);
+  if (g_replayModules.end() == it) {
+    return 0;
+  }
+  return SymLoadModule64(g_piDbgee.hProcess, NULL, (PSTR)it->second.c_str(), NULL, base, 0);
+}
+
+DWORD64 ReplayTargetAllocCode(SIZE_T size)
+{
+  //
+  // Stand-in address outside user space, so bps are stepped off the same
+  // way as when recorded. Writes there only go to the overlay.
+  //
+
+  static DWORD64 s_next = 0xFFF00000;
+  DWORD64 addr = s_next;
+  s_next += size;
+  return addr;
+}
+
+DEBUG_TARGET g_replayTarget = {
+  "replay",
+  ReplayTargetReadMemory,
+  ReplayTargetWriteMemory,
+  ReplayTargetQueryRegions,
+  ReplayTargetGetContext,
+  ReplayTargetSetContext,
+  ReplayTargetWaitEvent,
+  ReplayTargetContinueEvent,
+  ReplayTargetLoadModule,
+  ReplayTargetAllocCode
+};
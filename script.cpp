@@ -0,0 +1,283 @@
+#include "mydbg.h"
+
+#include <io.h>
+
+extern int g_dbgState;
+extern int g_stopReason;
+
+//
+// Script file format, one command per line:
+//   any debugger command        executed as typed at the prompt
+//   repeat [count]              loop until matching end, forever if no count
+//   if [!]bp|step|exit|exception
+//                               run until matching end on (not) this stop reason
+//   end
+//   capture [file]              redirect output to file, restore if no file
+//   echo text
+//   # comment
+//
+
+enum SCRIPT_OP {
+  SOP_CMD = 0,
+  SOP_REPEAT,
+  SOP_IF,
+  SOP_END,
+  SOP_CAPTURE,
+  SOP_ECHO
+};
+
+struct SCRIPT_CMD
+{
+  int op;
+  std::string arg;
+  int count;                            // repeat: loop count, -1 forever. if: stop reason.
+  bool negate;                          // if: true for !reason.
+  int match;                            // Index of matching end, or of repeat/if for end.
+};
+
+std::vector<SCRIPT_CMD> g_script;
+size_t g_scriptPc;
+std::vector<int> g_scriptLoops;         // Remaining count of each active repeat.
+int g_scriptStdout = -1;                // Saved stdout while capturing.
+
+bool IsScriptRunning()
+{
+  return g_scriptPc < g_script.size();
+}
+
+bool ParseScriptLine(const std::string &str, SCRIPT_CMD &cmd)
+{
+  cmd.op = SOP_CMD;
+  cmd.arg = str;
+  cmd.count = 0;
+  cmd.negate = false;
+  cmd.match = -1;
+
+  size_t n = str.find_first_of(" \t");
+  std::string key(str, 0, n);
+  std::string arg;
+  if (std::string::npos != n) {
+    arg = str.substr(str.find_first_not_of(" \t", n));
+  }
+
+  if ("repeat" == key) {
+    cmd.op = SOP_REPEAT;
+    cmd.count = -1;
+    if (!arg.empty() && 1 != sscanf(arg.c_str(), "%d", &cmd.count)) {
+      return false;
+    }
+  } else if ("if" == key) {
+    cmd.op = SOP_IF;
+    if (!arg.empty() && '!' == arg[0]) {
+      cmd.negate = true;
+      arg.erase(0, 1);
+    }
+    if ("bp" == arg) {
+      cmd.count = STOP_BREAKPOINT;
+    } else if ("step" == arg) {
+      cmd.count = STOP_STEP;
+    } else if ("exit" == arg) {
+      cmd.count = STOP_EXIT;
+    } else if ("exception" == arg) {
+      cmd.count = STOP_EXCEPTION;
+    } else {
+      return false;
+    }
+  } else if ("end" == key) {
+    cmd.op = SOP_END;
+  } else if ("capture" == key) {
+    cmd.op = SOP_CAPTURE;
+    cmd.arg = arg;
+  } else if ("echo" == key) {
+    cmd.op = SOP_ECHO;
+    cmd.arg = arg;
+  }
+  return true;
+}
+
+bool LoadScript(const char *fn)
+{
+  FILE *f = fopen(fn, "rt");
+  if (!f) {
+    printf("Open script %s failed\n", fn);
+    return false;
+  }
+
+  std::vector<SCRIPT_CMD> script;
+  std::vector<int> blocks;              // Open repeat/if indices.
+  char buff[1024];
+  int LineNumber = 0;
+  bool ok = true;
+  while (ok && fgets(buff, sizeof(buff), f)) {
+    LineNumber++;
+    std::string str(buff);
+    str.erase(0, str.find_first_not_of(" \t\r\n")); // Trim space.
+    str.erase(str.find_last_not_of(" \t\r\n") + 1);
+    if (str.empty() || '#' == str[0]) {
+      continue;
+    }
+    SCRIPT_CMD cmd;
+    if (!ParseScriptLine(str, cmd)) {
+      printf("%s:%d: invalid script line\n", fn, LineNumber);
+      ok = false;
+      break;
+    }
+    if (SOP_REPEAT == cmd.op || SOP_IF == cmd.op) {
+      blocks.push_back((int)script.size());
+    } else if (SOP_END == cmd.op) {
+      if (blocks.empty()) {
+        printf("%s:%d: end without repeat or if\n", fn, LineNumber);
+        ok = false;
+        break;
+      }
+      cmd.match = blocks.back();
+      script[blocks.back()].match = (int)script.size();
+      blocks.pop_back();
+    }
+    script.push_back(cmd);
+  }
+  fclose(f);
+
+  if (ok && !blocks.empty()) {
+    printf("%s: missing end\n", fn);
+    ok = false;
+  }
+  if (!ok) {
+    return false;
+  }
+
+  g_script.swap(script);
+  g_scriptPc = 0;
+  g_scriptLoops.clear();
+  return true;
+}
+
+void CaptureOutput(const std::string &fn)
+{
+  fflush(stdout);
+  if (-1 != g_scriptStdout) {
+    _dup2(g_scriptStdout, _fileno(stdout));
+    _close(g_scriptStdout);
+    g_scriptStdout = -1;
+  }
+  if (!fn.empty()) {
+    g_scriptStdout = _dup(_fileno(stdout));
+    if (!freopen(fn.c_str(), "w", stdout)) {
+      _dup2(g_scriptStdout, _fileno(stdout));
+      _close(g_scriptStdout);
+      g_scriptStdout = -1;
+      printf("capture %s failed\n", fn.c_str());
+    }
+  }
+}
+
+void EndScript()
+{
+  CaptureOutput("");
+  g_script.clear();
+  g_scriptPc = 0;
+  fflush(stdout);
+}
+
+static void RunExitBlocks()
+{
+  //
+  // The process is gone. Only if exit blocks run, loops don't go back and
+  // commands that would resume the debuggee are skipped.
+  //
+
+  std::vector<int> blocks;              // Ends of the if exit blocks we are in.
+  g_scriptLoops.clear();
+  while (IsScriptRunning()) {
+    int pc = (int)g_scriptPc++;
+    SCRIPT_CMD cmd = g_script[pc];
+    bool run = !blocks.empty();
+    switch (cmd.op) {
+      case SOP_CMD:
+        if (run && !IsResumeCommand(cmd.arg)) {
+          ExecuteCommand(cmd.arg);
+        }
+        break;
+      case SOP_IF:
+        if (!run && STOP_EXIT == cmd.count && !cmd.negate) {
+          blocks.push_back(cmd.match);
+        } else if (run && (cmd.count == g_stopReason) == cmd.negate) {
+          g_scriptPc = cmd.match + 1;
+        }
+        break;
+      case SOP_END:
+        if (!blocks.empty() && blocks.back() == pc) {
+          blocks.pop_back();
+        }
+        break;
+      case SOP_CAPTURE:
+        if (run) {
+          CaptureOutput(cmd.arg);
+        }
+        break;
+      case SOP_ECHO:
+        if (run) {
+          printf("%s\n", cmd.arg.c_str());
+        }
+        break;
+    }
+  }
+}
+
+void RunScript()
+{
+  //
+  // Run commands until one of them resumes the debuggee, the script goes on
+  // from there at the next stop. On process exit the script ends, after
+  // its if exit blocks.
+  //
+
+  if (DBGS_EXIT_PROCESS == g_dbgState) {
+    RunExitBlocks();
+    if (!g_script.empty()) {
+      EndScript();
+    }
+    return;
+  }
+
+  while (IsScriptRunning() && DBGS_BREAK == g_dbgState) {
+    SCRIPT_CMD cmd = g_script[g_scriptPc++]; // Copy, a command may load another script.
+    switch (cmd.op) {
+      case SOP_CMD:
+        ExecuteCommand(cmd.arg);
+        break;
+      case SOP_REPEAT:
+        if (0 == cmd.count) {
+          g_scriptPc = cmd.match + 1;
+        } else {
+          g_scriptLoops.push_back(cmd.count);
+        }
+        break;
+      case SOP_IF:
+        if ((cmd.count == g_stopReason) == cmd.negate) {
+          g_scriptPc = cmd.match + 1;
+        }
+        break;
+      case SOP_END:
+        if (SOP_REPEAT == g_script[cmd.match].op) {
+          int &left = g_scriptLoops.back();
+          if (-1 == left || 0 < --left) {
+            g_scriptPc = cmd.match + 1;
+          } else {
+            g_scriptLoops.pop_back();
+          }
+        }
+        break;
+      case SOP_CAPTURE:
+        CaptureOutput(cmd.arg);
+        break;
+      case SOP_ECHO:
+        printf("%s\n", cmd.arg.c_str());
+        break;
+    }
+  }
+
+  if (!IsScriptRunning() && !g_script.empty()) {
+    EndScript();
+  }
+}
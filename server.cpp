@@ -0,0 +1,437 @@
+#include <winsock2.h>                   // Before windows.h, which pulls in winsock 1.
+
+#include "mydbg.h"
+
+#include <algorithm>
+
+extern int g_dbgState;
+extern int g_stopReason;
+
+//
+// Local debug server protocol. Every message, request or response, is a
+// SRV_HEADER followed by size bytes of payload. Requests may be pipelined,
+// responses come back in request order with the same seq.
+//
+// SRV_BATCH      payload: count x SRV_ITEM
+//                response: per item DWORD result size, then the bytes
+//                (memory read: bytes read, context: CONTEXT, write: none)
+//                Items take effect in order, a read after a write sees it.
+//                Memory reads and writes are of the original code, our
+//                breakpoints don't show and stay armed.
+// SRV_COMMAND    payload: debugger command text, as typed at the prompt
+//                response: SRV_STOP, sent when the debuggee stops again if
+//                the command resumed it
+//
+
+enum SRV_MSG_TYPE {
+  SRV_BATCH = 1,
+  SRV_COMMAND,
+  SRV_ERROR
+};
+
+enum SRV_ITEM_TYPE {
+  SRV_READ_MEMORY = 1,
+  SRV_WRITE_MEMORY,                     // Followed by size bytes of data.
+  SRV_GET_CONTEXT
+};
+
+struct SRV_HEADER
+{
+  DWORD size;
+  WORD type;
+  WORD count;
+  DWORD seq;
+};
+
+struct SRV_ITEM
+{
+  DWORD type;
+  DWORD address;
+  DWORD size;
+};
+
+struct SRV_STOP
+{
+  DWORD state;
+  DWORD reason;
+  DWORD ip;
+};
+
+#define SRV_MAX_PAYLOAD (16 * 1024 * 1024)
+#define SRV_MERGE_GAP 256               // Merge read ranges closer than this into one read.
+#define SRV_MAX_SPAN (64 * 1024)        // Largest merged read.
+
+SOCKET g_srvClient = INVALID_SOCKET;
+bool g_srvStopPending = false;
+DWORD g_srvStopSeq;
+
+bool RecvAll(SOCKET s, char *p, int size)
+{
+  while (0 < size) {
+    int n = recv(s, p, size, 0);
+    if (0 >= n) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool SendAll(SOCKET s, const char *p, int size)
+{
+  while (0 < size) {
+    int n = send(s, p, size, 0);
+    if (0 >= n) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool SendSrvMessage(SOCKET s, WORD type, WORD count, DWORD seq, const std::vector<char> &payload)
+{
+  SRV_HEADER hdr;
+  hdr.size = (DWORD)payload.size();
+  hdr.type = type;
+  hdr.count = count;
+  hdr.seq = seq;
+  std::vector<char> msg((const char*)&hdr, (const char*)&hdr + sizeof(hdr));
+  msg.insert(msg.end(), payload.begin(), payload.end());
+  return SendAll(s, &msg[0], (int)msg.size());
+}
+
+bool SendStop(DWORD seq)
+{
+  SRV_STOP stop;
+  stop.state = g_dbgState;
+  stop.reason = g_stopReason;
+  stop.ip = DBGS_BREAK == g_dbgState ? (DWORD)GetCurrIp() : 0;
+  std::vector<char> payload((const char*)&stop, (const char*)&stop + sizeof(stop));
+  return SendSrvMessage(g_srvClient, SRV_COMMAND, 1, seq, payload);
+}
+
+struct SRV_RANGE
+{
+  DWORD address;
+  DWORD size;
+  size_t item;
+};
+
+static bool LessRange(const SRV_RANGE &a, const SRV_RANGE &b)
+{
+  return a.address < b.address;
+}
+
+static void ReadRanges(std::vector<SRV_RANGE> &ranges, std::vector<std::string> &results, std::vector<bool> &ok)
+{
+  //
+  // Sort the reads and read runs of nearby ranges with one
+  // ReadProcessMemory, then scatter the bytes back to their items.
+  //
+
+  std::sort(ranges.begin(), ranges.end(), LessRange);
+  std::string buff;
+  for (size_t i = 0; i < ranges.size();) {
+    DWORD64 begin = ranges[i].address, end = begin + ranges[i].size;
+    size_t j = i + 1;
+    while (j < ranges.size() && ranges[j].address <= end + SRV_MERGE_GAP &&
+           ranges[j].address + (DWORD64)ranges[j].size - begin <= SRV_MAX_SPAN) {
+      end = (std::max)(end, ranges[j].address + (DWORD64)ranges[j].size);
+      j++;
+    }
+    buff.resize((size_t)(end - begin));
+    bool merged = ReadDbgeeMemory(begin, (LPVOID)buff.data(), buff.size()) ? true : false;
+    if (merged) {
+      RestoreOriginalCode(begin, (LPVOID)buff.data(), buff.size());
+    }
+    for (size_t k = i; k < j; k++) {
+      const SRV_RANGE &r = ranges[k];
+      if (merged) {
+        results[r.item] = buff.substr((size_t)(r.address - begin), r.size);
+        ok[r.item] = true;
+      } else {                          // Some page in the run is unreadable, read alone.
+        results[r.item].resize(r.size);
+        ok[r.item] = ReadDbgeeMemory(r.address, (LPVOID)results[r.item].data(), r.size) ? true : false;
+        if (ok[r.item]) {
+          RestoreOriginalCode(r.address, (LPVOID)results[r.item].data(), r.size);
+        }
+      }
+    }
+    i = j;
+  }
+  ranges.clear();
+}
+
+void HandleBatch(const SRV_HEADER &hdr, const std::vector<char> &payload, std::vector<char> &resp)
+{
+  //
+  // Reads are collected and done together, before the next write so
+  // items keep their order.
+  //
+
+  std::vector<SRV_RANGE> ranges;
+  std::vector<std::string> results(hdr.count);
+  std::vector<bool> ok(hdr.count, false);
+  size_t pos = 0;
+  for (size_t i = 0; i < hdr.count && sizeof(SRV_ITEM) <= payload.size() - pos; i++) {
+    const SRV_ITEM &item = *(const SRV_ITEM*)&payload[pos];
+    pos += sizeof(SRV_ITEM);
+    bool wraps = 0xffffffff - item.address < item.size;
+    switch (item.type) {
+      case SRV_READ_MEMORY:
+        if (SRV_MAX_PAYLOAD >= item.size && !wraps) {
+          SRV_RANGE r;
+          r.address = item.address;
+          r.size = item.size;
+          r.item = i;
+          ranges.push_back(r);
+        }
+        break;
+      case SRV_WRITE_MEMORY:
+        if (item.size <= payload.size() - pos) {
+          ReadRanges(ranges, results, ok);
+          ok[i] = !wraps && FALSE != WriteDbgeeCode(item.address, &payload[pos], item.size);
+          InvalidateDisasmCache(item.address, item.size);
+          pos += item.size;
+        }
+        break;
+      case SRV_GET_CONTEXT:
+        {
+          CONTEXT ctx;
+          ctx.ContextFlags = CONTEXT_FULL | CONTEXT_DEBUG_REGISTERS;
+          if (GetDbgeeContext(ctx)) {
+            results[i].assign((const char*)&ctx, sizeof(ctx));
+            ok[i] = true;
+          }
+        }
+        break;
+    }
+  }
+  ReadRanges(ranges, results, ok);
+
+  for (size_t i = 0; i < hdr.count; i++) {
+    DWORD size = ok[i] ? (DWORD)results[i].size() : (DWORD)-1;
+    resp.insert(resp.end(), (const char*)&size, (const char*)&size + sizeof(size));
+    if (ok[i]) {
+      resp.insert(resp.end(), results[i].begin(), results[i].end());
+    }
+  }
+}
+
+bool StartDebugServer(int port)
+{
+  WSADATA wsa;
+  if (0 != WSAStartup(MAKEWORD(2, 2), &wsa)) {
+    printf("WSAStartup failed\n");
+    return false;
+  }
+
+  SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((unsigned short)port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (INVALID_SOCKET == s || SOCKET_ERROR == bind(s, (sockaddr*)&addr, sizeof(addr)) || SOCKET_ERROR == listen(s, 1)) {
+    printf("Debug server listen on port %d failed: %d\n", port, WSAGetLastError());
+    closesocket(s);
+    return false;
+  }
+
+  printf("Debug server waiting on 127.0.0.1:%d\n", port);
+  g_srvClient = accept(s, NULL, NULL);
+  closesocket(s);
+  if (INVALID_SOCKET == g_srvClient) {
+    printf("Debug server accept failed: %d\n", WSAGetLastError());
+    return false;
+  }
+  BOOL nodelay = TRUE;
+  setsockopt(g_srvClient, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+  printf("Debug client connected\n");
+  return true;
+}
+
+void StopDebugServer()
+{
+  if (INVALID_SOCKET == g_srvClient) {
+    return;
+  }
+  if (g_srvStopPending) {               // Report process exit to a waiting command.
+    SendStop(g_srvStopSeq);
+    g_srvStopPending = false;
+  }
+  closesocket(g_srvClient);
+  g_srvClient = INVALID_SOCKET;
+  WSACleanup();
+}
+
+bool IsServerRunning()
+{
+  return INVALID_SOCKET != g_srvClient;
+}
+
+void ServeDebugClient()
+{
+  if (g_srvStopPending) {
+    g_srvStopPending = false;
+    if (!SendStop(g_srvStopSeq)) {
+      StopDebugServer();
+      return;
+    }
+  }
+
+  while (DBGS_BREAK == g_dbgState) {
+    SRV_HEADER hdr;
+    std::vector<char> payload;
+    if (!RecvAll(g_srvClient, (char*)&hdr, sizeof(hdr)) || SRV_MAX_PAYLOAD < hdr.size) {
+      printf("Debug client disconnected\n");
+      StopDebugServer();
+      return;
+    }
+    payload.resize(hdr.size);
+    if (0 < hdr.size && !RecvAll(g_srvClient, &payload[0], hdr.size)) {
+      printf("Debug client disconnected\n");
+      StopDebugServer();
+      return;
+    }
+
+    std::vector<char> resp;
+    switch (hdr.type) {
+      case SRV_BATCH:
+        HandleBatch(hdr, payload, resp);
+        SendSrvMessage(g_srvClient, SRV_BATCH, hdr.count, hdr.seq, resp);
+        break;
+      case SRV_COMMAND:
+        ExecuteCommand(std::string(payload.begin(), payload.end()));
+        if (DBGS_BREAK == g_dbgState) {
+          SendStop(hdr.seq);
+        } else {                        // Resumed, answer at next stop.
+          g_srvStopPending = true;
+          g_srvStopSeq = hdr.seq;
+        }
+        break;
+      default:
+        SendSrvMessage(g_srvClient, SRV_ERROR, 0, hdr.seq, resp);
+        break;
+    }
+  }
+}
+
+//
+// Stand-in client, measures batched and one-by-one read throughput against
+// a debug server stopped at a break.
+//
+
+bool RecvResponse(SOCKET s, SRV_HEADER &hdr, std::vector<char> &payload)
+{
+  if (!RecvAll(s, (char*)&hdr, sizeof(hdr)) || SRV_MAX_PAYLOAD < hdr.size) {
+    return false;
+  }
+  payload.resize(hdr.size);
+  return 0 == hdr.size || RecvAll(s, &payload[0], hdr.size);
+}
+
+double BenchReads(SOCKET s, DWORD base, int nMsgs, int nRanges, int depth)
+{
+  std::vector<char> req(sizeof(SRV_HEADER) + nRanges * sizeof(SRV_ITEM));
+  SRV_HEADER &hdr = *(SRV_HEADER*)&req[0];
+  hdr.size = nRanges * sizeof(SRV_ITEM);
+  hdr.type = SRV_BATCH;
+  hdr.count = (WORD)nRanges;
+  SRV_ITEM *items = (SRV_ITEM*)&req[sizeof(SRV_HEADER)];
+  for (int i = 0; i < nRanges; i++) {
+    items[i].type = SRV_READ_MEMORY;
+    items[i].address = base + i * 64;
+    items[i].size = 16;
+  }
+
+  LARGE_INTEGER freq, t0, t1;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t0);
+
+  SRV_HEADER rh;
+  std::vector<char> payload;
+  int sent = 0, received = 0;
+  while (received < nMsgs) {
+    while (sent < nMsgs && sent - received < depth) { // Keep depth requests in flight.
+      hdr.seq = sent++;
+      if (!SendAll(s, &req[0], (int)req.size())) {
+        return -1;
+      }
+    }
+    if (!RecvResponse(s, rh, payload)) {
+      return -1;
+    }
+    received++;
+  }
+
+  QueryPerformanceCounter(&t1);
+  return (t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart;
+}
+
+int BenchDebugServer(int port, int nReads)
+{
+  WSADATA wsa;
+  WSAStartup(MAKEWORD(2, 2), &wsa);
+  SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((unsigned short)port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (SOCKET_ERROR == connect(s, (sockaddr*)&addr, sizeof(addr))) {
+    printf("Connect to 127.0.0.1:%d failed: %d\n", port, WSAGetLastError());
+    closesocket(s);
+    WSACleanup();
+    return -1;
+  }
+  BOOL nodelay = TRUE;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+
+  //
+  // Read around the stack pointer of the stopped thread, always readable.
+  //
+
+  std::vector<char> req(sizeof(SRV_HEADER) + sizeof(SRV_ITEM));
+  SRV_HEADER &hdr = *(SRV_HEADER*)&req[0];
+  hdr.size = sizeof(SRV_ITEM);
+  hdr.type = SRV_BATCH;
+  hdr.count = 1;
+  hdr.seq = 0;
+  SRV_ITEM &item = *(SRV_ITEM*)&req[sizeof(SRV_HEADER)];
+  item.type = SRV_GET_CONTEXT;
+  item.address = 0;
+  item.size = 0;
+  SRV_HEADER rh;
+  std::vector<char> payload;
+  if (!SendAll(s, &req[0], (int)req.size()) || !RecvResponse(s, rh, payload) || sizeof(DWORD) + sizeof(CONTEXT) > payload.size()) {
+    printf("Get context failed\n");
+    closesocket(s);
+    WSACleanup();
+    return -1;
+  }
+  const CONTEXT *ctx = (const CONTEXT*)&payload[sizeof(DWORD)];
+  DWORD base = ctx->Esp;
+
+  printf("%d reads of 16 bytes around ESP 0x%08x\n", nReads, base);
+  static const int shapes[][2] = {      // Ranges per message, requests in flight.
+    {1, 1},
+    {1, 16},
+    {50, 1},
+    {50, 16}
+  };
+  for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+    int nRanges = shapes[i][0], depth = shapes[i][1];
+    double ms = BenchReads(s, base, nReads / nRanges, nRanges, depth);
+    if (0 > ms) {
+      printf("Server connection lost\n");
+      break;
+    }
+    printf("%2d ranges/msg, %2d in flight: %8.1f ms, %10.0f reads/s\n", nRanges, depth, ms, nReads * 1000.0 / ms);
+  }
+
+  closesocket(s);
+  WSACleanup();
+  return 0;
+}
@@ -0,0 +1,252 @@
+#include "mydbg.h"
+#include "mydbghelp.h"
+
+#include <algorithm>
+
+extern PROCESS_INFORMATION g_piDbgee;
+extern std::map<DWORD64, BREAK_POINT> g_bp;
+extern std::vector<BP_PATTERN> g_bpPatterns;
+
+#define SESSION_MAGIC "mydbg session 1"
+
+//
+// Session file: breakpoints, breakpoint patterns, watches and exception
+// policies, saved at process exit and restored on the next launch. Only
+// with -session file, a run without it leaves no file behind.
+// Breakpoints are kept per module as RVAs with the module's checksum,
+// timestamp and size. When a module loads unchanged its breakpoints are
+// patched straight from the RVAs in one batch, no symbol queries. A
+// changed module has them re-resolved by file:line. Only bps on a source
+// line are kept, which all user bps are.
+//
+// Text, one item per line:
+//   sx code|* policy
+//   pattern 0|1 pattern
+//   watch expr
+//   module name checksum timestamp size
+//   bp rva line file           (module above)
+//
+
+struct SESSION_BP
+{
+  DWORD rva;
+  int LineNumber;
+  std::string fn;
+};
+
+struct SESSION_MODULE
+{
+  DWORD checksum;
+  DWORD timestamp;
+  DWORD size;
+  std::vector<SESSION_BP> bps;
+};
+
+std::string g_sessionFileName;
+std::map<std::string, SESSION_MODULE> g_sessionModules; // <Module name lowercase, bps>
+std::vector<std::string> g_sessionWatches; // Added at a break, need a scope.
+bool g_sessionWatchesTried;             // Failures reported once.
+
+static bool GetModuleIdentity(DWORD64 base, std::string &name, SESSION_MODULE &mod)
+{
+  IMAGEHLP_MODULE64 mi = {0};
+  mi.SizeOfStruct = sizeof(mi);
+  if (!TRACE_CALL("SymGetModuleInfo64", SymGetModuleInfo64(g_piDbgee.hProcess, base, &mi))) {
+    return false;
+  }
+  name = mi.ModuleName;
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  mod.checksum = mi.CheckSum;
+  mod.timestamp = mi.TimeDateStamp;
+  mod.size = mi.ImageSize;
+  return true;
+}
+
+bool LoadSession(const char *fn)
+{
+  g_sessionFileName = fn;
+  FILE *fp = fopen(fn, "rt");
+  if (!fp) {
+    return false;                       // First run.
+  }
+  char line[1024];
+  if (!fgets(line, sizeof(line), fp) || 0 != strncmp(line, SESSION_MAGIC, strlen(SESSION_MAGIC))) {
+    printf("%s is not a session file\n", fn);
+    fclose(fp);
+    return false;
+  }
+
+  SESSION_MODULE *mod = NULL;
+  int nBps = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    std::string str(line);
+    str.erase(str.find_last_not_of("\r\n") + 1);
+    char key[16], arg1[MAX_PATH], arg2[MAX_PATH];
+    unsigned int a, b, c;
+    int LineNumber = 0;
+    int n = 0;
+    if (1 != sscanf(str.c_str(), "%15s %n", key, &n)) {
+      continue;
+    }
+    std::string rest(str, n);
+    if (0 == strcmp(key, "sx") && 2 == sscanf(rest.c_str(), "%259s %259s", arg1, arg2)) {
+      SetExceptionPolicy(arg1, arg2);
+    } else if (0 == strcmp(key, "pattern") && 1 == sscanf(rest.c_str(), "%u %n", &a, &n)) {
+      BP_PATTERN pat;
+      pat.source = 0 != a;
+      pat.pattern = rest.substr(n);
+      g_bpPatterns.push_back(pat);    // Matched as modules load.
+    } else if (0 == strcmp(key, "watch")) {
+      g_sessionWatches.push_back(rest);
+    } else if (0 == strcmp(key, "module") && 4 == sscanf(rest.c_str(), "%259s %x %x %x", arg1, &a, &b, &c)) {
+      mod = &g_sessionModules[arg1];
+      mod->checksum = a;
+      mod->timestamp = b;
+      mod->size = c;
+      mod->bps.clear();
+    } else if (0 == strcmp(key, "bp") && mod && 2 == sscanf(rest.c_str(), "%x %d %n", &a, &LineNumber, &n)) {
+      SESSION_BP bp;
+      bp.rva = a;
+      bp.LineNumber = LineNumber;
+      bp.fn = rest.substr(n);
+      mod->bps.push_back(bp);
+      nBps++;
+    }
+  }
+  fclose(fp);
+  printf("Session %s: %d breakpoints in %u modules, %u patterns, %u watches\n", fn, nBps,
+         (unsigned int)g_sessionModules.size(), (unsigned int)g_bpPatterns.size(), (unsigned int)g_sessionWatches.size());
+  return true;
+}
+
+void ApplySessionBreakPoints(DWORD64 base)
+{
+  if (g_sessionModules.empty()) {
+    return;
+  }
+  std::string name;
+  SESSION_MODULE now;
+  if (!GetModuleIdentity(base, name, now)) {
+    return;
+  }
+  std::map<std::string, SESSION_MODULE>::iterator it = g_sessionModules.find(name);
+  if (g_sessionModules.end() == it) {
+    return;
+  }
+  const SESSION_MODULE &mod = it->second;
+  bool same = mod.checksum == now.checksum && mod.timestamp == now.timestamp && mod.size == now.size;
+
+  std::vector<BREAK_POINT> bps;
+  for (size_t i = 0; i < mod.bps.size(); i++) {
+    BREAK_POINT bp;
+    bp.fn = mod.bps[i].fn;
+    bp.LineNumber = mod.bps[i].LineNumber;
+    bp.address = base + mod.bps[i].rva;
+    if (!same) {
+      LONG displacement;
+      IMAGEHLP_LINE64 li = { 0 };
+      li.SizeOfStruct = sizeof(li);
+      if (!TRACE_CALL("SymGetLineFromName64", SymGetLineFromName64(g_piDbgee.hProcess, (PSTR)name.c_str(), (PSTR)bp.fn.c_str(), bp.LineNumber, &displacement, &li))) {
+        printf("\tSession breakpoint %s:%d not found\n", bp.fn.c_str(), bp.LineNumber);
+        continue;
+      }
+      bp.address = li.Address;
+    }
+    bps.push_back(bp);
+  }
+  int n = AddBreakPoints(bps);
+  printf("\tRestore %d breakpoints in %s%s\n", n, name.c_str(), same ? ", cached" : ", module changed, resolved");
+  g_sessionModules.erase(it);
+}
+
+void ApplySessionWatches()
+{
+  //
+  // A watch whose variables aren't in scope at this break stays pending
+  // and is tried again at the next one, and saved back if it never takes.
+  //
+
+  std::vector<std::string> pending;
+  for (size_t i = 0; i < g_sessionWatches.size(); i++) {
+    if (!AddWatch(g_sessionWatches[i], g_sessionWatchesTried)) {
+      pending.push_back(g_sessionWatches[i]);
+    }
+  }
+  g_sessionWatches.swap(pending);
+  g_sessionWatchesTried = true;
+}
+
+void SaveSession()
+{
+  if (g_sessionFileName.empty()) {
+    return;
+  }
+
+  //
+  // Group user bps by module. Only source bps persist: b address and b
+  // function set the bp on the address's line, so every user bp has one,
+  // a bp with no line is a temp bp. Pattern bps come back from their
+  // pattern.
+  //
+
+  std::map<std::string, SESSION_MODULE> modules;
+  for (std::map<DWORD64, BREAK_POINT>::const_iterator it = g_bp.begin(); g_bp.end() != it; ++it) {
+    const BREAK_POINT &bp = it->second;
+    if (0 == bp.LineNumber || !bp.pattern.empty()) {
+      continue;
+    }
+    DWORD64 base = TRACE_CALL("SymGetModuleBase64", SymGetModuleBase64(g_piDbgee.hProcess, bp.address));
+    std::string name;
+    SESSION_MODULE id;
+    if (0 == base || !GetModuleIdentity(base, name, id)) {
+      continue;
+    }
+    SESSION_MODULE &mod = modules[name];
+    mod.checksum = id.checksum;
+    mod.timestamp = id.timestamp;
+    mod.size = id.size;
+    SESSION_BP sbp = {(DWORD)(bp.address - base), bp.LineNumber, bp.fn};
+    mod.bps.push_back(sbp);
+  }
+
+  //
+  // Modules of the last session that didn't load this time keep their bps.
+  //
+
+  for (std::map<std::string, SESSION_MODULE>::const_iterator it = g_sessionModules.begin(); g_sessionModules.end() != it; ++it) {
+    if (!modules.count(it->first)) {
+      modules[it->first] = it->second;
+    }
+  }
+
+  FILE *fp = fopen(g_sessionFileName.c_str(), "wt");
+  if (!fp) {
+    printf("Save session %s failed\n", g_sessionFileName.c_str());
+    return;
+  }
+  fprintf(fp, "%s\n", SESSION_MAGIC);
+  std::vector<std::string> codes, policies;
+  GetExceptionPolicies(codes, policies);
+  for (size_t i = 0; i < codes.size(); i++) {
+    fprintf(fp, "sx %s %s\n", codes[i].c_str(), policies[i].c_str());
+  }
+  for (size_t i = 0; i < g_bpPatterns.size(); i++) {
+    fprintf(fp, "pattern %d %s\n", g_bpPatterns[i].source ? 1 : 0, g_bpPatterns[i].pattern.c_str());
+  }
+  std::vector<std::string> watches;
+  GetWatchExpressions(watches);
+  watches.insert(watches.end(), g_sessionWatches.begin(), g_sessionWatches.end()); // Never in scope.
+  for (size_t i = 0; i < watches.size(); i++) {
+    fprintf(fp, "watch %s\n", watches[i].c_str());
+  }
+  for (std::map<std::string, SESSION_MODULE>::const_iterator it = modules.begin(); modules.end() != it; ++it) {
+    const SESSION_MODULE &mod = it->second;
+    fprintf(fp, "module %s %x %x %x\n", it->first.c_str(), mod.checksum, mod.timestamp, mod.size);
+    for (size_t i = 0; i < mod.bps.size(); i++) {
+      fprintf(fp, "bp %x %d %s\n", mod.bps[i].rva, mod.bps[i].LineNumber, mod.bps[i].fn.c_str());
+    }
+  }
+  fclose(fp);
+  g_sessionModules.clear();
+  g_sessionWatches.clear();
+}
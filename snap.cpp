@@ -0,0 +1,201 @@
+#include "mydbg.h"
+
+extern PROCESS_INFORMATION g_piDbgee;
+extern DEBUG_TARGET *g_target;
+
+#define SNAP_PAGE_SIZE 4096
+#define SNAP_READ_PAGES 256             // Pages per bulk read.
+#define SNAP_MAX_RANGES 200
+
+struct SNAP_PAGE
+{
+  DWORD64 address;
+  DWORD64 hash;
+  int slot;                             // Index into page pool, shared by pages with same content.
+};
+
+std::vector<SNAP_PAGE> g_snapPages;
+std::vector<unsigned char> g_snapPool;
+std::vector<int> g_snapSlotRefs;
+std::vector<int> g_snapFreeSlots;
+std::map<DWORD64, int> g_snapSlotByHash; // <Hash, Slot>
+
+DWORD64 HashPage(const unsigned char *p)
+{
+  DWORD64 h = 14695981039346656037ULL;
+  const unsigned int *w = (const unsigned int*)p;
+  for (int i = 0; i < SNAP_PAGE_SIZE / 4; i++) {
+    h = (h ^ w[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+void ReleaseSnapSlot(int slot, DWORD64 hash)
+{
+  if (0 == --g_snapSlotRefs[slot]) {
+    std::map<DWORD64, int>::iterator it = g_snapSlotByHash.find(hash);
+    if (g_snapSlotByHash.end() != it && slot == it->second) {
+      g_snapSlotByHash.erase(it);
+    }
+    g_snapFreeSlots.push_back(slot);
+  }
+}
+
+int StoreSnapPage(const unsigned char *p, DWORD64 hash)
+{
+  //
+  // Identical pages (zero filled heap, repeated tables) share one slot.
+  //
+
+  std::map<DWORD64, int>::iterator it = g_snapSlotByHash.find(hash);
+  if (g_snapSlotByHash.end() != it && 0 == memcmp(&g_snapPool[it->second * SNAP_PAGE_SIZE], p, SNAP_PAGE_SIZE)) {
+    g_snapSlotRefs[it->second]++;
+    return it->second;
+  }
+
+  int slot;
+  if (!g_snapFreeSlots.empty()) {
+    slot = g_snapFreeSlots.back();
+    g_snapFreeSlots.pop_back();
+  } else {
+    slot = (int)g_snapSlotRefs.size();
+    g_snapSlotRefs.push_back(0);
+    g_snapPool.resize(g_snapPool.size() + SNAP_PAGE_SIZE);
+  }
+  memcpy(&g_snapPool[slot * SNAP_PAGE_SIZE], p, SNAP_PAGE_SIZE);
+  g_snapSlotRefs[slot] = 1;
+  g_snapSlotByHash[hash] = slot;
+  return slot;
+}
+
+void ClearSnapshot()
+{
+  g_snapPages.clear();
+  g_snapPool.clear();
+  g_snapSlotRefs.clear();
+  g_snapFreeSlots.clear();
+  g_snapSlotByHash.clear();
+}
+
+bool TakeSnapshot(DWORD64 addr, DWORD64 count)
+{
+  ClearSnapshot();
+
+  std::vector<MEM_REGION> regions;
+  if (0 == count) {
+    EnumCommittedRegions(regions, true);
+  } else {
+    MEM_REGION r;
+    r.address = addr - (addr % SNAP_PAGE_SIZE);
+    r.size = (addr + count - r.address + SNAP_PAGE_SIZE - 1) / SNAP_PAGE_SIZE * SNAP_PAGE_SIZE;
+    r.protect = 0;
+    regions.push_back(r);
+  }
+
+  std::vector<unsigned char> buff(SNAP_READ_PAGES * SNAP_PAGE_SIZE);
+  for (size_t i = 0; i < regions.size(); i++) {
+    const MEM_REGION &r = regions[i];
+    for (DWORD64 off = 0; off < r.size; off += buff.size()) {
+      SIZE_T size = (SIZE_T)(std::min)((DWORD64)buff.size(), r.size - off);
+      if (!g_target->ReadMemory(r.address + off, &buff[0], size)) {
+        continue;
+      }
+      for (SIZE_T p = 0; p < size; p += SNAP_PAGE_SIZE) {
+        SNAP_PAGE pg;
+        pg.address = r.address + off + p;
+        pg.hash = HashPage(&buff[p]);
+        pg.slot = StoreSnapPage(&buff[p], pg.hash);
+        g_snapPages.push_back(pg);
+      }
+    }
+  }
+
+  printf("Snapshot %u pages(%u KB), %u KB stored\n", (unsigned int)g_snapPages.size(), (unsigned int)g_snapPages.size() * (SNAP_PAGE_SIZE / 1024), (unsigned int)(g_snapPool.size() / 1024));
+  return !g_snapPages.empty();
+}
+
+void PrintChangedRange(DWORD64 begin, DWORD64 end)
+{
+  printf("0x%08x-0x%08x %5u", (unsigned int)begin, (unsigned int)end - 1, (unsigned int)(end - begin));
+
+  char buff[sizeof(SYMBOL_INFO) + 256] = {0};
+  SYMBOL_INFO *psi = (SYMBOL_INFO*)buff;
+  psi->SizeOfStruct = sizeof(SYMBOL_INFO);
+  psi->MaxNameLen = 256;
+  DWORD64 displacement = 0;
+  if (SymFromAddr(g_piDbgee.hProcess, begin, &displacement, psi) && displacement < (std::max)((ULONG)1, psi->Size)) {
+    if (0 == displacement) {
+      printf("  %s", psi->Name);
+    } else {
+      printf("  %s+0x%x", psi->Name, (unsigned int)displacement);
+    }
+  }
+  printf("\n");
+}
+
+bool DiffSnapshot()
+{
+  if (g_snapPages.empty()) {
+    printf("No snapshot, use snap first\n");
+    return false;
+  }
+
+  //
+  // Pages are read in bulk runs of contiguous addresses. Only pages whose
+  // hash changed are compared byte by byte, and only those get new storage.
+  //
+
+  std::vector<unsigned char> buff(SNAP_READ_PAGES * SNAP_PAGE_SIZE);
+  DWORD64 rangeBegin = 0, rangeEnd = 0;
+  unsigned int nRanges = 0, nChangedPages = 0, nChangedBytes = 0;
+
+  for (size_t i = 0; i < g_snapPages.size();) {
+    size_t n = 1;
+    while (i + n < g_snapPages.size() && n < SNAP_READ_PAGES && g_snapPages[i + n].address == g_snapPages[i].address + n * SNAP_PAGE_SIZE) {
+      n++;
+    }
+    if (!g_target->ReadMemory(g_snapPages[i].address, &buff[0], n * SNAP_PAGE_SIZE)) {
+      printf("0x%08x-0x%08x unreadable\n", (unsigned int)g_snapPages[i].address, (unsigned int)(g_snapPages[i].address + n * SNAP_PAGE_SIZE - 1));
+      i += n;
+      continue;
+    }
+
+    for (size_t k = 0; k < n; k++) {
+      SNAP_PAGE &pg = g_snapPages[i + k];
+      const unsigned char *curr = &buff[k * SNAP_PAGE_SIZE];
+      DWORD64 hash = HashPage(curr);
+      if (hash == pg.hash) {
+        continue;
+      }
+      nChangedPages++;
+      const unsigned char *prev = &g_snapPool[pg.slot * SNAP_PAGE_SIZE];
+      for (int j = 0; j < SNAP_PAGE_SIZE; j++) {
+        if (curr[j] == prev[j]) {
+          continue;
+        }
+        nChangedBytes++;
+        DWORD64 a = pg.address + j;
+        if (a != rangeEnd) {
+          if (rangeEnd && SNAP_MAX_RANGES > nRanges++) {
+            PrintChangedRange(rangeBegin, rangeEnd);
+          }
+          rangeBegin = a;
+        }
+        rangeEnd = a + 1;
+      }
+      ReleaseSnapSlot(pg.slot, pg.hash);
+      pg.hash = hash;
+      pg.slot = StoreSnapPage(curr, hash);
+    }
+    i += n;
+  }
+  if (rangeEnd && SNAP_MAX_RANGES > nRanges++) {
+    PrintChangedRange(rangeBegin, rangeEnd);
+  }
+
+  if (SNAP_MAX_RANGES < nRanges) {
+    printf("... %u more ranges\n", nRanges - SNAP_MAX_RANGES);
+  }
+  printf("%u bytes changed in %u ranges, %u of %u pages\n", nChangedBytes, nRanges, nChangedPages, (unsigned int)g_snapPages.size());
+  return true;
+}
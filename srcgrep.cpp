@@ -0,0 +1,307 @@
+#include "mydbg.h"
+
+#include <algorithm>
+#include <iterator>
+
+extern PROCESS_INFORMATION g_piDbgee;
+
+#define GREP_MAX_RESULTS 200
+#define GREP_HASH_BITS 20
+
+//
+// Source search over every file named in the loaded modules' line tables.
+// Modules whose symbols are still deferred are left out, and come in once
+// something loads them. The file list comes from dbghelp on the main
+// thread at each prompt; a background thread reads the files while the
+// user is idle and builds a trigram index: for each 3 byte sequence,
+// hashed to 20 bits, the sorted ids of files containing it. A search
+// intersects the posting lists of the query's trigrams and only scans the
+// files left, so hash collisions just cost a scan. Indexes are immutable
+// once built, a new module set gets a new one swapped in.
+//
+
+struct SRC_FILE
+{
+  std::string path;
+  std::string text;
+  std::vector<DWORD> lines;             // Offset of each line start.
+};
+
+struct SRC_INDEX
+{
+  std::vector<SRC_FILE> files;
+  std::vector<DWORD> offsets;           // Per trigram hash, start in ids, plus end.
+  std::vector<DWORD> ids;               // File ids, grouped by trigram hash.
+};
+
+struct GREP_RESULT
+{
+  std::string path;
+  DWORD file;                           // Id in the index searched.
+  int LineNumber;
+};
+
+SRC_INDEX *g_srcIndex;                  // Current, used by main thread only.
+SRC_INDEX *g_srcIndexNext;              // Being built.
+HANDLE g_srcIndexThread;
+std::vector<DWORD64> g_srcIndexModules; // Module set the index was built for.
+std::vector<GREP_RESULT> g_grepResults; // Last search, for b #n.
+
+static BOOL CALLBACK StaticEnumSourceFiles(PSOURCEFILE pSourceFile, PVOID UserContext)
+{
+  std::map<std::string, std::string> &paths = *(std::map<std::string, std::string>*)UserContext;
+  std::string key(pSourceFile->FileName);
+  std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+  paths[key] = pSourceFile->FileName;   // Same file named in several modules.
+  return TRUE;
+}
+
+static inline DWORD Trigram(const char *p)
+{
+  DWORD gram = ((unsigned char)p[0] << 16) | ((unsigned char)p[1] << 8) | (unsigned char)p[2];
+  return (gram * 2654435761u) >> (32 - GREP_HASH_BITS);
+}
+
+static DWORD WINAPI BuildSourceIndex(LPVOID param)
+{
+  SRC_INDEX *idx = (SRC_INDEX*)param;
+  std::vector<std::vector<DWORD> > grams(idx->files.size()); // Unique per file.
+  idx->offsets.assign((1 << GREP_HASH_BITS) + 1, 0);
+  for (size_t i = 0; i < idx->files.size(); i++) {
+    SRC_FILE &f = idx->files[i];
+    FILE *fp = fopen(f.path.c_str(), "rb");
+    if (!fp) {
+      continue;
+    }
+    char buff[64 * 1024];
+    size_t n;
+    while (0 < (n = fread(buff, 1, sizeof(buff), fp))) {
+      f.text.append(buff, n);
+    }
+    fclose(fp);
+
+    f.lines.push_back(0);
+    std::vector<DWORD> &g = grams[i];
+    for (size_t j = 0; j < f.text.size(); j++) {
+      if ('\n' == f.text[j]) {
+        f.lines.push_back((DWORD)j + 1);
+      }
+      if (j + 3 <= f.text.size()) {
+        g.push_back(Trigram(&f.text[j]));
+      }
+    }
+    std::sort(g.begin(), g.end());
+    g.erase(std::unique(g.begin(), g.end()), g.end());
+    for (size_t j = 0; j < g.size(); j++) {
+      idx->offsets[g[j] + 1]++;
+    }
+  }
+
+  //
+  // Counts to offsets, then fill. Files go in id order, so each posting
+  // list comes out sorted.
+  //
+
+  for (size_t i = 1; i < idx->offsets.size(); i++) {
+    idx->offsets[i] += idx->offsets[i - 1];
+  }
+  idx->ids.resize(idx->offsets.back());
+  std::vector<DWORD> next(idx->offsets.begin(), idx->offsets.end() - 1);
+  for (size_t i = 0; i < grams.size(); i++) {
+    for (size_t j = 0; j < grams[i].size(); j++) {
+      idx->ids[next[grams[i][j]]++] = (DWORD)i;
+    }
+    std::vector<DWORD>().swap(grams[i]);
+  }
+  return 0;
+}
+
+static void FinishSourceIndex()
+{
+  if (!g_srcIndexThread) {
+    return;
+  }
+  WaitForSingleObject(g_srcIndexThread, INFINITE);
+  CloseHandle(g_srcIndexThread);
+  g_srcIndexThread = NULL;
+  delete g_srcIndex;
+  g_srcIndex = g_srcIndexNext;
+  g_srcIndexNext = NULL;
+}
+
+void UpdateSourceIndex()
+{
+  //
+  // Never waits: a build still running is left alone, the next call swaps
+  // it in and looks at the module set again.
+  //
+
+  if (g_srcIndexThread) {
+    if (WAIT_OBJECT_0 != WaitForSingleObject(g_srcIndexThread, 0)) {
+      return;
+    }
+    FinishSourceIndex();
+  }
+  std::vector<DWORD64> modules, all;
+  GetIndexModules(all);
+  for (size_t i = 0; i < all.size(); i++) {
+    if (IsModuleSymbolsLoaded(all[i])) {
+      modules.push_back(all[i]);
+    }
+  }
+  if (modules == g_srcIndexModules && g_srcIndex) {
+    return;
+  }
+  g_srcIndexModules = modules;
+
+  std::map<std::string, std::string> paths;
+  for (size_t i = 0; i < modules.size(); i++) {
+    TRACE_CALL("SymEnumSourceFiles", SymEnumSourceFiles(g_piDbgee.hProcess, modules[i], NULL, StaticEnumSourceFiles, &paths));
+  }
+  g_srcIndexNext = new SRC_INDEX;
+  g_srcIndexNext->files.resize(paths.size());
+  size_t i = 0;
+  for (std::map<std::string, std::string>::const_iterator it = paths.begin(); paths.end() != it; ++it) {
+    g_srcIndexNext->files[i++].path = it->second;
+  }
+  g_srcIndexThread = CreateThread(NULL, 0, BuildSourceIndex, g_srcIndexNext, 0, NULL);
+  if (!g_srcIndexThread) {
+    BuildSourceIndex(g_srcIndexNext);
+    delete g_srcIndex;
+    g_srcIndex = g_srcIndexNext;
+    g_srcIndexNext = NULL;
+  }
+}
+
+static void GetPostings(const SRC_INDEX &idx, DWORD gram, const DWORD *&begin, const DWORD *&end)
+{
+  begin = idx.ids.empty() ? NULL : &idx.ids[0] + idx.offsets[gram];
+  end = idx.ids.empty() ? NULL : &idx.ids[0] + idx.offsets[gram + 1];
+}
+
+static void FindCandidateFiles(const SRC_INDEX &idx, const std::string &text, std::vector<DWORD> &files)
+{
+  files.clear();
+  if (3 > text.size()) {
+    for (DWORD i = 0; i < idx.files.size(); i++) {
+      files.push_back(i);
+    }
+    return;
+  }
+
+  //
+  // Intersect posting lists, shortest first so the set shrinks fastest.
+  //
+
+  std::vector<std::pair<size_t, DWORD> > grams; // <List length, trigram hash>
+  for (size_t i = 0; i + 3 <= text.size(); i++) {
+    const DWORD *begin, *end;
+    DWORD gram = Trigram(&text[i]);
+    GetPostings(idx, gram, begin, end);
+    if (begin == end) {
+      return;
+    }
+    grams.push_back(std::make_pair((size_t)(end - begin), gram));
+  }
+  std::sort(grams.begin(), grams.end());
+
+  const DWORD *begin, *end;
+  GetPostings(idx, grams[0].second, begin, end);
+  files.assign(begin, end);
+  std::vector<DWORD> tmp;
+  for (size_t i = 1; i < grams.size() && !files.empty(); i++) {
+    if (grams[i].second == grams[i - 1].second) {
+      continue;
+    }
+    GetPostings(idx, grams[i].second, begin, end);
+    tmp.clear();
+    std::set_intersection(files.begin(), files.end(), begin, end, std::back_inserter(tmp));
+    files.swap(tmp);
+  }
+}
+
+void GrepSource(const std::string &text)
+{
+  if (text.empty()) {
+    printf("invalid grep cmd\n");
+    return;
+  }
+  LONGLONG t0 = StartupTicks();
+  UpdateSourceIndex();
+  bool waited = false;
+  if (g_srcIndexThread && (!g_srcIndex || WAIT_OBJECT_0 == WaitForSingleObject(g_srcIndexThread, 0))) {
+    if (!g_srcIndex) {
+      printf("Indexing %u source files...\n", (unsigned int)g_srcIndexNext->files.size());
+      waited = true;
+    }
+    FinishSourceIndex();
+  } else if (g_srcIndexThread) {
+    printf("(index of new modules still building, searching previous one)\n");
+  }
+  LONGLONG t1 = StartupTicks();
+
+  std::vector<DWORD> files;
+  FindCandidateFiles(*g_srcIndex, text, files);
+  g_grepResults.clear();
+  int nMatches = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    const SRC_FILE &f = g_srcIndex->files[files[i]];
+    size_t pos = 0;
+    while (std::string::npos != (pos = f.text.find(text, pos))) {
+      int line = (int)(std::upper_bound(f.lines.begin(), f.lines.end(), (DWORD)pos) - f.lines.begin());
+      size_t eol = f.text.find('\n', pos);
+      pos = std::string::npos == eol ? f.text.size() : eol + 1;
+      if (GREP_MAX_RESULTS > nMatches++) {
+        GREP_RESULT r = {f.path, files[i], line};
+        g_grepResults.push_back(r);
+      }
+    }
+  }
+  LONGLONG t2 = StartupTicks();
+
+  //
+  // Addresses from the line table, only for results shown. No code on the
+  // line if dbghelp returns another line.
+  //
+
+  for (size_t i = 0; i < g_grepResults.size(); i++) {
+    const GREP_RESULT &r = g_grepResults[i];
+    const SRC_FILE *f = &g_srcIndex->files[r.file];
+    LONG displacement;
+    IMAGEHLP_LINE64 li = { 0 };
+    li.SizeOfStruct = sizeof(li);
+    bool code = TRACE_CALL("SymGetLineFromName64", SymGetLineFromName64(g_piDbgee.hProcess, NULL, (PSTR)r.path.c_str(), r.LineNumber, &displacement, &li))
+                && (int)li.LineNumber == r.LineNumber;
+    DWORD begin = f->lines[r.LineNumber - 1];
+    size_t end = f->text.find_first_of("\r\n", begin);
+    std::string line(f->text, begin, std::string::npos == end ? std::string::npos : end - begin);
+    if (code) {
+      printf("#%-3u 0x%08x %s:%d: %s\n", (unsigned int)i, (unsigned int)li.Address, r.path.c_str(), r.LineNumber, line.c_str());
+    } else {
+      printf("#%-3u %10s %s:%d: %s\n", (unsigned int)i, "", r.path.c_str(), r.LineNumber, line.c_str());
+    }
+  }
+  printf("%d matches, %u of %u files scanned, search %.2f ms", nMatches, (unsigned int)files.size(), (unsigned int)g_srcIndex->files.size(), TicksToMs(t2 - t1));
+  if (waited) {
+    printf(", index %.2f ms", TicksToMs(t1 - t0));
+  }
+  printf("\n");
+}
+
+bool ToggleGrepBreakPoint(int i)
+{
+  if (0 > i || (int)g_grepResults.size() <= i) {
+    printf("no grep result #%d\n", i);
+    return false;
+  }
+  return ToggleBreakPoint(g_grepResults[i].path, g_grepResults[i].LineNumber);
+}
+
+void ClearSourceIndex()
+{
+  FinishSourceIndex();
+  delete g_srcIndex;
+  g_srcIndex = NULL;
+  g_srcIndexModules.clear();
+  g_grepResults.clear();
+}
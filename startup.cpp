@@ -0,0 +1,306 @@
+#include "mydbg.h"
+
+#include <algorithm>
+
+extern int g_dbgState;
+extern PROCESS_INFORMATION g_piDbgee;
+extern std::string g_sessionFileName;
+
+#define STARTUP_MAX_PHASES 16
+#define PREFETCH_MAX_THREADS 8
+#define PREFETCH_READ_SIZE (1024 * 1024)
+
+//
+// Startup timing, from CreateProcess to the first break.
+//
+
+struct STARTUP_PHASE
+{
+  const char *name;
+  LONGLONG ticks;                       // Since startup began.
+};
+
+STARTUP_PHASE g_startupPhases[STARTUP_MAX_PHASES];
+int g_nStartupPhases;
+LONGLONG g_startupBegin;
+LONGLONG g_startupFreq;
+LONGLONG g_moduleLoadTicks, g_moduleLoadMax;
+int g_nModuleLoads;
+bool g_startupTiming, g_startupPrint;
+
+LONGLONG StartupTicks()
+{
+  LARGE_INTEGER t;
+  QueryPerformanceCounter(&t);
+  return t.QuadPart;
+}
+
+double TicksToMs(LONGLONG ticks)
+{
+  if (0 == g_startupFreq) {             // No startup timing in replay and dump sessions.
+    LARGE_INTEGER f;
+    QueryPerformanceFrequency(&f);
+    g_startupFreq = f.QuadPart;
+  }
+  return ticks * 1000.0 / g_startupFreq;
+}
+
+void BeginStartupTiming(bool print)
+{
+  LARGE_INTEGER f;
+  QueryPerformanceFrequency(&f);
+  g_startupFreq = f.QuadPart;
+  g_nStartupPhases = 0;
+  g_moduleLoadTicks = g_moduleLoadMax = 0;
+  g_nModuleLoads = 0;
+  g_startupTiming = true;
+  g_startupPrint = print;
+  g_startupBegin = StartupTicks();
+}
+
+void MarkStartupPhase(const char *name)
+{
+  if (g_startupTiming && STARTUP_MAX_PHASES > g_nStartupPhases) {
+    g_startupPhases[g_nStartupPhases].name = name;
+    g_startupPhases[g_nStartupPhases].ticks = StartupTicks() - g_startupBegin;
+    g_nStartupPhases++;
+  }
+}
+
+void AddModuleLoadTime(LONGLONG ticks)
+{
+  if (g_startupTiming) {
+    g_nModuleLoads++;
+    g_moduleLoadTicks += ticks;
+    g_moduleLoadMax = (std::max)(g_moduleLoadMax, ticks);
+  }
+}
+
+void EndStartupTiming()
+{
+  if (!g_startupTiming) {
+    return;
+  }
+  MarkStartupPhase("first break");
+  g_startupTiming = false;
+  if (!g_startupPrint) {
+    return;
+  }
+
+  printf("Startup:\n");
+  LONGLONG prev = 0;
+  for (int i = 0; i < g_nStartupPhases; i++) {
+    const STARTUP_PHASE &ph = g_startupPhases[i];
+    printf("  %-20s %9.2f ms  (+%.2f)\n", ph.name, TicksToMs(ph.ticks), TicksToMs(ph.ticks - prev));
+    prev = ph.ticks;
+  }
+  printf("  %d module loads, %.2f ms total, %.2f ms max\n", g_nModuleLoads, TicksToMs(g_moduleLoadTicks), TicksToMs(g_moduleLoadMax));
+}
+
+//
+// Symbol prefetch. dbghelp is not thread safe, so symbol tables can't be
+// parsed on other threads. Instead modules are registered with deferred
+// loads, and a worker pool reads each module's PDB (from its CodeView
+// record) into the file cache, so the parse on first lookup doesn't wait
+// for the disk. A burst of load events is spread over all workers.
+//
+
+std::vector<HANDLE> g_prefetchQueue;    // Duplicated module file handles.
+CRITICAL_SECTION g_prefetchLock;
+HANDLE g_prefetchSem;
+HANDLE g_prefetchThreads[PREFETCH_MAX_THREADS];
+int g_nPrefetchThreads;
+volatile bool g_prefetchStop;
+
+static bool ReadFileAt(HANDLE hFile, DWORD offset, LPVOID buff, DWORD size)
+{
+  OVERLAPPED ov = {0};
+  ov.Offset = offset;
+  DWORD read = 0;
+  return ReadFile(hFile, buff, size, &read, &ov) && read == size;
+}
+
+bool GetModulePdbPath(HANDLE hFile, std::string &path)
+{
+  IMAGE_DOS_HEADER dos;
+  IMAGE_NT_HEADERS32 nt;
+  if (!ReadFileAt(hFile, 0, &dos, sizeof(dos)) || IMAGE_DOS_SIGNATURE != dos.e_magic) {
+    return false;
+  }
+  if (!ReadFileAt(hFile, dos.e_lfanew, &nt, sizeof(nt)) || IMAGE_NT_SIGNATURE != nt.Signature) {
+    return false;
+  }
+  const IMAGE_DATA_DIRECTORY &dd = nt.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+  if (0 == dd.VirtualAddress || 0 == dd.Size) {
+    return false;
+  }
+
+  //
+  // Map debug directory RVA to file offset through the section table.
+  //
+
+  DWORD offset = 0;
+  DWORD sections = dos.e_lfanew + FIELD_OFFSET(IMAGE_NT_HEADERS32, OptionalHeader) + nt.FileHeader.SizeOfOptionalHeader;
+  for (WORD i = 0; i < nt.FileHeader.NumberOfSections; i++) {
+    IMAGE_SECTION_HEADER sh;
+    if (!ReadFileAt(hFile, sections + i * sizeof(sh), &sh, sizeof(sh))) {
+      return false;
+    }
+    if (dd.VirtualAddress >= sh.VirtualAddress && dd.VirtualAddress < sh.VirtualAddress + sh.SizeOfRawData) {
+      offset = dd.VirtualAddress - sh.VirtualAddress + sh.PointerToRawData;
+      break;
+    }
+  }
+  if (0 == offset) {
+    return false;
+  }
+
+  for (DWORD i = 0; i < dd.Size / sizeof(IMAGE_DEBUG_DIRECTORY); i++) {
+    IMAGE_DEBUG_DIRECTORY dbg;
+    if (!ReadFileAt(hFile, offset + i * sizeof(dbg), &dbg, sizeof(dbg))) {
+      return false;
+    }
+    if (IMAGE_DEBUG_TYPE_CODEVIEW != dbg.Type || 24 >= dbg.SizeOfData) {
+      continue;
+    }
+    char cv[24 + MAX_PATH] = {0};       // 'RSDS', GUID, age, path.
+    DWORD size = (std::min)(dbg.SizeOfData, (DWORD)sizeof(cv) - 1);
+    if (!ReadFileAt(hFile, dbg.PointerToRawData, cv, size) || 0 != memcmp(cv, "RSDS", 4)) {
+      return false;
+    }
+    path = cv + 24;
+    return !path.empty();
+  }
+  return false;
+}
+
+void PrefetchFile(const std::string &path, std::vector<char> &buff)
+{
+  HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (INVALID_HANDLE_VALUE == hFile) {
+    return;
+  }
+  DWORD read = 0;
+  while (!g_prefetchStop && ReadFile(hFile, &buff[0], (DWORD)buff.size(), &read, NULL) && 0 < read) {
+  }
+  CloseHandle(hFile);
+}
+
+static DWORD WINAPI PrefetchWorker(LPVOID)
+{
+  std::vector<char> buff(PREFETCH_READ_SIZE);
+  while (WAIT_OBJECT_0 == WaitForSingleObject(g_prefetchSem, INFINITE) && !g_prefetchStop) {
+    HANDLE hFile = NULL;
+    EnterCriticalSection(&g_prefetchLock);
+    if (!g_prefetchQueue.empty()) {
+      hFile = g_prefetchQueue.back();
+      g_prefetchQueue.pop_back();
+    }
+    LeaveCriticalSection(&g_prefetchLock);
+    if (!hFile) {
+      continue;
+    }
+    std::string path;
+    if (GetModulePdbPath(hFile, path)) {
+      PrefetchFile(path, buff);
+    }
+    CloseHandle(hFile);
+  }
+  return 0;
+}
+
+void PrefetchModuleSymbols(HANDLE hFile)
+{
+  HANDLE hDup = NULL;
+  if (!hFile || !DuplicateHandle(GetCurrentProcess(), hFile, GetCurrentProcess(), &hDup, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+    return;
+  }
+
+  if (0 == g_nPrefetchThreads) {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int nThreads = (std::max)(1, (std::min)((int)si.dwNumberOfProcessors, PREFETCH_MAX_THREADS));
+    InitializeCriticalSection(&g_prefetchLock);
+    g_prefetchSem = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+    g_prefetchStop = false;
+    for (int i = 0; i < nThreads; i++) {
+      HANDLE h = CreateThread(NULL, 0, PrefetchWorker, NULL, 0, NULL);
+      if (h) {
+        g_prefetchThreads[g_nPrefetchThreads++] = h;
+      }
+    }
+    if (0 == g_nPrefetchThreads) {
+      CloseHandle(g_prefetchSem);
+      DeleteCriticalSection(&g_prefetchLock);
+      CloseHandle(hDup);
+      return;
+    }
+  }
+
+  EnterCriticalSection(&g_prefetchLock);
+  g_prefetchQueue.push_back(hDup);
+  LeaveCriticalSection(&g_prefetchLock);
+  ReleaseSemaphore(g_prefetchSem, 1, NULL);
+}
+
+void StopSymbolPrefetch()
+{
+  if (0 == g_nPrefetchThreads) {
+    return;
+  }
+  g_prefetchStop = true;
+  ReleaseSemaphore(g_prefetchSem, g_nPrefetchThreads, NULL);
+  WaitForMultipleObjects(g_nPrefetchThreads, g_prefetchThreads, TRUE, INFINITE);
+  for (int i = 0; i < g_nPrefetchThreads; i++) {
+    CloseHandle(g_prefetchThreads[i]);
+  }
+  g_nPrefetchThreads = 0;
+  for (size_t i = 0; i < g_prefetchQueue.size(); i++) {
+    CloseHandle(g_prefetchQueue[i]);
+  }
+  g_prefetchQueue.clear();
+  CloseHandle(g_prefetchSem);
+  DeleteCriticalSection(&g_prefetchLock);
+}
+
+//
+// Startup benchmark: launch target runs times, each until the first break,
+// then kill it.
+//
+
+int BenchStartup(const char *exe, int runs)
+{
+  //
+  // Each run ends through HandleProcessExited, which saves the session.
+  // Benchmark runs leave the user's session file alone.
+  //
+
+  g_sessionFileName.clear();
+  std::vector<double> times;
+  for (int i = 0; i < runs; i++) {
+    g_dbgState = DBGS_NONE;
+    BeginStartupTiming(false);
+    if (!LaunchDbgee(exe)) {
+      return -1;
+    }
+    while (DBGS_BREAK != g_dbgState && DBGS_EXIT_PROCESS != g_dbgState) {
+      DebugEventLoop();
+    }
+    EndStartupTiming();
+    if (DBGS_BREAK != g_dbgState) {
+      printf("run %d: exited before first break\n", i + 1);
+      return -1;
+    }
+    times.push_back(TicksToMs(g_startupPhases[g_nStartupPhases - 1].ticks));
+    printf("run %d: first break %.2f ms, %d modules, %.2f ms module loads\n", i + 1, times.back(), g_nModuleLoads, TicksToMs(g_moduleLoadTicks));
+
+    TerminateProcess(g_piDbgee.hProcess, 0);
+    ClearBreakPoints();
+    ContinueDbgeeEvent(DBG_CONTINUE);
+    DebugEventLoop();                   // Drain to exit process.
+  }
+
+  std::sort(times.begin(), times.end());
+  printf("%s: %d runs, first break min %.2f ms, median %.2f ms, max %.2f ms\n", exe, runs, times.front(), times[times.size() / 2], times.back());
+  return 0;
+}
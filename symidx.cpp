@@ -0,0 +1,416 @@
+#include "mydbg.h"
+#include "mydbghelp.h"
+
+#include <algorithm>
+
+extern PROCESS_INFORMATION g_piDbgee;
+
+//
+// Per module function name index, sorted by name, and a second order by
+// case folded name for x's prefix lookups. Built on first use, and
+// lookups leave out modules whose symbols are still deferred, so they keep
+// their deferred load. Next to each entry is a mask of the characters in
+// its name, so substring and fuzzy lookups skip most names with one AND
+// before touching the string.
+//
+
+struct SYM_MODULE_INDEX
+{
+  bool built;
+  std::vector<char> names;              // NUL terminated names.
+  std::vector<SYM_INDEX_ENTRY> entries; // Sorted by name.
+  std::vector<DWORD> folded;            // Entry indices, sorted by case folded name.
+  std::vector<DWORD64> masks;           // Per entry, see SymCharMask.
+};
+
+struct SYM_RANKED
+{
+  int rank;                             // SYM_RANK_*, lower is better.
+  int score;                            // Fuzzy score, higher is better.
+  const char *name;
+  size_t length;
+  DWORD64 address;
+  bool operator<(const SYM_RANKED &b) const
+  {
+    if (rank != b.rank) {
+      return rank < b.rank;
+    }
+    if (score != b.score) {
+      return score > b.score;
+    }
+    return length != b.length ? length < b.length : strcmp(name, b.name) < 0;
+  }
+};
+
+enum {
+  SYM_RANK_EXACT = 0,
+  SYM_RANK_PREFIX,
+  SYM_RANK_SUBSTRING,
+  SYM_RANK_FUZZY
+};
+
+std::map<DWORD64, SYM_MODULE_INDEX> g_symIndex; // <Module base, Index>
+
+struct LessSymName
+{
+  const char *names;
+  bool operator()(const SYM_INDEX_ENTRY &a, const SYM_INDEX_ENTRY &b) const
+  {
+    return strcmp(names + a.name, names + b.name) < 0;
+  }
+  bool operator()(const SYM_INDEX_ENTRY &a, const char *b) const
+  {
+    return strcmp(names + a.name, b) < 0;
+  }
+  bool operator()(const char *a, const SYM_INDEX_ENTRY &b) const
+  {
+    return strcmp(a, names + b.name) < 0; // Debug lower_bound checks the order both ways.
+  }
+};
+
+struct LessFoldedName
+{
+  const char *names;
+  const SYM_INDEX_ENTRY *entries;
+  bool operator()(DWORD a, DWORD b) const
+  {
+    return _stricmp(names + entries[a].name, names + entries[b].name) < 0;
+  }
+  bool operator()(DWORD a, const char *b) const
+  {
+    return _stricmp(names + entries[a].name, b) < 0;
+  }
+  bool operator()(const char *a, DWORD b) const
+  {
+    return _stricmp(a, names + entries[b].name) < 0;
+  }
+};
+
+static BOOL CALLBACK StaticEnumIndexSymbols(PSYMBOL_INFO pSymInfo, ULONG, PVOID UserContext)
+{
+  if (SymTagFunction != pSymInfo->Tag) {
+    return TRUE;
+  }
+  SYM_MODULE_INDEX &idx = *(SYM_MODULE_INDEX*)UserContext;
+  SYM_INDEX_ENTRY e;
+  e.name = (DWORD)idx.names.size();
+  e.address = pSymInfo->Address;
+  idx.names.insert(idx.names.end(), pSymInfo->Name, pSymInfo->Name + pSymInfo->NameLen);
+  idx.names.push_back('\0');
+  idx.entries.push_back(e);
+  return TRUE;
+}
+
+void AddIndexModule(DWORD64 base)
+{
+  SYM_MODULE_INDEX &idx = g_symIndex[base];
+  idx.built = false;
+  idx.names.clear();
+  idx.entries.clear();
+  idx.folded.clear();
+  idx.masks.clear();
+}
+
+void RemoveIndexModule(DWORD64 base)
+{
+  g_symIndex.erase(base);
+}
+
+void ClearSymbolIndex()
+{
+  g_symIndex.clear();
+}
+
+void GetIndexModules(std::vector<DWORD64> &bases)
+{
+  bases.clear();
+  for (std::map<DWORD64, SYM_MODULE_INDEX>::const_iterator it = g_symIndex.begin(); g_symIndex.end() != it; ++it) {
+    bases.push_back(it->first);
+  }
+}
+
+static DWORD64 SymCharMask(const char *s)
+{
+  //
+  // Bit per letter (case folded), digit and '_', bit 63 for anything else.
+  //
+
+  DWORD64 mask = 0;
+  for (; *s; s++) {
+    int c = tolower((unsigned char)*s);
+    if ('a' <= c && 'z' >= c) {
+      mask |= 1ull << (c - 'a');
+    } else if ('0' <= c && '9' >= c) {
+      mask |= 1ull << (26 + c - '0');
+    } else if ('_' == c) {
+      mask |= 1ull << 36;
+    } else {
+      mask |= 1ull << 63;
+    }
+  }
+  return mask;
+}
+
+SYM_MODULE_INDEX* GetModuleSymbolIndex(DWORD64 base)
+{
+  std::map<DWORD64, SYM_MODULE_INDEX>::iterator it = g_symIndex.find(base);
+  if (g_symIndex.end() == it) {
+    return NULL;
+  }
+  SYM_MODULE_INDEX &idx = it->second;
+  if (!idx.built) {
+    idx.built = true;
+    SymEnumSymbols(g_piDbgee.hProcess, base, "*", StaticEnumIndexSymbols, &idx);
+    LessSymName less = {idx.names.empty() ? "" : &idx.names[0]};
+    std::sort(idx.entries.begin(), idx.entries.end(), less);
+    idx.masks.resize(idx.entries.size());
+    idx.folded.resize(idx.entries.size());
+    for (size_t i = 0; i < idx.entries.size(); i++) {
+      idx.masks[i] = SymCharMask(&idx.names[idx.entries[i].name]);
+      idx.folded[i] = (DWORD)i;
+    }
+    if (!idx.entries.empty()) {
+      LessFoldedName folded = {&idx.names[0], &idx.entries[0]};
+      std::sort(idx.folded.begin(), idx.folded.end(), folded);
+    }
+  }
+  return &idx;
+}
+
+bool MatchWildcard(const char *pat, const char *str, bool noCase)
+{
+  //
+  // '*' any run, '?' any one char. Greedy with backtrack to the last '*'.
+  // noCase for file names.
+  //
+
+  const char *star = NULL, *resume = NULL;
+  while (*str) {
+    if ('?' == *pat || *pat == *str || (noCase && tolower((unsigned char)*pat) == tolower((unsigned char)*str))) {
+      pat++;
+      str++;
+    } else if ('*' == *pat) {
+      star = pat++;
+      resume = str;
+    } else if (star) {
+      pat = star + 1;
+      str = ++resume;
+    } else {
+      return false;
+    }
+  }
+  while ('*' == *pat) {
+    pat++;
+  }
+  return '\0' == *pat;
+}
+
+void FindIndexSymbols(DWORD64 base, const std::string &pattern, std::vector<SYM_INDEX_ENTRY> &matches)
+{
+  SYM_MODULE_INDEX *idx = GetModuleSymbolIndex(base);
+  if (!idx || idx->entries.empty()) {
+    return;
+  }
+
+  //
+  // The literal prefix before the first wildcard bounds the sorted range.
+  //
+
+  std::string prefix(pattern, 0, pattern.find_first_of("*?"));
+  LessSymName less = {&idx->names[0]};
+  std::vector<SYM_INDEX_ENTRY>::const_iterator it = std::lower_bound(idx->entries.begin(), idx->entries.end(), prefix.c_str(), less);
+  for (; idx->entries.end() != it; ++it) {
+    const char *name = &idx->names[it->name];
+    if (0 != strncmp(name, prefix.c_str(), prefix.size())) {
+      break;
+    }
+    if (MatchWildcard(pattern.c_str(), name, false)) {
+      matches.push_back(*it);
+    }
+  }
+}
+
+static int FuzzyScore(const char *pat, const char *str)
+{
+  //
+  // Pattern chars must appear in order, case folded. Runs of consecutive
+  // chars and chars at word starts (after '_' or ':', or a lower to upper
+  // case step) score more. -1 if no match.
+  //
+
+  int score = 0, run = 0;
+  const char *begin = str;
+  for (; *pat; pat++) {
+    int c = tolower((unsigned char)*pat);
+    while (*str && tolower((unsigned char)*str) != c) {
+      str++;
+      run = 0;
+    }
+    if (!*str) {
+      return -1;
+    }
+    bool start = begin == str || '_' == str[-1] || ':' == str[-1] || (islower((unsigned char)str[-1]) && isupper((unsigned char)*str));
+    score += 1 + 2 * run + (start ? 3 : 0);
+    run++;
+    str++;
+  }
+  return score;
+}
+
+static const char* FindNoCase(const char *str, const char *sub, size_t n)
+{
+  for (; *str; str++) {
+    if (0 == _strnicmp(str, sub, n)) {
+      return str;
+    }
+  }
+  return NULL;
+}
+
+bool IsModuleSymbolsLoaded(DWORD64 base)
+{
+  IMAGEHLP_MODULE64 mi = {0};
+  mi.SizeOfStruct = sizeof(mi);
+  return TRACE_CALL("SymGetModuleInfo64", SymGetModuleInfo64(g_piDbgee.hProcess, base, &mi)) &&
+         SymDeferred != mi.SymType && SymNone != mi.SymType;
+}
+
+void LookupSymbols(const std::string &query, size_t max, std::vector<std::string> &names, std::vector<DWORD64> &addresses)
+{
+  names.clear();
+  addresses.clear();
+  if (query.empty()) {
+    return;
+  }
+  std::vector<SYM_MODULE_INDEX*> indexes;
+  for (std::map<DWORD64, SYM_MODULE_INDEX>::iterator it = g_symIndex.begin(); g_symIndex.end() != it; ++it) {
+    if (!it->second.built && !IsModuleSymbolsLoaded(it->first)) {
+      continue;                         // Deferred, don't force the load.
+    }
+    SYM_MODULE_INDEX *idx = GetModuleSymbolIndex(it->first);
+    if (!idx->entries.empty()) {
+      indexes.push_back(idx);
+    }
+  }
+
+  //
+  // Exact and prefix matches by binary search in the case folded order.
+  // Only if they don't fill max are all names scanned for substring and
+  // fuzzy matches.
+  //
+
+  const char *q = query.c_str();
+  size_t n = query.size();
+  std::vector<SYM_RANKED> ranked;
+  for (size_t m = 0; m < indexes.size(); m++) {
+    const SYM_MODULE_INDEX *idx = indexes[m];
+    LessFoldedName less = {&idx->names[0], &idx->entries[0]};
+    std::vector<DWORD>::const_iterator it = std::lower_bound(idx->folded.begin(), idx->folded.end(), q, less);
+    for (; idx->folded.end() != it; ++it) {
+      const SYM_INDEX_ENTRY &e = idx->entries[*it];
+      SYM_RANKED r;
+      r.name = &idx->names[e.name];
+      if (0 != _strnicmp(r.name, q, n)) {
+        break;
+      }
+      r.length = strlen(r.name);
+      r.address = e.address;
+      r.score = 0;
+      r.rank = n == r.length ? SYM_RANK_EXACT : SYM_RANK_PREFIX;
+      ranked.push_back(r);
+    }
+  }
+
+  if (ranked.size() < max) {
+    DWORD64 want = SymCharMask(q);
+    for (size_t m = 0; m < indexes.size(); m++) {
+      const SYM_MODULE_INDEX *idx = indexes[m];
+      for (size_t i = 0; i < idx->entries.size(); i++) {
+        if (want != (idx->masks[i] & want)) {
+          continue;
+        }
+        SYM_RANKED r;
+        r.name = &idx->names[idx->entries[i].name];
+        r.address = idx->entries[i].address;
+        r.score = 0;
+        if (0 == _strnicmp(r.name, q, n)) {
+          continue;                     // Found by the binary search.
+        } else if (FindNoCase(r.name, q, n)) {
+          r.rank = SYM_RANK_SUBSTRING;
+        } else if (0 <= (r.score = FuzzyScore(q, r.name))) {
+          r.rank = SYM_RANK_FUZZY;
+        } else {
+          continue;
+        }
+        r.length = strlen(r.name);
+        ranked.push_back(r);
+      }
+    }
+  }
+
+  size_t nShown = (std::min)(max, ranked.size());
+  std::partial_sort(ranked.begin(), ranked.begin() + nShown, ranked.end());
+  for (size_t i = 0; i < nShown; i++) {
+    names.push_back(ranked[i].name);
+    addresses.push_back(ranked[i].address);
+  }
+}
+
+void CompleteSymbol(const std::string &prefix, size_t max, std::vector<std::string> &names)
+{
+  //
+  // Case sensitive prefix, a binary search per module. Runs on Tab, so
+  // modules whose symbols are still deferred are left out rather than
+  // loaded, only those loaded already get an index built.
+  //
+
+  names.clear();
+  for (std::map<DWORD64, SYM_MODULE_INDEX>::iterator it = g_symIndex.begin(); g_symIndex.end() != it; ++it) {
+    if (!it->second.built && !IsModuleSymbolsLoaded(it->first)) {
+      continue;
+    }
+    SYM_MODULE_INDEX *idx = GetModuleSymbolIndex(it->first);
+    if (idx->entries.empty()) {
+      continue;
+    }
+    LessSymName less = {&idx->names[0]};
+    std::vector<SYM_INDEX_ENTRY>::const_iterator e = std::lower_bound(idx->entries.begin(), idx->entries.end(), prefix.c_str(), less);
+    for (; idx->entries.end() != e && names.size() < max; ++e) {
+      const char *name = &idx->names[e->name];
+      if (0 != strncmp(name, prefix.c_str(), prefix.size())) {
+        break;
+      }
+      names.push_back(name);
+    }
+  }
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+}
+
+void ShowSymbols(const std::string &query)
+{
+  LONGLONG t = StartupTicks();
+  std::vector<std::string> names;
+  std::vector<DWORD64> addresses;
+  LookupSymbols(query, 20, names, addresses);
+  t = StartupTicks() - t;
+  for (size_t i = 0; i < names.size(); i++) {
+    printf("0x%08x %s\n", (unsigned int)addresses[i], names[i].c_str());
+  }
+  printf("%u shown, %.3f ms\n", (unsigned int)names.size(), TicksToMs(t));
+}
+
+void SuggestSymbols(const std::string &name)
+{
+  std::vector<std::string> names;
+  std::vector<DWORD64> addresses;
+  LookupSymbols(name, 5, names, addresses);
+  if (names.empty()) {
+    printf("%s not found\n", name.c_str());
+    return;
+  }
+  printf("%s not found, did you mean:\n", name.c_str());
+  for (size_t i = 0; i < names.size(); i++) {
+    printf("  %s\n", names[i].c_str());
+  }
+}
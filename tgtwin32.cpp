@@ -0,0 +1,95 @@
+#include "mydbg.h"
+
+extern PROCESS_INFORMATION g_piDbgee;
+
+//
+// Win32 debug API target, the live debuggee.
+//
+
+HANDLE GetDbgeeThreadHandle(DWORD tid)
+{
+  const DBG_THREAD *th = FindDbgeeThread(tid);
+  if (th && th->hThread) {
+    return th->hThread;
+  }
+  return tid == g_piDbgee.dwThreadId ? g_piDbgee.hThread : NULL;
+}
+
+BOOL Win32TargetReadMemory(DWORD64 addr, LPVOID buff, SIZE_T size)
+{
+  return ReadProcessMemory(g_piDbgee.hProcess, (LPCVOID)addr, buff, size, NULL);
+}
+
+BOOL Win32TargetWriteMemory(DWORD64 addr, LPCVOID buff, SIZE_T size)
+{
+  return WriteProcessMemory(g_piDbgee.hProcess, (LPVOID)addr, buff, size, NULL);
+}
+
+void Win32TargetQueryRegions(std::vector<MEM_REGION> &regions, bool WritableOnly)
+{
+  regions.clear();
+  DWORD64 addr = 0;
+  MEMORY_BASIC_INFORMATION mbi;
+  while (VirtualQueryEx(g_piDbgee.hProcess, (LPCVOID)addr, &mbi, sizeof(mbi))) {
+    DWORD64 next = (DWORD64)mbi.BaseAddress + mbi.RegionSize;
+    if (next <= addr) {
+      break;
+    }
+    addr = next;
+    if (MEM_COMMIT != mbi.State || (mbi.Protect & (PAGE_NOACCESS | PAGE_GUARD))) {
+      continue;
+    }
+    if (WritableOnly && !(mbi.Protect & (PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY))) {
+      continue;
+    }
+    MEM_REGION r;
+    r.address = (DWORD64)mbi.BaseAddress;
+    r.size = mbi.RegionSize;
+    r.protect = mbi.Protect;
+    regions.push_back(r);
+  }
+}
+
+BOOL Win32TargetGetContext(DWORD tid, CONTEXT &ctx)
+{
+  return GetThreadContext(GetDbgeeThreadHandle(tid), &ctx);
+}
+
+BOOL Win32TargetSetContext(DWORD tid, const CONTEXT &ctx)
+{
+  return SetThreadContext(GetDbgeeThreadHandle(tid), &ctx);
+}
+
+BOOL Win32TargetWaitEvent(DEBUG_EVENT &ev, DWORD timeout)
+{
+  return WaitForDebugEvent(&ev, timeout);
+}
+
+BOOL Win32TargetContinueEvent(DWORD pid, DWORD tid, DWORD ContinueStatus)
+{
+  return ContinueDebugEvent(pid, tid, ContinueStatus);
+}
+
+DWORD64 Win32TargetLoadModule(HANDLE hFile, DWORD64 base)
+{
+  PrefetchModuleSymbols(hFile);
+  return SymLoadModule64(g_piDbgee.hProcess, hFile, NULL, NULL, base, 0);
+}
+
+DWORD64 Win32TargetAllocCode(SIZE_T size)
+{
+  return (DWORD64)VirtualAllocEx(g_piDbgee.hProcess, NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+}
+
+DEBUG_TARGET g_win32Target = {
+  "win32",
+  Win32TargetReadMemory,
+  Win32TargetWriteMemory,
+  Win32TargetQueryRegions,
+  Win32TargetGetContext,
+  Win32TargetSetContext,
+  Win32TargetWaitEvent,
+  Win32TargetContinueEvent,
+  Win32TargetLoadModule,
+  Win32TargetAllocCode
+};
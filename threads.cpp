@@ -0,0 +1,232 @@
+#include "mydbg.h"
+#include "mydbghelp.h"
+
+#include <algorithm>
+
+extern PROCESS_INFORMATION g_piDbgee;
+extern DEBUG_TARGET *g_target;
+
+#define CONTEXT_MAX_THREADS 16
+
+//
+// Debuggee threads by id, added and removed by the thread events. The
+// current thread is the one of the last debug event, or the one picked
+// with the thread command, and all context access goes to it. Its entry
+// is cached, so the per event lookups don't search the table.
+//
+
+std::map<DWORD, DBG_THREAD> g_threads;  // <Thread id, Thread>
+DWORD g_currTid;
+DBG_THREAD *g_currThread;               // Entry of g_currTid, NULL if none.
+
+void AddDbgeeThread(DWORD tid, HANDLE hThread, DWORD64 startAddress)
+{
+  DBG_THREAD &th = g_threads[tid];
+  th.tid = tid;
+  th.hThread = hThread;
+  th.startAddress = startAddress;
+  th.tmpBpAddr = 0;
+  th.stepOutFrame = 0;
+  th.lastBreakLine = 0;
+  th.held = false;
+  th.frozen = false;
+  th.scratch = 0;
+  th.stepOffAddr = 0;
+  th.stepOffTf = false;
+  th.lineBegin = th.lineEnd = 0;
+  th.lineEndBp = false;
+  if (tid == g_currTid) {
+    g_currThread = &th;
+  }
+}
+
+void RemoveDbgeeThread(DWORD tid)
+{
+  //
+  // The handle from the create event is closed by the system when the
+  // exit event is continued.
+  //
+
+  if (tid == g_currTid) {
+    g_currThread = NULL;
+  }
+  std::map<DWORD, DBG_THREAD>::iterator it = g_threads.find(tid);
+  if (g_threads.end() != it) {
+    ReleaseScratchSlot(&it->second);    // A thread starting later gets it.
+    g_threads.erase(it);
+  }
+}
+
+void ClearDbgeeThreads()
+{
+  g_threads.clear();
+  g_currThread = NULL;
+  g_currTid = 0;
+}
+
+DBG_THREAD* FindDbgeeThread(DWORD tid)
+{
+  if (tid == g_currTid && g_currThread) {
+    return g_currThread;
+  }
+  std::map<DWORD, DBG_THREAD>::iterator it = g_threads.find(tid);
+  return g_threads.end() != it ? &it->second : NULL;
+}
+
+void SetCurrThread(DWORD tid)
+{
+  if (tid != g_currTid || !g_currThread) {
+    g_currTid = tid;
+    std::map<DWORD, DBG_THREAD>::iterator it = g_threads.find(tid);
+    g_currThread = g_threads.end() != it ? &it->second : NULL;
+  }
+}
+
+DWORD GetCurrThreadId()
+{
+  return g_currTid ? g_currTid : g_piDbgee.dwThreadId;
+}
+
+DBG_THREAD* GetCurrThread()
+{
+  //
+  // Never NULL, a thread we got no create event for gets an entry.
+  //
+
+  if (!g_currThread) {
+    DWORD tid = GetCurrThreadId();
+    if (!g_threads.count(tid)) {
+      AddDbgeeThread(tid, NULL, 0);
+    }
+    SetCurrThread(tid);
+  }
+  return g_currThread;
+}
+
+HANDLE GetCurrThreadHandle()
+{
+  DBG_THREAD *th = GetCurrThread();
+  return th && th->hThread ? th->hThread : g_piDbgee.hThread;
+}
+
+bool SelectThread(DWORD tid)
+{
+  if (!g_threads.count(tid)) {
+    printf("no thread %u\n", tid);
+    return false;
+  }
+  SetCurrThread(tid);
+  std::string fn;
+  int LineNumber = 0;
+  DWORD displacement = 0;
+  if (GetSourceLineByAddr(GetCurrIp(), fn, LineNumber, displacement)) {
+    printf("thread %u at %s:%d\n", tid, fn.c_str(), LineNumber);
+    DisplaySourceLines(fn, LineNumber);
+  } else {
+    printf("thread %u at 0x%08x\n", tid, (unsigned int)GetCurrIp());
+  }
+  return true;
+}
+
+//
+// Contexts of all threads, fetched by a few workers at once. Only target
+// calls on the workers, no dbghelp and no recording.
+//
+
+struct CONTEXT_JOB
+{
+  std::vector<DWORD> tids;
+  std::vector<CONTEXT> ctxs;
+  std::vector<BOOL> ok;
+  volatile LONG next;
+};
+
+static DWORD WINAPI ContextWorker(LPVOID param)
+{
+  CONTEXT_JOB &job = *(CONTEXT_JOB*)param;
+  LONG i;
+  while ((i = InterlockedIncrement(&job.next) - 1) < (LONG)job.tids.size()) {
+    job.ctxs[i].ContextFlags = CONTEXT_FULL;
+    job.ok[i] = g_target->GetContext(job.tids[i], job.ctxs[i]);
+  }
+  return 0;
+}
+
+void GetAllThreadContexts(std::vector<DWORD> &tids, std::vector<CONTEXT> &ctxs)
+{
+  CONTEXT_JOB job;
+  for (std::map<DWORD, DBG_THREAD>::const_iterator it = g_threads.begin(); g_threads.end() != it; ++it) {
+    job.tids.push_back(it->first);
+  }
+  if (job.tids.empty()) {
+    job.tids.push_back(GetCurrThreadId());
+  }
+  job.ctxs.resize(job.tids.size());
+  job.ok.assign(job.tids.size(), FALSE);
+  job.next = 0;
+
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  int nThreads = (std::max)(1, (std::min)((int)si.dwNumberOfProcessors, CONTEXT_MAX_THREADS));
+  nThreads = (std::min)(nThreads, (int)(job.tids.size() + 7) / 8); // Not worth a thread for a few.
+  HANDLE threads[CONTEXT_MAX_THREADS];
+  int nCreated = 0;
+  for (int i = 1; i < nThreads; i++) {
+    threads[nCreated] = CreateThread(NULL, 0, ContextWorker, &job, 0, NULL);
+    if (threads[nCreated]) {
+      nCreated++;
+    }
+  }
+  ContextWorker(&job);
+  if (nCreated) {
+    WaitForMultipleObjects(nCreated, threads, TRUE, INFINITE);
+  }
+  for (int i = 0; i < nCreated; i++) {
+    CloseHandle(threads[i]);
+  }
+
+  tids.clear();
+  ctxs.clear();
+  for (size_t i = 0; i < job.tids.size(); i++) {
+    if (job.ok[i]) {
+      tids.push_back(job.tids[i]);
+      ctxs.push_back(job.ctxs[i]);
+      if (IsRecording()) {
+        RecordContext(job.tids[i], job.ctxs[i]);
+      }
+    }
+  }
+}
+
+void DumpAllCallStacks()
+{
+  std::vector<DWORD> tids;
+  std::vector<CONTEXT> ctxs;
+  GetAllThreadContexts(tids, ctxs);
+  for (size_t i = 0; i < tids.size(); i++) {
+    printf("%c thread %u\n", tids[i] == GetCurrThreadId() ? '*' : ' ', tids[i]);
+    DumpCallStack(ctxs[i]);
+  }
+}
+
+void ShowThreads()
+{
+  std::vector<DWORD> tids;
+  std::vector<CONTEXT> ctxs;
+  GetAllThreadContexts(tids, ctxs);
+  for (size_t i = 0; i < tids.size(); i++) {
+    const DBG_THREAD *th = FindDbgeeThread(tids[i]);
+    char buff[sizeof(SYMBOL_INFO) + 256] = {0};
+    SYMBOL_INFO *psi = (SYMBOL_INFO*)buff;
+    psi->SizeOfStruct = sizeof(SYMBOL_INFO);
+    psi->MaxNameLen = 256;
+    DWORD64 displacement = 0;
+    const char *func = TRACE_CALL("SymFromAddr", SymFromAddr(g_piDbgee.hProcess, ctxs[i].Eip, &displacement, psi)) ? psi->Name : "?";
+    printf("%c %6u eip 0x%08x esp 0x%08x start 0x%08x %s%s\n", tids[i] == GetCurrThreadId() ? '*' : ' ', tids[i],
+           ctxs[i].Eip, ctxs[i].Esp, th ? (unsigned int)th->startAddress : 0, func, th && th->held ? " (held)" : "");
+  }
+  if (IsNonStop() && GetHeldThreadCount()) {
+    printf("stop queue:\n");
+    ShowHeldThreads();
+  }
+}
@@ -0,0 +1,143 @@
+#include "mydbg.h"
+
+#define TRACE_MAX_EVENTS (1024 * 1024)  // Per thread, later calls are dropped.
+
+//
+// Timeline of the debugger's own calls into dbghelp and the target, for
+// -trace file. Each thread appends completed spans to its own buffer, no
+// lock after the first call on a thread. Spans carry the last user
+// command, so the cost of one p or c can be picked out. Written as Chrome
+// trace event JSON (chrome://tracing, Perfetto) at exit.
+//
+
+struct TRACE_EVENT
+{
+  const char *name;
+  LONGLONG begin;
+  LONGLONG end;
+  DWORD size;
+  int cmd;                              // Index into g_traceCmds.
+};
+
+struct TRACE_BUFFER
+{
+  DWORD tid;
+  DWORD nDropped;
+  std::vector<TRACE_EVENT> events;
+};
+
+bool g_traceOn;
+std::string g_traceFileName;
+LONGLONG g_traceStart, g_traceFreq = 1;
+std::vector<std::string> g_traceCmds;   // Commands seen, main thread only.
+volatile int g_traceCmd = -1;
+CRITICAL_SECTION g_traceLock;           // Guards g_traceBuffers.
+std::vector<TRACE_BUFFER*> g_traceBuffers;
+__declspec(thread) TRACE_BUFFER *t_traceBuffer;
+
+bool StartTrace(const char *fn)
+{
+  g_traceFileName = fn;
+  LARGE_INTEGER t;
+  QueryPerformanceFrequency(&t);
+  g_traceFreq = t.QuadPart;
+  g_traceStart = StartupTicks();
+  InitializeCriticalSection(&g_traceLock);
+  g_traceOn = true;
+  return true;
+}
+
+void SetTraceCommand(const std::string &cmd)
+{
+  if (g_traceOn) {
+    g_traceCmds.push_back(cmd);
+    g_traceCmd = (int)g_traceCmds.size() - 1;
+  }
+}
+
+TRACE_SPAN::TRACE_SPAN(const char *name, DWORD size)
+  : name(name), size(size), begin(g_traceOn ? StartupTicks() : 0)
+{
+}
+
+TRACE_SPAN::~TRACE_SPAN()
+{
+  if (!g_traceOn || 0 == begin) {
+    return;
+  }
+  TRACE_BUFFER *buff = t_traceBuffer;
+  if (!buff) {
+    buff = new TRACE_BUFFER;
+    buff->tid = GetCurrentThreadId();
+    buff->nDropped = 0;
+    buff->events.reserve(4096);
+    EnterCriticalSection(&g_traceLock);
+    g_traceBuffers.push_back(buff);
+    LeaveCriticalSection(&g_traceLock);
+    t_traceBuffer = buff;
+  }
+  if (TRACE_MAX_EVENTS <= buff->events.size()) {
+    buff->nDropped++;
+    return;
+  }
+  TRACE_EVENT ev = {name, begin, StartupTicks(), size, g_traceCmd};
+  buff->events.push_back(ev);
+}
+
+static void WriteJsonString(FILE *fp, const std::string &s)
+{
+  fputc('"', fp);
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if ('"' == c || '\\' == c) {
+      fprintf(fp, "\\%c", c);
+    } else if (' ' > c) {
+      fprintf(fp, "\\u%04x", c);
+    } else {
+      fputc(c, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+void StopTrace()
+{
+  if (!g_traceOn) {
+    return;
+  }
+  g_traceOn = false;                    // Other threads are stopped by now.
+
+  FILE *fp = fopen(g_traceFileName.c_str(), "w");
+  if (!fp) {
+    printf("Open trace file %s failed\n", g_traceFileName.c_str());
+  }
+  size_t nEvents = 0;
+  DWORD nDropped = 0;
+  if (fp) {
+    fprintf(fp, "{\"traceEvents\":[\n");
+  }
+  bool first = true;
+  for (size_t i = 0; i < g_traceBuffers.size(); i++) {
+    const TRACE_BUFFER *buff = g_traceBuffers[i];
+    for (size_t j = 0; fp && j < buff->events.size(); j++) {
+      const TRACE_EVENT &ev = buff->events[j];
+      fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"size\":%u,\"cmd\":",
+              first ? "" : ",\n", ev.name, buff->tid, (ev.begin - g_traceStart) * 1000000.0 / g_traceFreq,
+              (ev.end - ev.begin) * 1000000.0 / g_traceFreq, ev.size);
+      WriteJsonString(fp, 0 <= ev.cmd ? g_traceCmds[ev.cmd] : std::string());
+      fprintf(fp, "}}");
+      first = false;
+    }
+    nEvents += buff->events.size();
+    nDropped += buff->nDropped;
+    delete buff;
+  }
+  if (fp) {
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    printf("Trace: %u calls written to %s, %u dropped\n", (unsigned int)nEvents, g_traceFileName.c_str(), nDropped);
+  }
+  g_traceBuffers.clear();
+  g_traceCmds.clear();
+  DeleteCriticalSection(&g_traceLock);
+}
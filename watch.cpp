@@ -0,0 +1,412 @@
+#include "mydbg.h"
+#include "mydbghelp.h"
+
+#include <algorithm>
+
+extern PROCESS_INFORMATION g_piDbgee;
+
+#define WATCH_MAX_SIZE 64               // Bytes shown of a watched value.
+#define WATCH_MERGE_GAP 256             // Reads closer than this share one read.
+#define WATCH_MAX_SPAN (64 * 1024)
+
+//
+// Watch expression: [*...]name{.member|->member|[index]}
+// Compiled once into an access plan: a root (absolute, or EBP relative for
+// locals), then an offset chain. chain[0] is added to the root, each later
+// offset is added after reading a pointer at the address so far.
+//
+
+struct WATCH
+{
+  std::string expr;
+  std::string error;                    // Compile error, empty if compiled.
+  bool regRel;
+  DWORD64 root;                         // Address, or EBP offset if regRel.
+  DWORD64 scope;                        // Function start for locals, 0 for globals.
+  DWORD64 modBase;
+  std::vector<LONG> chain;
+  ULONG typeId;
+  DWORD size;
+  std::string last;                     // Value shown at previous stop.
+};
+
+struct WATCH_READ
+{
+  DWORD64 address;
+  DWORD size;
+  unsigned char *out;
+  bool ok;
+};
+
+std::vector<WATCH> g_watches;
+
+static bool LessWatchRead(const WATCH_READ *a, const WATCH_READ *b)
+{
+  return a->address < b->address;
+}
+
+DWORD GetTypeInfoDword(DWORD64 modBase, ULONG typeId, IMAGEHLP_SYMBOL_TYPE_INFO info)
+{
+  DWORD value = 0;
+  SymGetTypeInfo(g_piDbgee.hProcess, modBase, typeId, info, &value);
+  return value;
+}
+
+ULONG ResolveTypedef(DWORD64 modBase, ULONG typeId)
+{
+  while (SymTagTypedef == GetTypeInfoDword(modBase, typeId, TI_GET_SYMTAG)) {
+    typeId = GetTypeInfoDword(modBase, typeId, TI_GET_TYPEID);
+  }
+  return typeId;
+}
+
+bool FindMember(DWORD64 modBase, ULONG typeId, const std::string &name, LONG &offset, ULONG &memberType)
+{
+  DWORD count = GetTypeInfoDword(modBase, typeId, TI_GET_CHILDRENCOUNT);
+  if (0 == count) {
+    return false;
+  }
+  std::vector<char> buff(sizeof(TI_FINDCHILDREN_PARAMS) + count * sizeof(ULONG));
+  TI_FINDCHILDREN_PARAMS *params = (TI_FINDCHILDREN_PARAMS*)&buff[0];
+  params->Count = count;
+  params->Start = 0;
+  if (!SymGetTypeInfo(g_piDbgee.hProcess, modBase, typeId, TI_FINDCHILDREN, params)) {
+    return false;
+  }
+
+  for (DWORD i = 0; i < count; i++) {
+    ULONG child = params->ChildId[i];
+    DWORD tag = GetTypeInfoDword(modBase, child, TI_GET_SYMTAG);
+    if (SymTagBaseClass == tag) {       // Look into base class at its offset.
+      LONG baseOffset = (LONG)GetTypeInfoDword(modBase, child, TI_GET_OFFSET);
+      if (FindMember(modBase, GetTypeInfoDword(modBase, child, TI_GET_TYPEID), name, offset, memberType)) {
+        offset += baseOffset;
+        return true;
+      }
+      continue;
+    }
+    if (SymTagData != tag) {
+      continue;
+    }
+    WCHAR *pName = NULL;
+    if (!SymGetTypeInfo(g_piDbgee.hProcess, modBase, child, TI_GET_SYMNAME, &pName)) {
+      continue;
+    }
+    char childName[256];
+    WideCharToMultiByte(CP_ACP, 0, pName, -1, childName, sizeof(childName), NULL, NULL);
+    LocalFree(pName);
+    if (name == childName) {
+      offset = (LONG)GetTypeInfoDword(modBase, child, TI_GET_OFFSET);
+      memberType = GetTypeInfoDword(modBase, child, TI_GET_TYPEID);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ParseWatchName(const std::string &expr, size_t &pos, std::string &name)
+{
+  size_t begin = pos;
+  while (pos < expr.size() && (isalnum((unsigned char)expr[pos]) || '_' == expr[pos] || ':' == expr[pos])) {
+    pos++;
+  }
+  name = expr.substr(begin, pos - begin);
+  return !name.empty();
+}
+
+bool CompileWatch(WATCH &w)
+{
+  const std::string &expr = w.expr;
+  size_t pos = 0;
+  int nDeref = 0;
+  while (pos < expr.size() && '*' == expr[pos]) {
+    nDeref++;
+    pos++;
+  }
+  std::string name;
+  if (!ParseWatchName(expr, pos, name)) {
+    w.error = "expected name";
+    return false;
+  }
+
+  //
+  // Root symbol, locals of current function first.
+  //
+
+  IMAGEHLP_STACK_FRAME sf = {0};
+  sf.InstructionOffset = GetCurrIp();
+  SymSetContext(g_piDbgee.hProcess, &sf, NULL);
+
+  char buff[sizeof(SYMBOL_INFO) + 256] = {0};
+  SYMBOL_INFO *psi = (SYMBOL_INFO*)buff;
+  psi->SizeOfStruct = sizeof(SYMBOL_INFO);
+  psi->MaxNameLen = 256;
+  if (!SymFromName(g_piDbgee.hProcess, (PSTR)name.c_str(), psi)) {
+    w.error = "unknown symbol " + name;
+    return false;
+  }
+  w.modBase = psi->ModBase;
+  w.regRel = 0 != (psi->Flags & SYMFLAG_REGREL);
+  w.root = psi->Address;
+  w.scope = 0;
+  if (w.regRel) {
+    char fbuff[sizeof(SYMBOL_INFO) + 256] = {0};
+    SYMBOL_INFO *pfi = (SYMBOL_INFO*)fbuff;
+    pfi->SizeOfStruct = sizeof(SYMBOL_INFO);
+    pfi->MaxNameLen = 256;
+    DWORD64 displacement = 0;
+    if (SymFromAddr(g_piDbgee.hProcess, GetCurrIp(), &displacement, pfi)) {
+      w.scope = pfi->Address;
+    }
+  }
+  w.chain.assign(1, 0);
+  ULONG type = ResolveTypedef(w.modBase, psi->TypeIndex);
+
+  //
+  // Postfix operators fold into the offset chain, prefix '*' applies last.
+  //
+
+  while (pos < expr.size()) {
+    DWORD tag = GetTypeInfoDword(w.modBase, type, TI_GET_SYMTAG);
+    if ('.' == expr[pos] || ('-' == expr[pos] && pos + 1 < expr.size() && '>' == expr[pos + 1])) {
+      if ('-' == expr[pos]) {
+        if (SymTagPointerType != tag) {
+          w.error = "-> on non pointer";
+          return false;
+        }
+        type = ResolveTypedef(w.modBase, GetTypeInfoDword(w.modBase, type, TI_GET_TYPEID));
+        w.chain.push_back(0);
+        pos += 2;
+      } else {
+        pos++;
+      }
+      std::string member;
+      LONG offset = 0;
+      ULONG memberType = 0;
+      if (!ParseWatchName(expr, pos, member) || !FindMember(w.modBase, type, member, offset, memberType)) {
+        w.error = "unknown member " + member;
+        return false;
+      }
+      w.chain.back() += offset;
+      type = ResolveTypedef(w.modBase, memberType);
+    } else if ('[' == expr[pos]) {
+      size_t end = expr.find(']', pos);
+      int index = 0;
+      if (std::string::npos == end || 1 != sscanf(expr.c_str() + pos + 1, "%d", &index)) {
+        w.error = "bad index";
+        return false;
+      }
+      pos = end + 1;
+      if (SymTagPointerType == tag) {
+        w.chain.push_back(0);
+      } else if (SymTagArrayType != tag) {
+        w.error = "[] on non array";
+        return false;
+      }
+      type = ResolveTypedef(w.modBase, GetTypeInfoDword(w.modBase, type, TI_GET_TYPEID));
+      ULONG64 length = 0;
+      SymGetTypeInfo(g_piDbgee.hProcess, w.modBase, type, TI_GET_LENGTH, &length);
+      w.chain.back() += index * (LONG)length;
+    } else {
+      w.error = "unexpected " + expr.substr(pos);
+      return false;
+    }
+  }
+
+  for (int i = 0; i < nDeref; i++) {
+    if (SymTagPointerType != GetTypeInfoDword(w.modBase, type, TI_GET_SYMTAG)) {
+      w.error = "* on non pointer";
+      return false;
+    }
+    type = ResolveTypedef(w.modBase, GetTypeInfoDword(w.modBase, type, TI_GET_TYPEID));
+    w.chain.push_back(0);
+  }
+
+  ULONG64 length = 0;
+  SymGetTypeInfo(g_piDbgee.hProcess, w.modBase, type, TI_GET_LENGTH, &length);
+  w.typeId = type;
+  w.size = (DWORD)(std::min)(length, (ULONG64)WATCH_MAX_SIZE);
+  w.error.clear();
+  return true;
+}
+
+void BatchReadDbgeeMemory(std::vector<WATCH_READ> &reads)
+{
+  //
+  // Sort by address and read nearby requests as one span.
+  //
+
+  std::vector<WATCH_READ*> sorted;
+  for (size_t i = 0; i < reads.size(); i++) {
+    sorted.push_back(&reads[i]);
+  }
+  std::sort(sorted.begin(), sorted.end(), LessWatchRead);
+
+  std::vector<unsigned char> span;
+  for (size_t i = 0; i < sorted.size();) {
+    DWORD64 begin = sorted[i]->address, end = begin + sorted[i]->size;
+    size_t j = i + 1;
+    while (j < sorted.size() && sorted[j]->address <= end + WATCH_MERGE_GAP && sorted[j]->address + sorted[j]->size - begin <= WATCH_MAX_SPAN) {
+      end = (std::max)(end, sorted[j]->address + sorted[j]->size);
+      j++;
+    }
+    span.resize((size_t)(end - begin));
+    bool ok = ReadDbgeeMemory(begin, &span[0], span.size());
+    for (size_t k = i; k < j; k++) {
+      WATCH_READ &r = *sorted[k];
+      r.ok = ok || ReadDbgeeMemory(r.address, r.out, r.size); // Span may cover a hole, retry alone.
+      if (ok) {
+        memcpy(r.out, &span[(size_t)(r.address - begin)], r.size);
+      }
+    }
+    i = j;
+  }
+}
+
+void EvaluateWatches(std::vector<std::string> &values)
+{
+  values.assign(g_watches.size(), std::string());
+  if (g_watches.empty()) {
+    return;
+  }
+
+  CONTEXT ctx;
+  ctx.ContextFlags = CONTEXT_CONTROL;
+  GetDbgeeContext(ctx);
+  char fbuff[sizeof(SYMBOL_INFO) + 256] = {0};
+  SYMBOL_INFO *pfi = (SYMBOL_INFO*)fbuff;
+  pfi->SizeOfStruct = sizeof(SYMBOL_INFO);
+  pfi->MaxNameLen = 256;
+  DWORD64 displacement = 0;
+  DWORD64 scope = SymFromAddr(g_piDbgee.hProcess, ctx.Eip, &displacement, pfi) ? pfi->Address : 0;
+
+  std::vector<DWORD64> addr(g_watches.size());
+  std::vector<bool> live(g_watches.size());
+  size_t maxLevel = 0;
+  for (size_t i = 0; i < g_watches.size(); i++) {
+    const WATCH &w = g_watches[i];
+    if (!w.error.empty()) {
+      values[i] = "<" + w.error + ">";
+    } else if (w.scope && w.scope != scope) {
+      values[i] = "<not in scope>";
+    } else {
+      live[i] = true;
+      addr[i] = (w.regRel ? ctx.Ebp : 0) + w.root + w.chain[0];
+      maxLevel = (std::max)(maxLevel, w.chain.size() - 1);
+    }
+  }
+
+  //
+  // One batched read per pointer level, then one for all values.
+  //
+
+  std::vector<DWORD> ptr(g_watches.size());
+  for (size_t level = 1; level <= maxLevel; level++) {
+    std::vector<WATCH_READ> reads;
+    std::vector<size_t> owner;
+    for (size_t i = 0; i < g_watches.size(); i++) {
+      if (live[i] && level < g_watches[i].chain.size()) {
+        WATCH_READ r = {addr[i], sizeof(DWORD), (unsigned char*)&ptr[i], false};
+        reads.push_back(r);
+        owner.push_back(i);
+      }
+    }
+    BatchReadDbgeeMemory(reads);
+    for (size_t k = 0; k < reads.size(); k++) {
+      size_t i = owner[k];
+      if (!reads[k].ok) {
+        live[i] = false;
+        values[i] = "<bad pointer>";
+      } else {
+        addr[i] = ptr[i] + g_watches[i].chain[level];
+      }
+    }
+  }
+
+  std::vector<WATCH_READ> reads;
+  std::vector<size_t> owner;
+  std::vector<unsigned char> data(g_watches.size() * WATCH_MAX_SIZE);
+  for (size_t i = 0; i < g_watches.size(); i++) {
+    if (live[i] && 0 < g_watches[i].size) {
+      WATCH_READ r = {addr[i], g_watches[i].size, &data[i * WATCH_MAX_SIZE], false};
+      reads.push_back(r);
+      owner.push_back(i);
+    }
+  }
+  BatchReadDbgeeMemory(reads);
+  for (size_t k = 0; k < reads.size(); k++) {
+    size_t i = owner[k];
+    const WATCH &w = g_watches[i];
+    if (!reads[k].ok) {
+      values[i] = "<unreadable>";
+      continue;
+    }
+    SYMBOL_INFO si = {0};
+    si.SizeOfStruct = sizeof(si);
+    si.ModBase = w.modBase;
+    STR_VIEW value = GetVariableValue(w.typeId, &si, (const char*)reads[k].out, w.size);
+    values[i].assign(value.p, value.n);
+  }
+}
+
+void PrintWatch(size_t i, const std::string &value)
+{
+  const WATCH &w = g_watches[i];
+  if (!w.error.empty()) {
+    printf("%2u %s %s\n", (unsigned int)i, w.expr.c_str(), value.c_str());
+    return;
+  }
+  SYMBOL_INFO si = {0};
+  si.SizeOfStruct = sizeof(si);
+  si.ModBase = w.modBase;
+  printf("%2u %s %s = %s\n", (unsigned int)i, GetVariableTypeName(w.typeId, &si).p, w.expr.c_str(), value.c_str());
+}
+
+bool AddWatch(const std::string &expr, bool quiet)
+{
+  WATCH w;
+  w.expr = expr;
+  if (!CompileWatch(w)) {
+    if (!quiet) {
+      printf("watch %s: %s\n", expr.c_str(), w.error.c_str());
+    }
+    return false;
+  }
+  g_watches.push_back(w);
+  ShowWatches(false);
+  return true;
+}
+
+void GetWatchExpressions(std::vector<std::string> &exprs)
+{
+  exprs.clear();
+  for (size_t i = 0; i < g_watches.size(); i++) {
+    exprs.push_back(g_watches[i].expr);
+  }
+}
+
+bool RemoveWatch(int i)
+{
+  if (0 > i) {
+    g_watches.clear();
+    return true;
+  }
+  if ((size_t)i >= g_watches.size()) {
+    printf("no watch %d\n", i);
+    return false;
+  }
+  g_watches.erase(g_watches.begin() + i);
+  return true;
+}
+
+void ShowWatches(bool ChangedOnly)
+{
+  std::vector<std::string> values;
+  EvaluateWatches(values);
+  for (size_t i = 0; i < g_watches.size(); i++) {
+    if (!ChangedOnly || values[i] != g_watches[i].last) {
+      PrintWatch(i, values[i]);
+    }
+    g_watches[i].last = values[i];
+  }
+}
@@ -0,0 +1,689 @@
+#include "mydbg.h"
+
+//
+// x86-32 instruction length decoder, enough to copy one instruction
+// elsewhere: prefixes, opcode, ModRM/SIB/displacement and immediate
+// sizes, and the target of relative branches. FormatX86 below gives the
+// mnemonics for the integer instruction set, the rest shows as opcode
+// bytes.
+//
+
+enum {
+  OP_NONE = 0,                          // Opcode only.
+  OP_MODRM = 1,                         // ModRM follows.
+  OP_IMM8 = 2,
+  OP_IMM16 = 4,
+  OP_IMMZ = 8,                          // 32 bits, 16 with operand size prefix.
+  OP_REL8 = 16,
+  OP_RELZ = 32,
+  OP_MOFFS = 64,                        // Address size offset.
+  OP_FAR = 128,                         // ptr16:32.
+  OP_GROUP3 = 256,                      // F6/F7, immediate only for /0 and /1.
+  OP_BAD = 512
+};
+
+#define M OP_MODRM
+#define MI8 (OP_MODRM | OP_IMM8)
+#define MIZ (OP_MODRM | OP_IMMZ)
+
+static const unsigned short s_oneByte[256] = {
+  // 00
+  M, M, M, M, OP_IMM8, OP_IMMZ, 0, 0, M, M, M, M, OP_IMM8, OP_IMMZ, 0, OP_BAD,
+  // 10
+  M, M, M, M, OP_IMM8, OP_IMMZ, 0, 0, M, M, M, M, OP_IMM8, OP_IMMZ, 0, 0,
+  // 20
+  M, M, M, M, OP_IMM8, OP_IMMZ, OP_BAD, 0, M, M, M, M, OP_IMM8, OP_IMMZ, OP_BAD, 0,
+  // 30
+  M, M, M, M, OP_IMM8, OP_IMMZ, OP_BAD, 0, M, M, M, M, OP_IMM8, OP_IMMZ, OP_BAD, 0,
+  // 40
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  // 50
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  // 60
+  0, 0, M, M, OP_BAD, OP_BAD, OP_BAD, OP_BAD, OP_IMMZ, MIZ, OP_IMM8, MI8, 0, 0, 0, 0,
+  // 70
+  OP_REL8, OP_REL8, OP_REL8, OP_REL8, OP_REL8, OP_REL8, OP_REL8, OP_REL8,
+  OP_REL8, OP_REL8, OP_REL8, OP_REL8, OP_REL8, OP_REL8, OP_REL8, OP_REL8,
+  // 80
+  MI8, MIZ, MI8, MI8, M, M, M, M, M, M, M, M, M, M, M, M,
+  // 90
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, OP_FAR, 0, 0, 0, 0, 0,
+  // A0
+  OP_MOFFS, OP_MOFFS, OP_MOFFS, OP_MOFFS, 0, 0, 0, 0, OP_IMM8, OP_IMMZ, 0, 0, 0, 0, 0, 0,
+  // B0
+  OP_IMM8, OP_IMM8, OP_IMM8, OP_IMM8, OP_IMM8, OP_IMM8, OP_IMM8, OP_IMM8,
+  OP_IMMZ, OP_IMMZ, OP_IMMZ, OP_IMMZ, OP_IMMZ, OP_IMMZ, OP_IMMZ, OP_IMMZ,
+  // C0
+  MI8, MI8, OP_IMM16, 0, M, M, MI8, MIZ, OP_IMM16 | OP_IMM8, 0, OP_IMM16, 0, 0, OP_IMM8, 0, 0,
+  // D0
+  M, M, M, M, OP_IMM8, OP_IMM8, 0, 0, M, M, M, M, M, M, M, M,
+  // E0
+  OP_REL8, OP_REL8, OP_REL8, OP_REL8, OP_IMM8, OP_IMM8, OP_IMM8, OP_IMM8,
+  OP_RELZ, OP_RELZ, OP_FAR, OP_REL8, 0, 0, 0, 0,
+  // F0
+  OP_BAD, 0, OP_BAD, OP_BAD, 0, 0, M | OP_GROUP3, M | OP_GROUP3, 0, 0, 0, 0, 0, 0, M, M
+};
+
+static const unsigned short s_twoByte[256] = {
+  // 0F 00
+  M, M, M, M, OP_BAD, 0, 0, 0, 0, 0, OP_BAD, 0, OP_BAD, M, 0, MI8,
+  // 0F 10
+  M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  // 0F 20
+  M, M, M, M, OP_BAD, OP_BAD, OP_BAD, OP_BAD, M, M, M, M, M, M, M, M,
+  // 0F 30
+  0, 0, 0, 0, 0, 0, OP_BAD, 0, OP_BAD, OP_BAD, OP_BAD, OP_BAD, OP_BAD, OP_BAD, OP_BAD, OP_BAD,
+  // 0F 40
+  M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  // 0F 50
+  M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  // 0F 60
+  M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  // 0F 70
+  MI8, MI8, MI8, MI8, M, M, M, 0, M, M, OP_BAD, OP_BAD, M, M, M, M,
+  // 0F 80
+  OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ,
+  OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ, OP_RELZ,
+  // 0F 90
+  M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  // 0F A0
+  0, 0, 0, M, MI8, M, OP_BAD, OP_BAD, 0, 0, 0, M, MI8, M, M, M,
+  // 0F B0
+  M, M, M, M, M, M, M, M, M, M, MI8, M, M, M, M, M,
+  // 0F C0
+  M, M, MI8, M, MI8, MI8, MI8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+  // 0F D0
+  M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  // 0F E0
+  M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+  // 0F F0
+  M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M
+};
+
+#undef M
+#undef MI8
+#undef MIZ
+
+static bool IsPrefix(unsigned char c)
+{
+  switch (c) {
+    case 0x26: case 0x2E: case 0x36: case 0x3E: case 0x64: case 0x65: // Segment.
+    case 0x66: case 0x67: case 0xF0: case 0xF2: case 0xF3:
+      return true;
+  }
+  return false;
+}
+
+bool DecodeX86(const unsigned char *code, size_t size, DWORD64 addr, X86_INST &inst)
+{
+  memset(&inst, 0, sizeof(inst));
+  inst.modrm = -1;
+  size_t n = 0;
+  bool opSize16 = false, addrSize16 = false;
+  while (n < size && n < 14 && IsPrefix(code[n])) {
+    opSize16 |= 0x66 == code[n];
+    addrSize16 |= 0x67 == code[n];
+    n++;
+  }
+  inst.opcode = (int)n;
+  if (n >= size) {
+    return false;
+  }
+
+  unsigned int flags;
+  unsigned char op = code[n++];
+  if (0x0F != op) {
+    flags = s_oneByte[op];
+    if (0x70 <= op && 0x7F >= op) {
+      inst.kind = X86_JCC;
+    } else if (0xEB == op || 0xE9 == op) {
+      inst.kind = X86_JMP;
+    } else if (0xE8 == op) {
+      inst.kind = X86_CALL;
+    } else if (0xE0 <= op && 0xE3 >= op) {
+      inst.kind = X86_LOOP;
+    } else if (0x9A == op || 0xEA == op) {
+      inst.kind = X86_FAR;
+    }
+  } else {
+    if (n >= size) {
+      return false;
+    }
+    op = code[n++];
+    flags = s_twoByte[op];
+    if (0x38 == op || 0x3A == op) {     // Three byte opcode maps.
+      if (n >= size) {
+        return false;
+      }
+      n++;
+      flags = OP_MODRM | (0x3A == op ? OP_IMM8 : 0);
+    } else if (0x80 <= op && 0x8F >= op) {
+      inst.kind = X86_JCC;
+    }
+  }
+  if (flags & OP_BAD) {
+    return false;
+  }
+
+  if (flags & OP_MODRM) {
+    if (n >= size) {
+      return false;
+    }
+    inst.modrm = (int)n;
+    unsigned char modrm = code[n++];
+    int mod = modrm >> 6, reg = (modrm >> 3) & 7, rm = modrm & 7;
+    if (0xFF == code[inst.opcode] && 2 == reg) {
+      inst.kind = X86_CALL_INDIRECT;
+    } else if (0xFF == code[inst.opcode] && 3 == reg) {
+      inst.kind = X86_FAR;              // CALL FAR m16:32.
+    }
+    if (flags & OP_GROUP3) {
+      if (0 == reg || 1 == reg) {
+        flags |= 0xF6 == code[inst.opcode] ? OP_IMM8 : OP_IMMZ;
+      }
+    }
+    if (3 == mod) {
+      inst.usesEsp = 4 == rm;
+    } else if (addrSize16) {
+      if (1 == mod) {
+        n += 1;
+      } else if (2 == mod || (0 == mod && 6 == rm)) {
+        n += 2;
+      }
+    } else {
+      if (4 == rm) {
+        if (n >= size) {
+          return false;
+        }
+        unsigned char sib = code[n++];
+        inst.usesEsp = 4 == (sib & 7);
+        if (0 == mod && 5 == (sib & 7)) {
+          n += 4;
+        }
+      } else if (0 == mod && 5 == rm) {
+        n += 4;
+      }
+      if (1 == mod) {
+        n += 1;
+      } else if (2 == mod) {
+        n += 4;
+      }
+    }
+  }
+
+  int immz = opSize16 ? 2 : 4;
+  if (flags & OP_IMM16) {
+    n += 2;
+  }
+  if (flags & OP_IMM8) {
+    n += 1;
+  }
+  if (flags & OP_IMMZ) {
+    n += immz;
+  }
+  if (flags & OP_MOFFS) {
+    n += addrSize16 ? 2 : 4;
+  }
+  if (flags & OP_FAR) {
+    n += immz + 2;
+  }
+  if (flags & OP_REL8) {
+    if (n + 1 > size) {
+      return false;
+    }
+    inst.target = addr + n + 1 + (signed char)code[n];
+    n += 1;
+  }
+  if (flags & OP_RELZ) {
+    if (opSize16 || n + 4 > size) {
+      return false;                     // rel16 truncates EIP, not seen in practice.
+    }
+    inst.target = (DWORD)(addr + n + 4 + *(const LONG*)&code[n]);
+    n += 4;
+  }
+  if (n > size || 15 < n) {
+    return false;
+  }
+  inst.length = (int)n;
+  return true;
+}
+
+static unsigned char* PutRel32(unsigned char *p, unsigned char op, DWORD64 from, DWORD64 target)
+{
+  *p++ = op;
+  *(LONG*)p = (LONG)(target - (from + 5));
+  return p + 4;
+}
+
+int RelocateX86(const X86_INST &inst, const unsigned char *code, DWORD64 addr, DWORD64 to, unsigned char *out)
+{
+  //
+  // The instruction rewritten to run at 'to', followed by a jump back to
+  // the next one. Relative branches are widened to rel32 to their real
+  // target, calls push the real return address. 0 if it can't move.
+  //
+
+  DWORD64 next = addr + inst.length;
+  unsigned char *p = out;
+  switch (inst.kind) {
+    case X86_PLAIN:
+      memcpy(p, code, inst.length);
+      p += inst.length;
+      break;
+    case X86_JMP:
+      p = PutRel32(p, 0xE9, to, inst.target);
+      break;
+    case X86_JCC:
+      *p++ = 0x0F;                      // Jcc rel32, same condition.
+      p = PutRel32(p, 0x80 | (code[inst.opcode + (0x0F == code[inst.opcode] ? 1 : 0)] & 0x0F), to + 1, inst.target);
+      break;
+    case X86_CALL:
+      *p++ = 0x68;                      // PUSH imm32, the real return address.
+      *(DWORD*)p = (DWORD)next;
+      p += 4;
+      p = PutRel32(p, 0xE9, to + (p - out), inst.target);
+      break;
+    case X86_CALL_INDIRECT:
+      if (inst.usesEsp) {
+        return 0;                       // Push would move the operand.
+      }
+      *p++ = 0x68;
+      *(DWORD*)p = (DWORD)next;
+      p += 4;
+      memcpy(p, code, inst.length);
+      p[inst.modrm] ^= (2 ^ 4) << 3;    // FF /2 to FF /4, JMP.
+      p += inst.length;
+      break;
+    default:
+      return 0;                         // LOOP/JECXZ rel8 and far transfers.
+  }
+  p = PutRel32(p, 0xE9, to + (p - out), next);
+  return (int)(p - out);
+}
+
+//
+// Mnemonics. Operands of the one byte map in Intel order, groups named by
+// the ModRM reg field.
+//
+
+enum {
+  A_NONE = 0,
+  A_EB, A_EV, A_EW,                     // ModRM r/m.
+  A_GB, A_GV, A_GW,                     // ModRM reg.
+  A_SW,                                 // ModRM reg, segment register.
+  A_M,                                  // ModRM memory, no size (lea).
+  A_IB, A_IBS, A_IW, A_IZ,              // Immediates, IBS sign extended.
+  A_JB, A_JZ,                           // Relative targets.
+  A_AL, A_EAX, A_CL, A_DX, A_ONE,
+  A_OB, A_OV,                           // moffs.
+  A_ZB, A_ZV,                           // Register in the opcode's low bits.
+  A_AP                                  // ptr16:32.
+};
+
+struct X86_FORMAT
+{
+  const char *name;                     // NULL: prefix, 0F or group.
+  unsigned char a[3];
+};
+
+#define ALU(n) {n, {A_EB, A_GB}}, {n, {A_EV, A_GV}}, {n, {A_GB, A_EB}}, {n, {A_GV, A_EV}}, {n, {A_AL, A_IB}}, {n, {A_EAX, A_IZ}}
+#define R8(n, a1, a2) {n, {a1, a2}}, {n, {a1, a2}}, {n, {a1, a2}}, {n, {a1, a2}}, {n, {a1, a2}}, {n, {a1, a2}}, {n, {a1, a2}}, {n, {a1, a2}}
+
+static const X86_FORMAT s_oneByteFormat[256] = {
+  // 00
+  ALU("add"), {"push es"}, {"pop es"}, ALU("or"), {"push cs"}, {NULL},
+  // 10
+  ALU("adc"), {"push ss"}, {"pop ss"}, ALU("sbb"), {"push ds"}, {"pop ds"},
+  // 20
+  ALU("and"), {NULL}, {"daa"}, ALU("sub"), {NULL}, {"das"},
+  // 30
+  ALU("xor"), {NULL}, {"aaa"}, ALU("cmp"), {NULL}, {"aas"},
+  // 40
+  R8("inc", A_ZV, A_NONE), R8("dec", A_ZV, A_NONE),
+  // 50
+  R8("push", A_ZV, A_NONE), R8("pop", A_ZV, A_NONE),
+  // 60
+  {"pushad"}, {"popad"}, {"bound", {A_GV, A_M}}, {"arpl", {A_EW, A_GW}}, {NULL}, {NULL}, {NULL}, {NULL},
+  {"push", {A_IZ}}, {"imul", {A_GV, A_EV, A_IZ}}, {"push", {A_IBS}}, {"imul", {A_GV, A_EV, A_IBS}},
+  {"insb"}, {"insd"}, {"outsb"}, {"outsd"},
+  // 70
+  {"jo", {A_JB}}, {"jno", {A_JB}}, {"jb", {A_JB}}, {"jae", {A_JB}}, {"je", {A_JB}}, {"jne", {A_JB}}, {"jbe", {A_JB}}, {"ja", {A_JB}},
+  {"js", {A_JB}}, {"jns", {A_JB}}, {"jp", {A_JB}}, {"jnp", {A_JB}}, {"jl", {A_JB}}, {"jge", {A_JB}}, {"jle", {A_JB}}, {"jg", {A_JB}},
+  // 80
+  {NULL}, {NULL}, {NULL}, {NULL}, {"test", {A_EB, A_GB}}, {"test", {A_EV, A_GV}}, {"xchg", {A_EB, A_GB}}, {"xchg", {A_EV, A_GV}},
+  {"mov", {A_EB, A_GB}}, {"mov", {A_EV, A_GV}}, {"mov", {A_GB, A_EB}}, {"mov", {A_GV, A_EV}},
+  {"mov", {A_EW, A_SW}}, {"lea", {A_GV, A_M}}, {"mov", {A_SW, A_EW}}, {"pop", {A_EV}},
+  // 90
+  {"nop"}, {"xchg", {A_ZV, A_EAX}}, {"xchg", {A_ZV, A_EAX}}, {"xchg", {A_ZV, A_EAX}},
+  {"xchg", {A_ZV, A_EAX}}, {"xchg", {A_ZV, A_EAX}}, {"xchg", {A_ZV, A_EAX}}, {"xchg", {A_ZV, A_EAX}},
+  {"cwde"}, {"cdq"}, {"call", {A_AP}}, {"wait"}, {"pushfd"}, {"popfd"}, {"sahf"}, {"lahf"},
+  // A0
+  {"mov", {A_AL, A_OB}}, {"mov", {A_EAX, A_OV}}, {"mov", {A_OB, A_AL}}, {"mov", {A_OV, A_EAX}},
+  {"movsb"}, {"movsd"}, {"cmpsb"}, {"cmpsd"}, {"test", {A_AL, A_IB}}, {"test", {A_EAX, A_IZ}},
+  {"stosb"}, {"stosd"}, {"lodsb"}, {"lodsd"}, {"scasb"}, {"scasd"},
+  // B0
+  R8("mov", A_ZB, A_IB), R8("mov", A_ZV, A_IZ),
+  // C0
+  {NULL}, {NULL}, {"ret", {A_IW}}, {"ret"}, {"les", {A_GV, A_M}}, {"lds", {A_GV, A_M}}, {"mov", {A_EB, A_IB}}, {"mov", {A_EV, A_IZ}},
+  {"enter", {A_IW, A_IB}}, {"leave"}, {"retf", {A_IW}}, {"retf"}, {"int3"}, {"int", {A_IB}}, {"into"}, {"iretd"},
+  // D0
+  {NULL}, {NULL}, {NULL}, {NULL}, {"aam", {A_IB}}, {"aad", {A_IB}}, {"salc"}, {"xlatb"},
+  {"(x87)"}, {"(x87)"}, {"(x87)"}, {"(x87)"}, {"(x87)"}, {"(x87)"}, {"(x87)"}, {"(x87)"},
+  // E0
+  {"loopne", {A_JB}}, {"loope", {A_JB}}, {"loop", {A_JB}}, {"jecxz", {A_JB}},
+  {"in", {A_AL, A_IB}}, {"in", {A_EAX, A_IB}}, {"out", {A_IB, A_AL}}, {"out", {A_IB, A_EAX}},
+  {"call", {A_JZ}}, {"jmp", {A_JZ}}, {"jmp", {A_AP}}, {"jmp", {A_JB}},
+  {"in", {A_AL, A_DX}}, {"in", {A_EAX, A_DX}}, {"out", {A_DX, A_AL}}, {"out", {A_DX, A_EAX}},
+  // F0
+  {NULL}, {"int1"}, {NULL}, {NULL}, {"hlt"}, {"cmc"}, {NULL}, {NULL},
+  {"clc"}, {"stc"}, {"cli"}, {"sti"}, {"cld"}, {"std"}, {NULL}, {NULL}
+};
+
+#undef ALU
+#undef R8
+
+static const char *s_group1[8] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"};
+static const char *s_group2[8] = {"rol", "ror", "rcl", "rcr", "shl", "shr", "sal", "sar"};
+static const char *s_group3[8] = {"test", "test", "not", "neg", "mul", "imul", "div", "idiv"};
+static const char *s_group5[8] = {"inc", "dec", "call", "call far", "jmp", "jmp far", "push", NULL};
+static const char *s_cc[16] = {"o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g"};
+
+static const char *s_reg8[8] = {"al", "cl", "dl", "bl", "ah", "ch", "dh", "bh"};
+static const char *s_reg16[8] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+static const char *s_reg32[8] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
+static const char *s_sreg[8] = {"es", "cs", "ss", "ds", "fs", "gs", "?", "?"};
+
+static void AppendHex(std::string &text, DWORD v)
+{
+  char buff[16];
+  sprintf(buff, 10 > v ? "%u" : "0x%x", v);
+  text += buff;
+}
+
+static bool FindTwoByteFormat(unsigned char op, X86_FORMAT &fmt, char *name)
+{
+  static const struct {
+    unsigned char op;
+    X86_FORMAT fmt;
+  } s_twoByteFormat[] = {
+    {0x0B, {"ud2"}}, {0x1F, {"nop", {A_EV}}}, {0x31, {"rdtsc"}}, {0xA0, {"push fs"}}, {0xA1, {"pop fs"}},
+    {0xA2, {"cpuid"}}, {0xA3, {"bt", {A_EV, A_GV}}}, {0xA4, {"shld", {A_EV, A_GV, A_IB}}}, {0xA5, {"shld", {A_EV, A_GV, A_CL}}},
+    {0xA8, {"push gs"}}, {0xA9, {"pop gs"}}, {0xAB, {"bts", {A_EV, A_GV}}}, {0xAC, {"shrd", {A_EV, A_GV, A_IB}}},
+    {0xAD, {"shrd", {A_EV, A_GV, A_CL}}}, {0xAF, {"imul", {A_GV, A_EV}}}, {0xB0, {"cmpxchg", {A_EB, A_GB}}},
+    {0xB1, {"cmpxchg", {A_EV, A_GV}}}, {0xB3, {"btr", {A_EV, A_GV}}}, {0xB6, {"movzx", {A_GV, A_EB}}},
+    {0xB7, {"movzx", {A_GV, A_EW}}}, {0xBB, {"btc", {A_EV, A_GV}}}, {0xBC, {"bsf", {A_GV, A_EV}}},
+    {0xBD, {"bsr", {A_GV, A_EV}}}, {0xBE, {"movsx", {A_GV, A_EB}}}, {0xBF, {"movsx", {A_GV, A_EW}}},
+    {0xC0, {"xadd", {A_EB, A_GB}}}, {0xC1, {"xadd", {A_EV, A_GV}}}
+  };
+
+  memset(&fmt, 0, sizeof(fmt));
+  if (0x80 <= op && 0x8F >= op) {
+    sprintf(name, "j%s", s_cc[op & 0x0F]);
+    fmt.a[0] = A_JZ;
+  } else if (0x90 <= op && 0x9F >= op) {
+    sprintf(name, "set%s", s_cc[op & 0x0F]);
+    fmt.a[0] = A_EB;
+  } else if (0x40 <= op && 0x4F >= op) {
+    sprintf(name, "cmov%s", s_cc[op & 0x0F]);
+    fmt.a[0] = A_GV;
+    fmt.a[1] = A_EV;
+  } else if (0xC8 <= op && 0xCF >= op) {
+    strcpy(name, "bswap");
+    fmt.a[0] = A_ZV;
+  } else {
+    for (size_t i = 0; i < sizeof(s_twoByteFormat) / sizeof(s_twoByteFormat[0]); i++) {
+      if (s_twoByteFormat[i].op == op) {
+        fmt = s_twoByteFormat[i].fmt;
+        return true;
+      }
+    }
+    return false;
+  }
+  fmt.name = name;
+  return true;
+}
+
+static bool FindGroupFormat(unsigned char op, int reg, X86_FORMAT &fmt)
+{
+  memset(&fmt, 0, sizeof(fmt));
+  switch (op) {
+    case 0x80: case 0x82: fmt.name = s_group1[reg]; fmt.a[0] = A_EB; fmt.a[1] = A_IB; break;
+    case 0x81: fmt.name = s_group1[reg]; fmt.a[0] = A_EV; fmt.a[1] = A_IZ; break;
+    case 0x83: fmt.name = s_group1[reg]; fmt.a[0] = A_EV; fmt.a[1] = A_IBS; break;
+    case 0xC0: fmt.name = s_group2[reg]; fmt.a[0] = A_EB; fmt.a[1] = A_IB; break;
+    case 0xC1: fmt.name = s_group2[reg]; fmt.a[0] = A_EV; fmt.a[1] = A_IB; break;
+    case 0xD0: fmt.name = s_group2[reg]; fmt.a[0] = A_EB; fmt.a[1] = A_ONE; break;
+    case 0xD1: fmt.name = s_group2[reg]; fmt.a[0] = A_EV; fmt.a[1] = A_ONE; break;
+    case 0xD2: fmt.name = s_group2[reg]; fmt.a[0] = A_EB; fmt.a[1] = A_CL; break;
+    case 0xD3: fmt.name = s_group2[reg]; fmt.a[0] = A_EV; fmt.a[1] = A_CL; break;
+    case 0xF6: fmt.name = s_group3[reg]; fmt.a[0] = A_EB; fmt.a[1] = 2 > reg ? A_IB : A_NONE; break;
+    case 0xF7: fmt.name = s_group3[reg]; fmt.a[0] = A_EV; fmt.a[1] = 2 > reg ? A_IZ : A_NONE; break;
+    case 0xFE: fmt.name = 2 > reg ? s_group5[reg] : NULL; fmt.a[0] = A_EB; break;
+    case 0xFF: fmt.name = s_group5[reg]; fmt.a[0] = 3 == reg || 5 == reg ? A_M : A_EV; break;
+  }
+  return NULL != fmt.name;
+}
+
+static void FormatMemory(const unsigned char *code, const X86_INST &inst, bool addrSize16, const char *seg, const char *size, std::string &text)
+{
+  const unsigned char *p = code + inst.modrm;
+  int mod = *p >> 6, rm = *p & 7;
+  p++;
+  std::string base;
+  LONG disp = 0;
+  if (addrSize16) {
+    static const char *s_base16[8] = {"bx+si", "bx+di", "bp+si", "bp+di", "si", "di", "bp", "bx"};
+    if (0 == mod && 6 == rm) {
+      disp = *(const WORD*)p;
+    } else {
+      base = s_base16[rm];
+      disp = 1 == mod ? (signed char)*p : 2 == mod ? *(const short*)p : 0;
+    }
+  } else {
+    if (4 == rm) {
+      unsigned char sib = *p++;
+      int index = (sib >> 3) & 7;
+      if (0 == mod && 5 == (sib & 7)) {
+        disp = *(const LONG*)p;
+      } else {
+        base = s_reg32[sib & 7];
+      }
+      if (4 != index) {
+        base += base.empty() ? "" : "+";
+        base += s_reg32[index];
+        if (sib >> 6) {
+          base += "*";
+          base += (char)('0' + (1 << (sib >> 6)));
+        }
+      }
+    } else if (0 == mod && 5 == rm) {
+      disp = *(const LONG*)p;
+    } else {
+      base = s_reg32[rm];
+    }
+    if (1 == mod) {
+      disp = (signed char)*p;
+    } else if (2 == mod) {
+      disp = *(const LONG*)p;
+    }
+  }
+
+  if (size) {
+    text += size;
+    text += " ptr ";
+  }
+  if (seg || base.empty()) {
+    text += seg ? seg : "ds";
+    text += ":";
+  }
+  text += "[";
+  text += base;
+  if (base.empty()) {
+    AppendHex(text, (DWORD)disp);
+  } else if (0 > disp) {
+    text += "-";
+    AppendHex(text, (DWORD)-disp);
+  } else if (0 < disp) {
+    text += "+";
+    AppendHex(text, (DWORD)disp);
+  }
+  text += "]";
+}
+
+void FormatX86(const X86_INST &inst, const unsigned char *code, std::string &text)
+{
+  //
+  // Intel syntax, immediates and displacements in hex, branch targets as
+  // absolute addresses.
+  //
+
+  bool opSize16 = false, addrSize16 = false;
+  const char *seg = NULL, *rep = NULL;
+  for (int i = 0; i < inst.opcode; i++) {
+    switch (code[i]) {
+      case 0x26: seg = "es"; break;
+      case 0x2E: seg = "cs"; break;
+      case 0x36: seg = "ss"; break;
+      case 0x3E: seg = "ds"; break;
+      case 0x64: seg = "fs"; break;
+      case 0x65: seg = "gs"; break;
+      case 0x66: opSize16 = true; break;
+      case 0x67: addrSize16 = true; break;
+      case 0xF0: rep = "lock "; break;
+      case 0xF2: rep = "repne "; break;
+      case 0xF3: rep = "rep "; break;
+    }
+  }
+
+  X86_FORMAT fmt;
+  char name[16];
+  unsigned char op = code[inst.opcode];
+  int reg = 0 <= inst.modrm ? (code[inst.modrm] >> 3) & 7 : 0;
+  bool known;
+  if (0x0F == op) {
+    op = code[inst.opcode + 1];
+    known = FindTwoByteFormat(op, fmt, name);
+    if (!known) {
+      sprintf(name, "(0f %02x)", op);
+    }
+  } else if (s_oneByteFormat[op].name) {
+    fmt = s_oneByteFormat[op];
+    known = true;
+  } else {
+    known = FindGroupFormat(op, reg, fmt);
+    if (!known) {
+      sprintf(name, "(%02x /%d)", op, reg);
+    }
+  }
+  text.clear();
+  if (rep) {
+    text += rep;
+  }
+  if (!known) {
+    text += name;
+    return;
+  }
+  text += fmt.name;
+
+  //
+  // Immediates are the instruction's last bytes, in operand order.
+  //
+
+  int immz = opSize16 ? 2 : 4;
+  int imm = 0;
+  for (int i = 0; i < 3; i++) {
+    switch (fmt.a[i]) {
+      case A_IB: case A_IBS: case A_JB: imm += 1; break;
+      case A_IW: imm += 2; break;
+      case A_IZ: imm += immz; break;
+      case A_JZ: imm += 4; break;
+      case A_OB: case A_OV: imm += addrSize16 ? 2 : 4; break;
+      case A_AP: imm += immz + 2; break;
+    }
+  }
+  const unsigned char *p = code + inst.length - imm;
+
+  const char **regv = opSize16 ? s_reg16 : s_reg32;
+  const char *sizev = opSize16 ? "word" : "dword";
+  int rm = 0 <= inst.modrm ? code[inst.modrm] & 7 : 0;
+  bool regOperand = 0 <= inst.modrm && 3 == code[inst.modrm] >> 6;
+  for (int i = 0; i < 3 && A_NONE != fmt.a[i]; i++) {
+    text += 0 == i ? " " : ",";
+    switch (fmt.a[i]) {
+      case A_EB:
+        if (regOperand) {
+          text += s_reg8[rm];
+        } else {
+          FormatMemory(code, inst, addrSize16, seg, "byte", text);
+        }
+        break;
+      case A_EV:
+        if (regOperand) {
+          text += regv[rm];
+        } else {
+          FormatMemory(code, inst, addrSize16, seg, sizev, text);
+        }
+        break;
+      case A_EW:
+        if (regOperand) {
+          text += s_reg16[rm];
+        } else {
+          FormatMemory(code, inst, addrSize16, seg, "word", text);
+        }
+        break;
+      case A_M:
+        if (regOperand) {
+          text += regv[rm];
+        } else {
+          FormatMemory(code, inst, addrSize16, seg, NULL, text);
+        }
+        break;
+      case A_GB: text += s_reg8[reg]; break;
+      case A_GV: text += regv[reg]; break;
+      case A_GW: text += s_reg16[reg]; break;
+      case A_SW: text += s_sreg[reg]; break;
+      case A_IB: AppendHex(text, *p++); break;
+      case A_IBS:
+        if (0 > (signed char)*p) {
+          text += "-";
+          AppendHex(text, (DWORD)-(signed char)*p);
+        } else {
+          AppendHex(text, *p);
+        }
+        p++;
+        break;
+      case A_IW: AppendHex(text, *(const WORD*)p); p += 2; break;
+      case A_IZ: AppendHex(text, opSize16 ? *(const WORD*)p : *(const DWORD*)p); p += immz; break;
+      case A_JB: case A_JZ:
+        {
+          char buff[16];
+          sprintf(buff, "0x%08x", (unsigned int)inst.target);
+          text += buff;
+          p += A_JB == fmt.a[i] ? 1 : 4;
+        }
+        break;
+      case A_AL: text += "al"; break;
+      case A_EAX: text += regv[0]; break;
+      case A_CL: text += "cl"; break;
+      case A_DX: text += "dx"; break;
+      case A_ONE: text += "1"; break;
+      case A_OB: case A_OV:
+        text += A_OB == fmt.a[i] ? "byte" : sizev;
+        text += " ptr ";
+        text += seg ? seg : "ds";
+        text += ":[";
+        AppendHex(text, addrSize16 ? *(const WORD*)p : *(const DWORD*)p);
+        text += "]";
+        p += addrSize16 ? 2 : 4;
+        break;
+      case A_ZB: text += s_reg8[op & 7]; break;
+      case A_ZV: text += regv[op & 7]; break;
+      case A_AP:
+        AppendHex(text, *(const WORD*)(p + immz));
+        text += ":";
+        AppendHex(text, opSize16 ? *(const WORD*)p : *(const DWORD*)p);
+        p += immz + 2;
+        break;
+    }
+  }
+}